@@ -0,0 +1,107 @@
+#include "ChannelScheduler.hh"
+#include <map>
+
+// Declared weak, so that we can check at runtime whether we're linked to OpenBLAS,
+// and if so, how it was built.
+extern "C"
+{
+  int openblas_get_parallel(void) __attribute__((weak));
+  int openblas_get_num_threads(void) __attribute__((weak));
+  void openblas_set_num_threads(int) __attribute__((weak));
+}
+
+int ChannelScheduler::serial_blas_depth = 0;
+int ChannelScheduler::blas_threads = 1;
+
+
+/// Indices of cost, sorted from most to least expensive.
+/// Channels with equal cost keep their original order.
+vector<int> ChannelScheduler::SortByCost(const vector<double>& cost)
+{
+  vector<int> order(cost.size());
+  for (size_t i=0; i<order.size(); ++i) order[i] = i;
+  stable_sort(order.begin(), order.end(), [&cost](int i, int j){ return cost[i] > cost[j]; } );
+  return order;
+}
+
+
+/// Group the indices of shapes (rows, inner dimension, columns of a matrix product) into buckets.
+/// Products with all dimensions at most max_small are put together with the others of the same shape.
+/// Everything else gets a bucket of its own.
+vector<vector<int>> ChannelScheduler::BucketByShape(const vector<array<int,3>>& shapes, int max_small)
+{
+  vector<vector<int>> buckets;
+  map<array<int,3>,int> small_bucket;
+  for (size_t i=0; i<shapes.size(); ++i)
+  {
+    const array<int,3>& shape = shapes[i];
+    if ( *max_element(shape.begin(),shape.end()) > max_small )
+    {
+      buckets.push_back( {int(i)} );
+      continue;
+    }
+    if ( small_bucket.find(shape) == small_bucket.end() )
+    {
+      small_bucket[shape] = buckets.size();
+      buckets.push_back( {} );
+    }
+    buckets[small_bucket[shape]].push_back(i);
+  }
+  return buckets;
+}
+
+
+/// Indices of the channels which cost more than a thread's share of the total, most expensive first.
+/// In a loop dominated by BLAS, each of these is better off on its own with all the threads given to BLAS.
+vector<int> ChannelScheduler::BigChannels(const vector<double>& cost)
+{
+  vector<int> big;
+  int nthreads = omp_get_max_threads();
+  if (nthreads<2) return big;
+  double total = accumulate(cost.begin(), cost.end(), 0.0);
+  for (int i : SortByCost(cost))
+  {
+    if (cost[i] <= total/nthreads) break;
+    big.push_back(i);
+  }
+  return big;
+}
+
+
+void ChannelScheduler::ChannelLocks::Resize(size_t n)
+{
+  for (auto& lock : locks) omp_destroy_lock(&lock);
+  locks.resize(n);
+  for (auto& lock : locks) omp_init_lock(&lock);
+}
+
+
+/// openblas_get_parallel() returns 0 for a sequential build, 1 for pthreads and 2 for OpenMP.
+/// Only a pthreads build needs to be told to stay serial. The thread count is global,
+/// so it is only changed by the outermost SerialBLAS, and restored when that one goes away.
+ChannelScheduler::SerialBLAS::SerialBLAS()
+: active( openblas_get_parallel != NULL and openblas_set_num_threads != NULL
+          and openblas_get_num_threads != NULL and openblas_get_parallel()==1 )
+{
+  if (not active) return;
+  #pragma omp critical(SerialBLAS)
+  {
+    if (serial_blas_depth++ == 0)
+    {
+      blas_threads = openblas_get_num_threads();
+      openblas_set_num_threads(1);
+    }
+  }
+}
+
+ChannelScheduler::SerialBLAS::~SerialBLAS()
+{
+  if (not active) return;
+  #pragma omp critical(SerialBLAS)
+  {
+    if (--serial_blas_depth == 0)
+    {
+      openblas_set_num_threads(blas_threads);
+    }
+  }
+}
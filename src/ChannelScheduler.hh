@@ -0,0 +1,136 @@
+#ifndef ChannelScheduler_h
+#define ChannelScheduler_h 1
+
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <array>
+#include <omp.h>
+
+using namespace std;
+
+/// Runs loops over two-body channels in parallel, using an estimate of the cost of each channel
+/// (e.g. \f$ d^3 \f$ for a matrix multiplication, where \f$ d \f$ is the channel dimension).
+///
+/// The channels are handed out most expensive first, so that the cheap ones fill in
+/// the tail: an idle thread takes the next channel from the shared queue of the dynamic schedule.
+/// For loops dominated by matrix multiplication, any channel which costs more than
+/// a thread's share of the total is done on its own beforehand, with all the threads given to BLAS.
+/// The remaining channels are then done concurrently, each with single-threaded BLAS.
+/// This replaces the compile-time choice between OpenMP and BLAS threading (OPENBLAS_NOUSEOMP).
+///
+/// If called from inside a parallel region (e.g. from a task), the loop is turned into a taskloop.
+/// BLAS can't have the threads there, so a caller which runs channel loops from tasks should
+/// first do the BigChannels() itself, outside the parallel region, and pass them to Run() as done.
+///
+/// Small channels can also be grouped into buckets of equal shape with BucketByShape(),
+/// so that a whole bucket is handed out as a single piece of work by RunBuckets().
+class ChannelScheduler
+{
+ public:
+  template <class Body>
+  static void Run(const vector<double>& cost, Body body, bool blas_bound=false, const vector<int>& done=vector<int>());
+  template <class Body>
+  static void RunBuckets(const vector<vector<int>>& buckets, const vector<double>& cost, Body body, bool blas_bound=false, const vector<int>& done=vector<int>());
+  static vector<vector<int>> BucketByShape(const vector<array<int,3>>& shapes, int max_small);
+  static vector<int> BigChannels(const vector<double>& cost);
+
+  /// Within the lifetime of a SerialBLAS object, BLAS calls use a single thread.
+  /// This only does something for a pthreads build of OpenBLAS, since an OpenMP build
+  /// of OpenBLAS (or MKL) already runs serially when called inside a parallel region.
+  class SerialBLAS
+  {
+   public:
+    SerialBLAS();
+    ~SerialBLAS();
+   private:
+    bool active;
+  };
+
+  /// One lock per channel, for tasks which add into the same channels of an operator at the same time.
+  class ChannelLocks
+  {
+   public:
+    ChannelLocks() {};
+    ~ChannelLocks() {Resize(0);};
+    ChannelLocks(const ChannelLocks&) = delete;
+    ChannelLocks& operator=(const ChannelLocks&) = delete;
+    void Resize(size_t n);
+    bool empty() const {return locks.empty();};
+
+    /// Holds the lock of channel ch while it exists. Does nothing if there are no locks.
+    class Guard
+    {
+     public:
+      Guard(ChannelLocks& l, size_t ch) : locks(l.empty() ? NULL : &l), ch(ch) { if (locks) omp_set_lock(&locks->locks[ch]); };
+      ~Guard() { if (locks) omp_unset_lock(&locks->locks[ch]); };
+     private:
+      ChannelLocks* locks;
+      size_t ch;
+    };
+
+   private:
+    vector<omp_lock_t> locks;
+  };
+
+ private:
+  static int serial_blas_depth; ///< Number of SerialBLAS objects currently alive
+  static int blas_threads; ///< Number of BLAS threads to restore when the last SerialBLAS goes away
+  static vector<int> SortByCost(const vector<double>& cost);
+};
+
+
+/// Call body(i) for each i in [0,cost.size()), where cost[i] is the estimated cost of body(i),
+/// except for the ones in done.
+/// Set blas_bound if the body is dominated by BLAS calls.
+template <class Body>
+void ChannelScheduler::Run(const vector<double>& cost, Body body, bool blas_bound, const vector<int>& done)
+{
+  vector<int> order = SortByCost(cost);
+  if (not done.empty())
+  {
+    order.erase( remove_if(order.begin(), order.end(), [&done](int i){ return find(done.begin(),done.end(),i) != done.end(); }), order.end() );
+  }
+  int n = order.size();
+  if (omp_in_parallel())
+  {
+    #pragma omp taskloop grainsize(1)
+    for (int i=0; i<n; ++i) body(order[i]);
+    return;
+  }
+
+  int nbig = 0;
+  if (blas_bound)
+  {
+    vector<int> big = BigChannels(cost);
+    while (nbig<n and find(big.begin(),big.end(),order[nbig]) != big.end()) ++nbig;
+    for (int i=0; i<nbig; ++i) body(order[i]);
+  }
+
+  SerialBLAS serial_blas;
+  #pragma omp parallel for schedule(dynamic,1)
+  for (int i=nbig; i<n; ++i) body(order[i]);
+}
+
+
+/// Call body(i) for each i in the buckets, where cost[i] is the estimated cost of body(i).
+/// The channels in a bucket are done one after the other, by the same thread.
+/// The channels in done are skipped.
+template <class Body>
+void ChannelScheduler::RunBuckets(const vector<vector<int>>& buckets, const vector<double>& cost, Body body, bool blas_bound, const vector<int>& done)
+{
+  vector<vector<int>> todo(buckets.size());
+  vector<double> bucket_cost(buckets.size(),0.0);
+  for (size_t ib=0; ib<buckets.size(); ++ib)
+  {
+    for (int i : buckets[ib])
+    {
+      if (find(done.begin(),done.end(),i) != done.end()) continue;
+      todo[ib].push_back(i);
+      bucket_cost[ib] += cost[i];
+    }
+  }
+  Run( bucket_cost, [&](int ib){ for (int i : todo[ib]) body(i); }, blas_bound);
+}
+
+#endif
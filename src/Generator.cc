@@ -23,6 +23,9 @@ void Generator::AddToEta(Operator * H_s, Operator * Eta_s)
    H = H_s;
    Eta = Eta_s;
    modelspace = H->GetModelSpace();
+   // The generators record which two-body blocks they fill, but if Eta already
+   // has something without a known structure in it, that's no longer valid.
+   bool unstructured_Eta = Eta->TwoBodyKetClasses.empty() and Eta->TwoBodyNorm() > 0;
         if (generator_type == "wegner")           ConstructGenerator_Wegner(); // never tested, probably doesn't work.
    else if (generator_type == "white")            ConstructGenerator_White();
    else if (generator_type == "atan")             ConstructGenerator_Atan();
@@ -35,6 +38,7 @@ void Generator::AddToEta(Operator * H_s, Operator * Eta_s)
    {
       cout << "Error. Unkown generator_type: " << generator_type << endl;
    }
+   if (unstructured_Eta) Eta->TwoBodyKetClasses.clear();
    Eta->profiler.timer["UpdateEta"] += omp_get_wtime() - start_time;
 }
 
@@ -148,6 +152,7 @@ void Generator::ConstructGenerator_White()
    }
 
    // Two body piece -- eliminate pp'hh' bits
+   Eta->AddTwoBodyKetClasses( {"qq","vv","qv"}, {"cc"} );
    for (int ch=0;ch<Eta->nChannels;++ch)
    {
       TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
@@ -184,6 +189,7 @@ void Generator::ConstructGenerator_Atan()
    }
 
    // Two body piece -- eliminate pp'hh' bits
+   Eta->AddTwoBodyKetClasses( {"qq","vv","qv"}, {"cc"} );
    for (int ch=0;ch<Eta->nChannels;++ch)
    {
       TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
@@ -219,6 +225,7 @@ void Generator::ConstructGenerator_ImaginaryTime()
    }
 
    // Two body piece -- eliminate pp'hh' bits
+   Eta->AddTwoBodyKetClasses( {"qq","vv","qv"}, {"cc"} );
    for (int ch=0;ch<Eta->nChannels;++ch)
    {
       TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
@@ -256,6 +263,8 @@ void Generator::ConstructGenerator_ShellModel()
 
    // Two body piece -- eliminate ppvh and pqvv  
 
+   Eta->AddTwoBodyKetClasses( {"vv","qv","qq"}, {"cc","vc"} );
+   Eta->AddTwoBodyKetClasses( {"qv","qq"}, {"vv"} );
    int nchan = modelspace->GetNumberTwoBodyChannels();
    for (int ch=0;ch<nchan;++ch)
    {
@@ -309,6 +318,8 @@ void Generator::ConstructGenerator_ShellModel_Atan()
 
    // Two body piece -- eliminate ppvh and pqvv  
 
+   Eta->AddTwoBodyKetClasses( {"vv","qv","qq"}, {"cc","vc"} );
+   Eta->AddTwoBodyKetClasses( {"qv","qq"}, {"vv"} );
    int nchan = modelspace->GetNumberTwoBodyChannels();
    for (int ch=0;ch<nchan;++ch)
    {
@@ -365,6 +376,8 @@ void Generator::ConstructGenerator_ShellModel_ImaginaryTime()
 
    // Two body piece -- eliminate ppvh and pqvv  
 
+   Eta->AddTwoBodyKetClasses( {"vv","qv","qq"}, {"cc","vc"} );
+   Eta->AddTwoBodyKetClasses( {"qv","qq"}, {"vv"} );
    int nchan = modelspace->GetNumberTwoBodyChannels();
    for (int ch=0;ch<nchan;++ch)
    {
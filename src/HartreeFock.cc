@@ -6,9 +6,7 @@
 #include <array>
 #include <map>
 #include <utility> // for make_pair
-#include "gsl/gsl_sf_gamma.h" // for radial wave function
-#include "gsl/gsl_sf_laguerre.h" // for radial wave function
-#include <gsl/gsl_math.h> // for M_SQRTPI
+#include "RadialBasis.hh" // for radial wave function
 #include <omp.h>
 
 #ifndef SQRT2
@@ -23,7 +21,7 @@
 HartreeFock::HartreeFock(Operator& hbare)
   : Hbare(hbare), modelspace(hbare.GetModelSpace()), 
     KE(Hbare.OneBody), energies(Hbare.OneBody.diag()),
-    tolerance(1e-8), convergence_ediff(7,0), convergence_EHF(7,0), freeze_occupations(true), learning_rate(0.0)
+    tolerance(1e-8), convergence_ediff(7,0), convergence_EHF(7,0), freeze_occupations(true), learning_rate(0.0), diis_history(0)
 {
    int norbits = modelspace->GetNumberOrbits();
 
@@ -46,6 +44,7 @@ HartreeFock::HartreeFock(Operator& hbare)
    holeorbs = arma::uvec(modelspace->holes);
    hole_occ = arma::rowvec(occvec);
    BuildMonopoleV();
+   BuildMonopoleVMatrix();
    if (hbare.GetParticleRank()>2)
    {
       BuildMonopoleV3();
@@ -66,20 +65,49 @@ void HartreeFock::Solve()
 {
    iterations = 0; // counter so we don't go on forever
    int maxiter = 10000;
+   int diis_restart = 5; // simple iterations to do after a DIIS failure
+   int diis_pause = 0;
    
    CalcEHF();
    PrintEHF();
 
+   diis_F.clear();
+   diis_error.clear();
    for (iterations=0; iterations<maxiter; ++iterations)
    {
       Diagonalize();          // Diagonalize the Fock matrix
       ReorderCoefficients();  // Reorder columns of C so we can properly identify the hole orbits.
-      if (not freeze_occupations) FillLowestOrbits(); // if we don't freeze the occupations, then calculate the new ones.
+      if (not freeze_occupations)  // if we don't freeze the occupations, then calculate the new ones.
+      {
+        arma::uvec holeorbs_last = holeorbs;
+        FillLowestOrbits();
+        // the old error vectors belong to a different reference, so start the DIIS history over
+        if ( holeorbs.n_elem != holeorbs_last.n_elem or arma::any(holeorbs != holeorbs_last) )
+        {
+          diis_F.clear();
+          diis_error.clear();
+        }
+      }
       UpdateDensityMatrix();  // Update the 1 body density matrix, used in UpdateF()
       UpdateF();              // Update the Fock matrix
       //if (iterations%100 == 0) learning_rate *= 0.9; // reduce learning rate to force convergence
       if ( CheckConvergence() ) break;
+      if ( diis_pause>0 )
+      {
+        --diis_pause;
+      }
+      else if ( diis_history>0 and not ExtrapolateF_DIIS() )
+      {
+        // start the DIIS history over after a few simple iterations
+        std::cout << "HartreeFock: DIIS failed on iteration " << iterations << ". Doing " << diis_restart
+                  << " simple iterations before trying again." << std::endl;
+        diis_F.clear();
+        diis_error.clear();
+        diis_pause = diis_restart;
+      }
    }
+   diis_F.clear();
+   diis_error.clear();
    CalcEHF();
 
    std::cout << std::setw(15) << std::setprecision(10);
@@ -234,6 +262,66 @@ void HartreeFock::BuildMonopoleV()
 }
 
 
+//*********************************************************************
+/// The two-body part of the Fock matrix is
+/// \f[ V_{ij} = \frac{1}{2j_i+1}\sum_{ab} \rho_{ab} \langle ai | \bar{V}^{(2)} | bj \rangle \f]
+/// where a and b (and i and j) are in the same one-body channel.
+/// Since \f$\bar{V}^{(2)}\f$ doesn't change during the HF iterations, we store it as
+/// a dense matrix with rows labeled by (i,j), i<=j, and columns labeled by (a,b), so
+/// that UpdateF() only needs a single matrix-vector product.
+//*********************************************************************
+void HartreeFock::BuildMonopoleVMatrix()
+{
+   double start_time = omp_get_wtime();
+   int norbits = modelspace->GetNumberOrbits();
+   std::vector<std::array<index_t,2>> ij_pairs, ab_pairs;
+   for ( auto& it : Hbare.OneBodyChannels )
+   {
+     for (auto a : it.second)
+     {
+       for (auto b : it.second)
+       {
+         ab_pairs.push_back({a,b});
+         if (a<=b) ij_pairs.push_back({a,b});
+       }
+     }
+   }
+   int nij = ij_pairs.size();
+   int nab = ab_pairs.size();
+   Vij_index.set_size(nij);
+   rho_index.set_size(nab);
+   for (int k=0;k<nij;++k) Vij_index(k) = ij_pairs[k][0] + norbits*ij_pairs[k][1];
+   for (int k=0;k<nab;++k) rho_index(k) = ab_pairs[k][0] + norbits*ab_pairs[k][1];
+
+   Vmon_rho.zeros(nij,nab);
+   #pragma omp parallel for schedule(dynamic,1)
+   for (int row=0; row<nij; ++row)
+   {
+      index_t i = ij_pairs[row][0];
+      index_t j = ij_pairs[row][1];
+      Orbit& oi = modelspace->GetOrbit(i);
+      for (int col=0; col<nab; ++col)
+      {
+         index_t a = ab_pairs[col][0];
+         index_t b = ab_pairs[col][1];
+         Orbit& oa = modelspace->GetOrbit(a);
+         int Tz = (oi.tz2+oa.tz2)/2;
+         int parity = (oi.l+oa.l)%2;
+         auto& monokets = modelspace->MonopoleKets[Tz+1][parity];
+         auto itbra = monokets.find( modelspace->GetKetIndex(std::min(i,a),std::max(i,a)) );
+         auto itket = monokets.find( modelspace->GetKetIndex(std::min(j,b),std::max(j,b)) );
+         if (itbra==monokets.end() or itket==monokets.end()) continue;
+         // 2body term <ai|V|bj>
+         if ((a>i) xor (b>j))
+           Vmon_rho(row,col) = Vmon_exch[Tz+1][parity](itbra->second,itket->second) / (oi.j2+1); // <ai|Vmon|jb>
+         else
+           Vmon_rho(row,col) = Vmon[Tz+1][parity](itbra->second,itket->second) / (oi.j2+1); // <ai|Vmon|bj>
+      }
+   }
+   profiler.timer["HF_BuildMonopoleVMatrix"] += omp_get_wtime() - start_time;
+}
+
+
 
 //*********************************************************************
 /// Construct an unnormalized three-body monopole interaction
@@ -432,39 +520,11 @@ void HartreeFock::FillLowestOrbits()
 void HartreeFock::UpdateF()
 {
    double start_time = omp_get_wtime();
-   int norbits = modelspace->GetNumberOrbits();
    Vij.zeros();
    V3ij.zeros();
 
-
-   // This loop isn't thread safe for some reason. Regardless, parallelizing it makes it slower. 
-   for (int i=0;i<norbits;i++)
-   {
-      Orbit& oi = modelspace->GetOrbit(i);
-      for (int j : Hbare.OneBodyChannels.at({oi.l,oi.j2,oi.tz2}) )
-      {
-         if (j<i) continue;
-         for (int a=0;a<norbits;++a)
-         {
-            Orbit& oa = modelspace->GetOrbit(a);
-            int Tz = (oi.tz2+oa.tz2)/2;
-            int parity = (oi.l+oa.l)%2;
-            int bra = modelspace->GetKetIndex(std::min(i,a),std::max(i,a));
-            int local_bra = modelspace->MonopoleKets[Tz+1][parity][bra];
-            for (int b : Hbare.OneBodyChannels.at({oa.l,oa.j2,oa.tz2}) )
-            {
-               int ket = modelspace->GetKetIndex(std::min(j,b),std::max(j,b));
-               int local_ket = modelspace->MonopoleKets[Tz+1][parity][ket];
-               // 2body term <ai|V|bj>
-               if ((a>i) xor (b>j))  // code needed some obfuscation, so threw an xor in there...
-                  Vij(i,j) += rho(a,b)*Vmon_exch[Tz+1][parity](local_bra,local_ket); // <a|rho|b> * <ai|Vmon|jb>
-               else
-                  Vij(i,j) += rho(a,b)*Vmon[Tz+1][parity](local_bra,local_ket); // <a|rho|b> * <ai|Vmon|bj>
-           }
-         }
-      }
-      Vij.col(i) /= (oi.j2+1);
-   }
+   // 2body term, see BuildMonopoleVMatrix(). Only the upper triangle is filled here.
+   Vij.elem(Vij_index) = Vmon_rho * rho.elem(rho_index);
 
    if (Hbare.GetParticleRank()>=3) 
    {
@@ -512,6 +572,56 @@ bool HartreeFock::CheckConvergence()
 }
 
 
+//**********************************************************************
+/// Direct inversion in the iterative subspace (Pulay mixing).
+/// The Fock matrix is replaced by the linear combination
+/// \f$ F = \sum_i c_i F_i \f$ of the last diis_history Fock matrices
+/// which minimizes the norm of the combined error vector
+/// \f$ \sum_i c_i [F_i,\rho_i] \f$, subject to \f$ \sum_i c_i = 1 \f$.
+/// The commutator vanishes at self-consistency.
+/// Returns false if the DIIS equations couldn't be solved, in which case F is left alone.
+//**********************************************************************
+bool HartreeFock::ExtrapolateF_DIIS()
+{
+   double start_time = omp_get_wtime();
+   diis_F.push_back(F);
+   diis_error.push_back(F*rho - rho*F);
+   if ((int)diis_F.size() > diis_history)
+   {
+     diis_F.pop_front();
+     diis_error.pop_front();
+   }
+   int n = diis_F.size();
+   if (n<2) return true;
+
+   arma::mat B(n+1,n+1);
+   arma::vec rhs(n+1,arma::fill::zeros);
+   for (int i=0;i<n;++i)
+   {
+     for (int j=i;j<n;++j)
+     {
+       B(i,j) = B(j,i) = arma::dot(diis_error[i],diis_error[j]);
+     }
+     B(i,n) = B(n,i) = -1;
+   }
+   B(n,n) = 0;
+   rhs(n) = -1;
+   // rescale to keep B from becoming too badly conditioned as the errors go to zero
+   double scale = arma::max(B.submat(0,0,n-1,n-1).diag());
+   if (scale > 0) B.submat(0,0,n-1,n-1) /= scale;
+
+   arma::vec c;
+   bool success = arma::solve(c, B, rhs) and c.is_finite();
+   if (success)
+   {
+     F = c(0) * diis_F[0];
+     for (int i=1;i<n;++i) F += c(i) * diis_F[i];
+   }
+   profiler.timer["HF_DIIS"] += omp_get_wtime() - start_time;
+   return success;
+}
+
+
 //**********************************************************************
 /// Eigenvectors/values come out of the diagonalization energy-ordered.
 /// We want them ordered corresponding to the input ordering, i.e. we want
@@ -814,26 +924,17 @@ void HartreeFock::PrintSPE()
 
 void HartreeFock::GetRadialWF(index_t index, std::vector<double>& R, std::vector<double>& PSI)
 {
-  PSI.resize(0);
-  for (double r : R)
-  {
-    PSI.push_back( GetRadialWF_r(index, r) );
-  }
+  double b = sqrt( (HBARC*HBARC) / (modelspace->GetHbarOmega() * M_NUCLEON) );
+  RadialBasis basis("harmonic", b, *modelspace, R);
+  PSI = arma::conv_to<std::vector<double>>::from( C.row(index) * basis.psi );
 }
 
 double HartreeFock::GetRadialWF_r(index_t index, double R)
 {
-  double b = sqrt( (HBARC*HBARC) / (modelspace->GetHbarOmega() * M_NUCLEON) );
-  Orbit& orb = modelspace->GetOrbit(index);
-   double x = R/b;
-   double psi = 0;
-   for ( index_t j : Hbare.OneBodyChannels.at({orb.l,orb.j2,orb.tz2}) )
-   {
-     Orbit& oj = modelspace->GetOrbit(j);
-     double Norm = 2*sqrt( gsl_sf_fact(oj.n) * pow(2,oj.n+oj.l) / M_SQRTPI / gsl_sf_doublefact(2*oj.n+2*oj.l+1) * pow(b,-3.0) );
-     psi += C(index,j) * Norm * pow(x,oj.l) * exp(-x*x*0.5) * gsl_sf_laguerre_n(oj.n,oj.l+0.5,x*x);
-   }
-   return psi;
+  std::vector<double> PSI;
+  std::vector<double> Rlist = {R};
+  GetRadialWF(index, Rlist, PSI);
+  return PSI[0];
 }
 
 
@@ -41,6 +41,9 @@ class HartreeFock
    arma::mat F;             ///< Fock matrix
    std::array< std::array< arma::mat,2>,3> Vmon;          ///< Monopole 2-body interaction
    std::array< std::array< arma::mat,2>,3> Vmon_exch;          ///< Monopole 2-body interaction
+   arma::mat Vmon_rho;      ///< Monopole 2-body interaction arranged so that Vij(Vij_index) = Vmon_rho * rho(rho_index)
+   arma::uvec rho_index;    ///< Elements (a,b) of the density matrix with a,b in the same one-body channel
+   arma::uvec Vij_index;    ///< Elements (i,j), with i<=j, of Vij with i,j in the same one-body channel
    arma::uvec holeorbs;     ///< list of hole orbits for generating density matrix
    arma::rowvec hole_occ; /// occupations of hole orbits
    arma::vec energies;      ///< vector of single particle energies
@@ -58,16 +61,22 @@ class HartreeFock
    std::deque<double> convergence_EHF; ///< Save last few convergence checks for diagnostics
    bool freeze_occupations;
    double learning_rate;    ///< Learning rate of the HF calculation
+   int diis_history;        ///< Number of previous Fock matrices used for DIIS extrapolation. 0 means no DIIS.
+   std::deque<arma::mat> diis_F;     ///< Fock matrices from previous iterations, for DIIS
+   std::deque<arma::mat> diis_error; ///< Error vectors [F,rho] from previous iterations, for DIIS
 
 // Methods
    HartreeFock(Operator&  hbare); ///< Constructor
    void BuildMonopoleV();         ///< Only the monopole part of V is needed, so construct it.
    void BuildMonopoleV3();        ///< Only the monopole part of V3 is needed.
+   void BuildMonopoleVMatrix();   ///< Arrange Vmon and Vmon_exch into Vmon_rho for UpdateF().
    void Diagonalize();            ///< Diagonalize the Fock matrix
    void UpdateF();                ///< Update the Fock matrix with the new transformation coefficients C
    void UpdateDensityMatrix();    ///< Update the density matrix with the new coefficients C
    void FillLowestOrbits();       ///< Get new occupations based on the current single-particle energies
    bool CheckConvergence();       ///< Compare the current energies with those from the previous iteration
+   bool ExtrapolateF_DIIS();      ///< Replace F with the DIIS extrapolation from the last few iterations
+   void SetDIISHistory(int n){diis_history = n;}; ///< Turn on DIIS with n previous iterations, or off with n=0
    void Solve();                  ///< Diagonalize and UpdateF until convergence
    void CalcEHF();                ///< Evaluate the Hartree Fock energy
    void PrintEHF();               ///< Print out the Hartree Fock energy
@@ -5,8 +5,8 @@
 #include <omp.h>
 
 
-map<string, double> IMSRGProfiler::timer;
-map<string, int> IMSRGProfiler::counter;
+ProfilerMap<double> IMSRGProfiler::timer;
+ProfilerMap<int> IMSRGProfiler::counter;
 float IMSRGProfiler::start_time = -1;
 
 IMSRGProfiler::IMSRGProfiler()
@@ -8,18 +8,56 @@
 #include <iomanip>
 #include <map>
 
+using namespace std;
+
+/// A map of timers or counters which can be updated from several threads at once,
+/// e.g. by commutators running concurrently with their own CommutatorWorkspace.
+/// Updates like timer["x"] += dt go through a critical section; reads don't.
+template <class T>
+class ProfilerMap
+{
+ public:
+  class Entry
+  {
+   public:
+    Entry(T* v) : value(v) {};
+    operator T() const {return *value;};
+    Entry& operator+=(T x) {
+      #pragma omp critical(IMSRGProfiler)
+      *value += x;
+      return *this;}
+    Entry& operator=(T x) {
+      #pragma omp critical(IMSRGProfiler)
+      *value = x;
+      return *this;}
+    Entry& operator++(int) {return (*this += 1);};
+    Entry& operator--(int) {return (*this += -1);};
+   private:
+    T* value;
+  };
+
+  Entry operator[](const string& key) {
+    T* v;
+    #pragma omp critical(IMSRGProfiler)
+    v = &entries[key];
+    return Entry(v);}
+  typename map<string,T>::const_iterator begin() const {return entries.begin();};
+  typename map<string,T>::const_iterator end() const {return entries.end();};
+
+ private:
+  map<string,T> entries;
+};
+
 /// Profiling class with all static data members.
 /// This is for keeping track of timing and memory usage, etc.
-/// IMSRGProfiler methods should probably not be called inside parallel blocks.
-
-using namespace std;
+/// The timers and counters may be updated inside parallel blocks, but the Print methods should not be called there.
 
 class IMSRGProfiler
 {
  public:
   // timer and counter are declaired as static so that there's only one copy of each of them
-  static map<string, double> timer; ///< For keeping timing information for various method calls
-  static map<string, int> counter;
+  static ProfilerMap<double> timer; ///< For keeping timing information for various method calls
+  static ProfilerMap<int> counter;
   static float start_time;
 
   IMSRGProfiler();
@@ -1,11 +1,74 @@
 
 #include "IMSRGSolver.hh"
+#include "ChannelScheduler.hh"
 #include <iomanip>
+#include <cstring>
+#include <stdexcept>
+
+#define CHECKPOINT_MAGIC "IMSRGCHK"
+#define CHECKPOINT_VERSION 2 // 2: two-body kets ordered hh, ph, pp in each channel
 
 #ifndef NO_ODE
 #include <boost/numeric/odeint.hpp>
 #endif
 
+// Helpers for moving Omega between memory and the scratch files. The serialization
+// to and from memory is done on the main thread, and only the file I/O is done in the background.
+namespace
+{
+  // Stream buffer which appends to a vector<char>
+  class VectorOutBuf : public streambuf
+  {
+   public:
+    VectorOutBuf(vector<char>& v) : buffer(v) {};
+   protected:
+    streamsize xsputn(const char* s, streamsize n)
+    {
+      buffer.insert(buffer.end(), s, s+n);
+      return n;
+    }
+    int overflow(int c)
+    {
+      if (c != EOF) buffer.push_back(c);
+      return c;
+    }
+   private:
+    vector<char>& buffer;
+  };
+
+  // Stream buffer which reads from a vector<char>
+  class VectorInBuf : public streambuf
+  {
+   public:
+    VectorInBuf(vector<char>& v) { setg(v.data(), v.data(), v.data()+v.size()); };
+  };
+
+  bool WriteScratchFile(string fname, const vector<char>* buffer)
+  {
+    ofstream ofs(fname, ios::binary);
+    ofs.write(buffer->data(), buffer->size());
+    return ofs.good();
+  }
+
+  // Throws if the file can't be read in full, so that the failure shows up in future::get()
+  vector<char> ReadScratchFile(string fname)
+  {
+    ifstream ifs(fname, ios::binary|ios::ate);
+    if (not ifs.good())
+      throw runtime_error("ReadScratchFile: failed to open " + fname);
+    streamsize size = ifs.tellg();
+    if (size < 0)
+      throw runtime_error("ReadScratchFile: failed to get the size of " + fname);
+    vector<char> buffer( (size_t)size );
+    ifs.seekg(0);
+    ifs.read(buffer.data(), size);
+    if (not ifs.good() or ifs.gcount() != size)
+      throw runtime_error("ReadScratchFile: short read from " + fname);
+    return buffer;
+  }
+}
+
+
 IMSRGSolver::~IMSRGSolver()
 {
   CleanupScratch();
@@ -14,7 +77,8 @@ IMSRGSolver::~IMSRGSolver()
 IMSRGSolver::IMSRGSolver()
     : rw(NULL),s(0),ds(0.1),ds_max(0.5),
      norm_domega(0.1), omega_norm_max(2.0),eta_criterion(1e-6),method("magnus_euler"),
-     flowfile(""), n_omega_written(0),max_omega_written(50),magnus_adaptive(true)
+     flowfile(""), n_omega_written(0),max_omega_written(50),magnus_adaptive(true),
+     scratch_id(getpid()),checkpoint_file(""),checkpoint_interval(10),istep_restart(0),pack_omegas(false)
      ,ode_monitor(*this),ode_mode("H"),ode_e_abs(1e-6),ode_e_rel(1e-6)
 {}
 
@@ -23,7 +87,8 @@ IMSRGSolver::IMSRGSolver( Operator &H_in)
    : modelspace(H_in.GetModelSpace()),rw(NULL), H_0(&H_in), FlowingOps(1,H_in), Eta(H_in), 
     istep(0), s(0),ds(0.1),ds_max(0.5),
     smax(2.0), norm_domega(0.1), omega_norm_max(2.0),eta_criterion(1e-6),method("magnus_euler"),
-    flowfile(""), n_omega_written(0),max_omega_written(50),magnus_adaptive(true)
+    flowfile(""), n_omega_written(0),max_omega_written(50),magnus_adaptive(true),
+    scratch_id(getpid()),checkpoint_file(""),checkpoint_interval(10),istep_restart(0),pack_omegas(false)
     ,ode_monitor(*this),ode_mode("H"),ode_e_abs(1e-6),ode_e_rel(1e-6)
 {
    Eta.Erase();
@@ -43,14 +108,18 @@ void IMSRGSolver::NewOmega()
   if ((rw != NULL) and (rw->GetScratchDir() !=""))
   {
     
-    char tmp[512];
-    sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), getpid(), n_omega_written);
-    string fname(tmp);
-    ofstream ofs(fname, ios::binary);
-    Omega.back().WriteBinary(ofs);
+    // Serialize Omega and write it in the background while the flow continues.
+    // Only one write is in flight at a time, so this costs at most one extra copy of Omega.
+    string fname = GetOmegaScratchFileName(n_omega_written);
+    WaitForOmegaWrite();
+    omega_write_buffer.clear();
+    VectorOutBuf outbuf(omega_write_buffer);
+    ostream os(&outbuf);
+    Omega.back().WriteBinary(os);
+    omega_write_future = async(launch::async, WriteScratchFile, fname, &omega_write_buffer).share();
     if (Omega.back().GetModelSpace() != Eta.GetModelSpace()) Omega.back() = Eta;
     n_omega_written++;
-    cout << "Omega written to file " << fname << "  written " << n_omega_written << " so far." << endl;
+    cout << "Omega writing to file " << fname << "  written " << n_omega_written << " so far." << endl;
     if (n_omega_written > max_omega_written)
     {
       cout << "n_omega_written > max_omega_written.  (" << n_omega_written << " > " << max_omega_written
@@ -67,6 +136,16 @@ void IMSRGSolver::NewOmega()
 
 }
 
+/// In the Magnus flows, the Omega before the current one is only needed for transformations
+/// from now on, so with SetPackOmegas(true) its two-body part is packed to the upper triangles.
+/// This is only called from the Magnus Euler solvers. The ODE solver integrates all of the
+/// Omegas as its state, so it never packs them.
+void IMSRGSolver::PackPreviousOmega()
+{
+  if (not pack_omegas or Omega.size()<2) return;
+  Omega[Omega.size()-2].TwoBody.Pack();
+}
+
 void IMSRGSolver::SetHin( Operator & H_in)
 {
    modelspace = H_in.GetModelSpace();
@@ -138,6 +217,7 @@ void IMSRGSolver::Solve()
   }
   else
     cout << "IMSRGSolver: I don't know method " << method << endl;
+  CommutatorWorkspace::Default().Release();
 }
 
 void IMSRGSolver::UpdateEta()
@@ -147,7 +227,8 @@ void IMSRGSolver::UpdateEta()
 
 void IMSRGSolver::Solve_magnus_euler()
 {
-   istep = 0;
+   istep = istep_restart;
+   istep_restart = 0;
    generator.Update(&FlowingOps[0],&Eta);
 
    if (generator.GetType() == "shell-model-atan")
@@ -161,7 +242,7 @@ void IMSRGSolver::Solve_magnus_euler()
    //cout << "Writing details of the flow to cout." << endl;
    WriteFlowStatus(cout);
 
-   for (istep=1;s<smax;++istep)
+   for (++istep;s<smax;++istep)
    {
       //cout << "stepping through istep; istep=" << istep << " s=" << s << endl;
       double norm_eta = Eta.Norm();
@@ -174,6 +255,7 @@ void IMSRGSolver::Solve_magnus_euler()
       if (norm_omega > omega_norm_max)
       {
         NewOmega();
+        PackPreviousOmega();
         norm_omega = 0;
       }
       // ds should never be more than 1, as this is over-rotating
@@ -215,6 +297,7 @@ void IMSRGSolver::Solve_magnus_euler()
       WriteFlowStatus(cout);
       //cout << "Return to loop." << endl;
 //      profiler.PrintMemory();
+      if (checkpoint_file != "" and ((checkpoint_interval>0 and istep%checkpoint_interval==0) or s>=smax)) WriteCheckpoint();
 
    }
    //cout << "Leaving Solve_magnus_euler." << endl;
@@ -223,7 +306,8 @@ void IMSRGSolver::Solve_magnus_euler()
 
 void IMSRGSolver::Solve_magnus_modified_euler()
 {
-   istep = 0;
+   istep = istep_restart;
+   istep_restart = 0;
    generator.Update(&FlowingOps[0],&Eta);
 
    Operator H_temp;
@@ -231,13 +315,14 @@ void IMSRGSolver::Solve_magnus_modified_euler()
    WriteFlowStatus(flowfile);
    WriteFlowStatus(cout);
 
-   for (istep=1;s<smax;++istep)
+   for (++istep;s<smax;++istep)
    {
       double norm_eta = Eta.Norm();
       double norm_omega = Omega.back().Norm();
       if (norm_omega > omega_norm_max)
       {
         NewOmega();
+        PackPreviousOmega();
         norm_omega = 0;
       }
       // ds should never be more than 1, as this is over-rotating
@@ -267,12 +352,171 @@ void IMSRGSolver::Solve_magnus_modified_euler()
       // Write details of the flow
       WriteFlowStatus(flowfile);
       WriteFlowStatus(cout);
+      if (checkpoint_file != "" and ((checkpoint_interval>0 and istep%checkpoint_interval==0) or s>=smax)) WriteCheckpoint();
 
    }
 
 }
 
 
+/// Write the state of a Magnus flow to checkpoint_file so that it can be picked
+/// up again with ReadCheckpoint(). Omegas which have already been written to scratch
+/// are not duplicated, only their number and the tag of their file names are saved.
+/// The checkpoint is written to a temporary file and then renamed, so a crash
+/// while writing leaves the previous checkpoint intact.
+void IMSRGSolver::WriteCheckpoint()
+{
+  double t_start = omp_get_wtime();
+  WaitForOmegaWrite();
+  string tmpname = checkpoint_file + ".tmp";
+  ofstream ofs(tmpname, ios::binary);
+  int version = CHECKPOINT_VERSION;
+  int nomega = Omega.size();
+  bool have_H_saved = (nomega + n_omega_written) > 1;
+  ofs.write(CHECKPOINT_MAGIC,8);
+  ofs.write((char*)&version,sizeof(version));
+  ofs.write((char*)&s,sizeof(s));
+  ofs.write((char*)&ds,sizeof(ds));
+  ofs.write((char*)&istep,sizeof(istep));
+  ofs.write((char*)&n_omega_written,sizeof(n_omega_written));
+  ofs.write((char*)&scratch_id,sizeof(scratch_id));
+  int len = generator.generator_type.size();
+  ofs.write((char*)&len,sizeof(len));
+  ofs.write(generator.generator_type.data(),len);
+  ofs.write((char*)&generator.denominator_cutoff,sizeof(generator.denominator_cutoff));
+  ofs.write((char*)&generator.denominator_delta,sizeof(generator.denominator_delta));
+  ofs.write((char*)&generator.denominator_delta_index,sizeof(generator.denominator_delta_index));
+  ofs.write((char*)&nomega,sizeof(nomega));
+  for (auto& omega : Omega) omega.WriteBinary(ofs);
+  ofs.write((char*)&have_H_saved,sizeof(have_H_saved));
+  if (have_H_saved) H_saved.WriteBinary(ofs);
+  FlowingOps[0].WriteBinary(ofs);
+  ofs.close();
+  if ( not ofs.good() or rename(tmpname.c_str(), checkpoint_file.c_str()) != 0)
+  {
+    cout << "Error when writing checkpoint to " << checkpoint_file << endl;
+  }
+  profiler.timer["WriteCheckpoint"] += omp_get_wtime() - t_start;
+}
+
+
+/// Restore the state of a flow written by WriteCheckpoint().
+/// This should be called after SetHin() and before Solve().
+/// The Omega scratch files of the original run must still be in the scratch directory.
+/// Returns false, and leaves the solver untouched, if the checkpoint can't be used.
+bool IMSRGSolver::ReadCheckpoint(string fname)
+{
+  ifstream ifs(fname, ios::binary);
+  if (not ifs.good())
+  {
+    cout << "Checkpoint file " << fname << " not found. Starting the flow from s=0." << endl;
+    return false;
+  }
+  char magic[8];
+  int version;
+  ifs.read(magic,8);
+  ifs.read((char*)&version,sizeof(version));
+  if ( not ifs.good() or strncmp(magic,CHECKPOINT_MAGIC,8)!=0 or version != CHECKPOINT_VERSION)
+  {
+    cout << "Error: " << fname << " is not a valid checkpoint file. Starting the flow from s=0." << endl;
+    return false;
+  }
+  double s_in,ds_in;
+  int istep_in,nwritten_in,scratch_id_in,len;
+  ifs.read((char*)&s_in,sizeof(s_in));
+  ifs.read((char*)&ds_in,sizeof(ds_in));
+  ifs.read((char*)&istep_in,sizeof(istep_in));
+  ifs.read((char*)&nwritten_in,sizeof(nwritten_in));
+  ifs.read((char*)&scratch_id_in,sizeof(scratch_id_in));
+  ifs.read((char*)&len,sizeof(len));
+  if ( not ifs.good() or len<0 or len>256 or nwritten_in<0)
+  {
+    cout << "Error: " << fname << " is not a valid checkpoint file. Starting the flow from s=0." << endl;
+    return false;
+  }
+  string gen_type(len,' ');
+  ifs.read(&gen_type[0],len);
+
+  if (nwritten_in>0)
+  {
+    int scratch_id_save = scratch_id;
+    scratch_id = scratch_id_in;
+    bool missing = (rw==NULL or rw->GetScratchDir()=="");
+    for (int i=0;i<nwritten_in and not missing;++i)
+    {
+      missing = not ifstream(GetOmegaScratchFileName(i)).good();
+    }
+    scratch_id = scratch_id_save;
+    if (missing)
+    {
+      cout << "Error: Omega scratch files for checkpoint " << fname << " not found. Starting the flow from s=0." << endl;
+      return false;
+    }
+  }
+
+  // Everything is read into local copies first, so that a truncated or
+  // corrupted checkpoint doesn't leave the solver half restored.
+  double t_start = omp_get_wtime();
+  double cutoff_in,delta_in;
+  int delta_index_in,nomega;
+  bool have_H_saved = false;
+  deque<Operator> Omega_in;
+  Operator H_saved_in;
+  Operator H_in(FlowingOps[0]);
+  try
+  {
+    ifs.read((char*)&cutoff_in,sizeof(cutoff_in));
+    ifs.read((char*)&delta_in,sizeof(delta_in));
+    ifs.read((char*)&delta_index_in,sizeof(delta_index_in));
+    ifs.read((char*)&nomega,sizeof(nomega));
+    if ( not ifs.good() or nomega<0)
+      throw runtime_error("bad header");
+    Operator omega(Omega.back());
+    for (int i=0;i<nomega and ifs.good();++i)
+    {
+      omega.ReadBinary(ifs);
+      Omega_in.push_back(omega);
+    }
+    ifs.read((char*)&have_H_saved,sizeof(have_H_saved));
+    if (have_H_saved and ifs.good())
+    {
+      H_saved_in = FlowingOps[0];
+      H_saved_in.ReadBinary(ifs);
+    }
+    if (ifs.good())
+      H_in.ReadBinary(ifs);
+    if (not ifs.good())
+      throw runtime_error("truncated file");
+  }
+  catch (exception& e)
+  {
+    cout << "Error: could not read checkpoint " << fname << " (" << e.what() << "). Starting the flow from s=0." << endl;
+    return false;
+  }
+
+  CleanupScratch();
+  generator.SetType(gen_type);
+  generator.denominator_cutoff = cutoff_in;
+  generator.denominator_delta = delta_in;
+  generator.denominator_delta_index = delta_index_in;
+  Omega = Omega_in;
+  if (pack_omegas)
+  {
+    for (int i=0;i<nomega-1;++i) Omega[i].TwoBody.Pack();
+  }
+  if (have_H_saved) H_saved = H_saved_in;
+  FlowingOps[0] = H_in;
+  s = s_in;
+  ds = ds_in;
+  istep_restart = istep_in;
+  n_omega_written = nwritten_in;
+  scratch_id = scratch_id_in;
+  cout << "Resuming flow from checkpoint " << fname << " at s = " << s << " with " << Omega.size() + n_omega_written << " Omegas" << endl;
+  profiler.timer["ReadCheckpoint"] += omp_get_wtime() - t_start;
+  return true;
+}
+
+
 #ifndef NO_ODE
 
 // Implement element-wise division and abs and reduce for Operators.
@@ -550,6 +794,14 @@ Operator IMSRGSolver::Transform(Operator&& OpIn)
 
 
 
+/// Returns a copy of Omega i, unpacked if need be
+Operator IMSRGSolver::GetOmega(int i)
+{
+  Operator omega(Omega[i]);
+  omega.TwoBody.Unpack();
+  return omega;
+}
+
 /// Returns \f$ e^{-Omega} \mathcal{O} e^{Omega} \f$
 Operator IMSRGSolver::InverseTransform(Operator& OpIn)
 {
@@ -561,6 +813,7 @@ Operator IMSRGSolver::InverseTransform(Operator& OpIn)
   for (auto omega=Omega.rbegin(); omega !=Omega.rend(); ++omega )
   {
     Operator negomega = -(*omega);
+    negomega.TwoBody.Unpack();
     OpOut = OpOut.BCH_Transform( negomega );
   }
   return OpOut;
@@ -570,60 +823,105 @@ Operator IMSRGSolver::InverseTransform(Operator& OpIn)
 /// for the \f$\Omega_i\f$s with index greater than or equal to n.
 Operator IMSRGSolver::Transform_Partial(Operator& OpIn, int n)
 {
-//  cout << "Begin Transform_Partial" << endl;
-  Operator OpOut = OpIn;
-  if ((rw != NULL) and rw->GetScratchDir() != "")
+  vector<Operator> ops(1,OpIn);
+  TransformMany_Partial(ops, n);
+  return move(ops[0]);
+}
+
+
+Operator IMSRGSolver::Transform_Partial(Operator&& OpIn, int n)
+{
+  vector<Operator> ops(1,OpIn);
+  TransformMany_Partial(ops, n);
+  return move(ops[0]);
+}
+
+/// Transform all the operators in ops in place, \f$ \mathcal{O} \rightarrow e^{\Omega} \mathcal{O} e^{-\Omega} \f$.
+/// This gives the same result as calling Transform() on each of them, but each \f$\Omega\f$ is only
+/// read from the scratch directory once, and its Pandya transformation is shared by all the operators.
+void IMSRGSolver::TransformMany(vector<Operator>& ops)
+{
+  TransformMany_Partial(ops, 0);
+}
+
+/// Transform all the operators in ops in place, using the \f$\Omega_i\f$s with index greater than or equal to n.
+void IMSRGSolver::TransformMany_Partial(vector<Operator>& ops, int n)
+{
+  if (ops.empty()) return;
+  double t_start = omp_get_wtime();
+  deque<CommutatorWorkspace> workspaces; // one per thread, if the operators are transformed concurrently
+  if ((rw != NULL) and rw->GetScratchDir() != "" and n<n_omega_written)
   {
-    Operator omega(OpIn);
-    char tmp[512];
+    // Omega.back() is always a scalar operator on the right model space, so read into a copy of that.
+    // The file for Omega i+1 is read in the background while Omega i is being applied.
+    WaitForOmegaWrite();
+    Operator omega(Omega.back());
+    future<vector<char>> next_omega = async(launch::async, ReadScratchFile, GetOmegaScratchFileName(n));
     for (int i=n;i<n_omega_written;i++)
     {
-     sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), getpid(), i);
-     string fname(tmp);
-     ifstream ifs(fname,ios::binary);
-     omega.ReadBinary(ifs);
-//     if (OpIn.GetJRank()>0) cout << "step " << i << endl;
-     OpOut = OpOut.BCH_Transform( omega );
-//     if (OpIn.GetJRank()>0)cout << "done" << endl;
+     vector<char> buffer = next_omega.get();
+     if (i+1<n_omega_written)
+       next_omega = async(launch::async, ReadScratchFile, GetOmegaScratchFileName(i+1));
+     VectorInBuf inbuf(buffer);
+     istream is(&inbuf);
+     omega.ReadBinary(is);
+     TransformMany_SingleOmega(ops, omega, workspaces);
     }
   }
 
   for (size_t i=max(n-n_omega_written,0); i<Omega.size();++i)
   {
-//     if (OpIn.GetJRank()>0) cout << "step " << i << endl;
-    OpOut = OpOut.BCH_Transform( Omega[i] );
-//     if (OpIn.GetJRank()>0)cout << "done" << endl;
+    if (Omega[i].TwoBody.IsPacked())
+      TransformMany_SingleOmega(ops, GetOmega(i), workspaces);
+    else
+      TransformMany_SingleOmega(ops, Omega[i], workspaces);
   }
-
-  return OpOut;
+  CommutatorWorkspace::Default().Release();
+  profiler.timer["TransformMany"] += omp_get_wtime() - t_start;
 }
 
-
-Operator IMSRGSolver::Transform_Partial(Operator&& OpIn, int n)
+/// Apply a single \f$ e^{\Omega} \f$ to all the operators in ops.
+/// If there are at least as many operators as threads, each thread transforms whole
+/// operators with its own CommutatorWorkspace from workspaces. Otherwise, the threads are used inside the commutators.
+void IMSRGSolver::TransformMany_SingleOmega(vector<Operator>& ops, const Operator& omega, deque<CommutatorWorkspace>& workspaces)
 {
-//  cout << "Calling r-value version of Transform_Partial, n = " << n << endl;
-  Operator OpOut = OpIn;
-  if ((rw != NULL) and rw->GetScratchDir() != "")
+  int nops = ops.size();
+  if (nops>1 and nops>=omp_get_max_threads())
   {
-    Operator omega(OpIn);
-    char tmp[512];
-    for (int i=n;i<n_omega_written;i++)
+    if ((int)workspaces.size() < omp_get_max_threads()) workspaces.resize(omp_get_max_threads());
+    ChannelScheduler::SerialBLAS serial_blas;
+    #pragma omp parallel for schedule(dynamic,1)
+    for (int i=0; i<nops; ++i)
     {
-     sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), getpid(), i);
-     string fname(tmp);
-     ifstream ifs(fname,ios::binary);
-     omega.ReadBinary(ifs);
-     OpOut = OpOut.BCH_Transform( omega );
+      ops[i] = ops[i].BCH_Transform( omega, workspaces[omp_get_thread_num()] );
     }
+    return;
   }
 
-  for (size_t i=max(n-n_omega_written,0); i<Omega.size();++i)
+  // The Pandya transformation of omega is done once here instead of once per operator.
+  CommutatorWorkspace& ws = CommutatorWorkspace::Default();
+  bool built_cache = false;
+  if (Operator::use_pandya_bch_cache and ws.pandya_cache_owner != &omega
+       and omega.GetParticleRank()>1 and omega.GetJRank()+omega.GetTRank()+omega.GetParity()==0)
   {
-    OpOut = OpOut.BCH_Transform( Omega[i] );
+    for (auto& op : ops)
+    {
+      if (op.GetParticleRank()>1 and op.Norm()>Operator::bch_transform_threshold)
+      {
+        ws.BuildPandyaCache(omega);
+        built_cache = true;
+        break;
+      }
+    }
   }
-  return OpOut;
+  for (auto& op : ops)
+  {
+    op = op.BCH_Transform( omega, ws );
+  }
+  if (built_cache) ws.ClearPandyaCache();
 }
 
+
 // count number of equations to be solved
 int IMSRGSolver::GetSystemDimension()
 {
@@ -640,19 +938,41 @@ int IMSRGSolver::GetSystemDimension()
 void IMSRGSolver::CleanupScratch()
 {
   if (n_omega_written<=0) return;
+  // The files are deleted anyway, so a failed write doesn't matter here (and this is called from the destructor).
+  if (omega_write_future.valid()) omega_write_future.wait();
+  omega_write_future = shared_future<bool>();
   cout << "Cleaning up files written to scratch space" << endl;
-  char tmp[512];
   for (int i=0;i<n_omega_written;i++)
   {
-    sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), getpid(), i);
-    string fname(tmp);
-    if ( remove(tmp) !=0 )
+    string fname = GetOmegaScratchFileName(i);
+    if ( remove(fname.c_str()) !=0 )
     {
       cout << "Error when attempting to delete " << fname << endl;
     }
   }
 }
 
+string IMSRGSolver::GetOmegaScratchFileName(int i)
+{
+  char tmp[512];
+  sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), scratch_id, i);
+  return string(tmp);
+}
+
+/// Block until the Omega being written to scratch in the background is done.
+/// Throws if the write failed, since the flow can't be transformed without that Omega.
+void IMSRGSolver::WaitForOmegaWrite()
+{
+  if (not omega_write_future.valid()) return;
+  bool written = omega_write_future.get();
+  omega_write_future = shared_future<bool>();
+  if ( not written )
+  {
+    cout << "Error when writing Omega number " << n_omega_written-1 << " to scratch!" << endl;
+    throw runtime_error("IMSRGSolver: failed to write Omega " + to_string(n_omega_written-1) + " to " + GetOmegaScratchFileName(n_omega_written-1));
+  }
+}
+
 
 
 void IMSRGSolver::WriteFlowStatus(string fname)
@@ -5,6 +5,7 @@
 #include <fstream>
 #include <string>
 #include <deque>
+#include <future>
 #include "Operator.hh"
 #include "Generator.hh"
 #include "IMSRGProfiler.hh"
@@ -41,6 +42,13 @@ class IMSRGSolver
   int n_omega_written;
   int max_omega_written;
   bool magnus_adaptive;
+  int scratch_id; ///< Tag for the Omega scratch file names. The pid of the process which started the flow.
+  string checkpoint_file;
+  int checkpoint_interval;
+  int istep_restart;
+  vector<char> omega_write_buffer; ///< Serialized Omega which is being written to scratch in the background
+  shared_future<bool> omega_write_future; ///< shared so that the solver stays copyable for odeint
+  bool pack_omegas; ///< Keep only the upper triangle of the two-body part of the Omegas which are done (see TwoBodyME::Pack()). Off by default, Magnus Euler flows only. The Omegas are unpacked again for each transformation.
 
 
 
@@ -48,6 +56,7 @@ class IMSRGSolver
   IMSRGSolver();
   IMSRGSolver( Operator& H_in);
   void NewOmega();
+  void PackPreviousOmega();
   void SetHin( Operator& H_in);
   void SetReadWrite( ReadWrite& r){rw = &r;};
   void Reset();
@@ -62,11 +71,14 @@ class IMSRGSolver
   Operator Transform(Operator& OpIn);
   Operator Transform(Operator&& OpIn);
   Operator InverseTransform(Operator& OpIn);
-  Operator GetOmega(int i){return Omega[i];};
+  Operator GetOmega(int i);
   int GetOmegaSize(){return Omega.size();};
   int GetNOmegaWritten(){return n_omega_written;};
   Operator Transform_Partial(Operator& OpIn, int n);
   Operator Transform_Partial(Operator&& OpIn, int n);
+  void TransformMany(vector<Operator>& ops);
+  void TransformMany_Partial(vector<Operator>& ops, int n);
+  void TransformMany_SingleOmega(vector<Operator>& ops, const Operator& omega, deque<CommutatorWorkspace>& workspaces);
 
   void SetFlowFile(string s);
   void SetDs(double d){ds = d;};
@@ -78,6 +90,12 @@ class IMSRGSolver
   void SetODETolerance(float x){ode_e_abs=x;ode_e_rel=x;};
   void SetEtaCriterion(float x){eta_criterion = x;};
   void SetMagnusAdaptive(bool b){magnus_adaptive = b;};
+  void SetPackOmegas(bool b){pack_omegas = b;};
+  void SetCheckpointFile(string f){checkpoint_file = f;};
+  void SetCheckpointInterval(int n){checkpoint_interval = n;};
+  void WriteCheckpoint();
+  bool ReadCheckpoint(string fname);
+  double GetS(){return s;};
 
   int GetSystemDimension();
   Operator& GetH_s(){return FlowingOps[0];};
@@ -98,6 +116,8 @@ class IMSRGSolver
   void SetDenominatorDeltaOrbit(string o){generator.SetDenominatorDeltaOrbit(o);};
 
   void CleanupScratch();
+  string GetOmegaScratchFileName(int i);
+  void WaitForOmegaWrite();
 
 
   // This is used to get flow info from odeint
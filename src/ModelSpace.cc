@@ -7,11 +7,19 @@
 #include <gsl/gsl_math.h>
 
 #include "imsrg_util.hh"
+#include "RadialBasis.hh"
 #include "AngMom.hh"
 #include <boost/multiprecision/cpp_bin_float.hpp>
 #include <boost/implicit_cast.hpp>
 #include <gsl/gsl_integration.h>
 #include <list>
+#include <fstream>
+#include <cstring>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ModelSpace.hh"
 #include "Operator.hh"
@@ -77,6 +85,8 @@ TwoBodyChannel::~TwoBodyChannel()
 //  cout << "In TwoBodyChannel destructor" << endl;
 }
 
+bool TwoBodyChannel::order_kets_by_class = true;
+
 TwoBodyChannel::TwoBodyChannel()
 {}
 
@@ -102,15 +112,19 @@ void TwoBodyChannel::Initialize(int N, ModelSpace *ms)
    KetMap.resize(nk,-1); // set all values to -1
    for (int i=0;i<nk;i++)
    {
-      //cout << "Geting Ketmap init'd; i=" << i << endl;
       Ket &ket = modelspace->GetKet(i);
-      if ( CheckChannel_ket(ket) )
-      {
-	 //cout << "Got into check_channel." << endl;
-         KetMap[i] = NumberKets;
-         KetList.push_back(i);
-         NumberKets++;
-      }
+      if ( CheckChannel_ket(ket) )  KetList.push_back(i);
+   }
+   // Order the kets by occupation (hh, then ph, then pp) and then by core/valence/qspace class,
+   // so that each of the hh, ph and pp classes is a contiguous range of local indices.
+   // The commutators can then work on views of these blocks rather than gathering them.
+   // Kets in the same class stay in ModelSpace order.
+   if (order_kets_by_class)
+     stable_sort(KetList.begin(),KetList.end(),[this](int i, int j){ return KetClassRank(i) < KetClassRank(j); } );
+   for (int i : KetList)
+   {
+      KetMap[i] = NumberKets;
+      NumberKets++;
    }
    KetIndex_pp = GetKetIndexFromList(modelspace->KetIndex_pp);
    KetIndex_hh = GetKetIndexFromList(modelspace->KetIndex_hh);
@@ -121,30 +135,53 @@ void TwoBodyChannel::Initialize(int N, ModelSpace *ms)
    KetIndex_vv = GetKetIndexFromList(modelspace->KetIndex_vv);
    KetIndex_qv = GetKetIndexFromList(modelspace->KetIndex_qv);
    KetIndex_qq = GetKetIndexFromList(modelspace->KetIndex_qq);
-   vector<double> occvec;
-   vector<double> unoccvec;
-   for (index_t i=0;i<modelspace->KetIndex_hh.size();++i)
+   // Occupation factors, in the same order as KetIndex_hh and KetIndex_ph
+   Ket_occ_hh.set_size(KetIndex_hh.n_elem);
+   Ket_unocc_hh.set_size(KetIndex_hh.n_elem);
+   for (arma::uword i=0;i<KetIndex_hh.n_elem;++i)
    {
-      if (CheckChannel_ket(modelspace->GetKet(modelspace->KetIndex_hh[i])))
-      {
-        occvec.push_back( modelspace->Ket_occ_hh[i]);
-        unoccvec.push_back( modelspace->Ket_unocc_hh[i]);
-      }
+      Ket& ket = GetKet(KetIndex_hh(i));
+      Ket_occ_hh(i) = ket.op->occ * ket.oq->occ;
+      Ket_unocc_hh(i) = (1-ket.op->occ) * (1-ket.oq->occ);
    }
-   Ket_occ_hh = arma::vec(occvec);
-   Ket_unocc_hh = arma::vec(unoccvec);
-   occvec.clear();
-   unoccvec.clear();
-   for (index_t i=0;i<modelspace->KetIndex_ph.size();++i)
+   Ket_occ_ph.set_size(KetIndex_ph.n_elem);
+   Ket_unocc_ph.set_size(KetIndex_ph.n_elem);
+   for (arma::uword i=0;i<KetIndex_ph.n_elem;++i)
    {
-      if (CheckChannel_ket(modelspace->GetKet(modelspace->KetIndex_ph[i])))
-      {
-        occvec.push_back( modelspace->Ket_occ_ph[i]);
-        unoccvec.push_back( modelspace->Ket_unocc_ph[i]);
-      }
+      Ket& ket = GetKet(KetIndex_ph(i));
+      Ket_occ_ph(i) = ket.op->occ * ket.oq->occ;
+      Ket_unocc_ph(i) = (1-ket.op->occ) * (1-ket.oq->occ);
    }
-   Ket_occ_ph = arma::vec(occvec);
-   Ket_unocc_ph = arma::vec(unoccvec);
+}
+
+
+/// Sort key for the kets in a channel. The occupation class (hh=0, ph=1, pp=2, otherwise 3)
+/// comes first, then the core/valence/qspace class (cc, vc, qc, vv, qv, qq).
+int TwoBodyChannel::KetClassRank(int ketindex) const
+{
+   Ket& ket = modelspace->GetKet(ketindex);
+   double occp = ket.op->occ;
+   double occq = ket.oq->occ;
+   int occ_rank = 3;
+   if (occp>OCC_CUT and occq>OCC_CUT) occ_rank = 0;
+   else if ( (occp>OCC_CUT) xor (occq>OCC_CUT) ) occ_rank = 1;
+   else if (occp<OCC_CUT and occq<OCC_CUT) occ_rank = 2;
+   int cvq_p = ket.op->cvq;
+   int cvq_q = ket.oq->cvq;
+   int cvq_rank = cvq_p + cvq_q;
+   if (cvq_rank==2 and cvq_p*cvq_q==1) cvq_rank = 3; // vv comes after qc
+   else if (cvq_rank>2) cvq_rank += 1;
+   return 6*occ_rank + cvq_rank;
+}
+
+
+/// Returns true if kets is a non-empty range of consecutive local indices,
+/// as GetKetIndex_hh(), GetKetIndex_ph() and GetKetIndex_pp() are.
+/// Then the block can be addressed with arma::span(kets(0),kets(kets.n_elem-1)).
+bool TwoBodyChannel::IsContiguous(const arma::uvec& kets)
+{
+   if (kets.n_elem==0) return false;
+   return kets(kets.n_elem-1) - kets(0) + 1 == kets.n_elem;
 }
 
 
@@ -183,17 +220,36 @@ arma::uvec& TwoBodyChannel::GetKetIndex_vv() { return KetIndex_vv;};
 arma::uvec& TwoBodyChannel::GetKetIndex_qv() { return KetIndex_qv;};
 arma::uvec& TwoBodyChannel::GetKetIndex_qq() { return KetIndex_qq;};
 
+arma::uvec& TwoBodyChannel::GetKetIndexFromClass(string ketclass)
+{
+  if (ketclass == "pp") return KetIndex_pp;
+  if (ketclass == "hh") return KetIndex_hh;
+  if (ketclass == "ph") return KetIndex_ph;
+  if (ketclass == "cc") return KetIndex_cc;
+  if (ketclass == "vc") return KetIndex_vc;
+  if (ketclass == "qc") return KetIndex_qc;
+  if (ketclass == "vv") return KetIndex_vv;
+  if (ketclass == "qv") return KetIndex_qv;
+  if (ketclass == "qq") return KetIndex_qq;
+  cout << "TwoBodyChannel::GetKetIndexFromClass -- Unknown ket class " << ketclass << endl;
+  return KetIndex_pp;
+}
+
 
 
+/// Local indices of the kets in vec_in (ModelSpace ket indices, sorted) which are in this channel, in ascending order.
 arma::uvec TwoBodyChannel::GetKetIndexFromList(vector<index_t>& vec_in)
 {
+   vector<index_t> sorted_kets(KetList.begin(),KetList.end());
+   sort(sorted_kets.begin(),sorted_kets.end());
    vector<index_t> index_list (min(vec_in.size(),KetList.size()));
-   auto it = set_intersection(KetList.begin(),KetList.end(),vec_in.begin(),vec_in.end(),index_list.begin());
+   auto it = set_intersection(sorted_kets.begin(),sorted_kets.end(),vec_in.begin(),vec_in.end(),index_list.begin());
    index_list.resize(it-index_list.begin());
    for (auto& x : index_list)
    {
      x = KetMap[x];
    }
+   sort(index_list.begin(),index_list.end());
    return arma::uvec(index_list);
 }
 
@@ -241,9 +297,27 @@ bool TwoBodyChannel_CC::CheckChannel_ket(Orbit* op, Orbit* oq) const
 // Static members
 unordered_map<long long unsigned int, long double> ModelSpace::radList;
 unordered_map<long long unsigned int, long double> ModelSpace::OsToHydroCoeffList;
+int ModelSpace::ostohydro_Z = -1;
+double ModelSpace::ostohydro_b = 0;
 unordered_map<unsigned long int,double> ModelSpace::SixJList;
 unordered_map<unsigned long long int,double> ModelSpace::NineJList;
+vector<double> ModelSpace::SixJTable_hhi;
+vector<double> ModelSpace::SixJTable_iii;
+vector<double> ModelSpace::NineJTable_LS;
+int ModelSpace::sixj_table_j2max = -1;
+int ModelSpace::sixj_precalc_j2max = -1;
+double ModelSpace::sixj_table_max_memory = 256;
+int ModelSpace::ninej_table_lmax = -1;
+int ModelSpace::ninej_table_j2max = -1;
 unordered_map<unsigned long long int,double> ModelSpace::MoshList;
+int ModelSpace::mosh_list_Nmax = -1;
+string ModelSpace::symbol_cache_file = "";
+void* ModelSpace::symbol_cache_map = nullptr;
+size_t ModelSpace::symbol_cache_map_size = 0;
+MappedSymbolList ModelSpace::MappedSixJList;
+MappedSymbolList ModelSpace::MappedNineJList;
+MappedSymbolList ModelSpace::MappedMoshList;
+double ModelSpace::pandya_plans_max_memory = 4000;
 map<string,vector<string>> ModelSpace::ValenceSpaces  {
 { "s-shell"  ,         {"vacuum", "p0s1","n0s1"}},
 { "p-shell"  ,         {"He4", "p0p3","n0p3","p0p1","n0p1"}},
@@ -298,6 +372,7 @@ ModelSpace::ModelSpace(const ModelSpace& ms)
    OneBodyChannels(ms.OneBodyChannels),
    SortedTwoBodyChannels(ms.SortedTwoBodyChannels),
    SortedTwoBodyChannels_CC(ms.SortedTwoBodyChannels_CC),
+   PandyaPlans(ms.PandyaPlans), InversePandyaPlans(ms.InversePandyaPlans), pandya_plans_too_big(ms.pandya_plans_too_big),
    norbits(ms.norbits), hbar_omega(ms.hbar_omega),
    target_mass(ms.target_mass), target_Z(ms.target_Z), Aref(ms.Aref), Zref(ms.Zref),
    nTwoBodyChannels(ms.nTwoBodyChannels),
@@ -330,6 +405,7 @@ ModelSpace::ModelSpace(ModelSpace&& ms)
    OneBodyChannels(move(ms.OneBodyChannels)),
    SortedTwoBodyChannels(move(ms.SortedTwoBodyChannels)),
    SortedTwoBodyChannels_CC(move(ms.SortedTwoBodyChannels_CC)),
+   PandyaPlans(move(ms.PandyaPlans)), InversePandyaPlans(move(ms.InversePandyaPlans)), pandya_plans_too_big(ms.pandya_plans_too_big),
    norbits(ms.norbits), hbar_omega(ms.hbar_omega),
    target_mass(ms.target_mass), target_Z(ms.target_Z), Aref(ms.Aref), Zref(ms.Zref),
    nTwoBodyChannels(ms.nTwoBodyChannels),
@@ -990,6 +1066,9 @@ ModelSpace ModelSpace::operator=(const ModelSpace& ms)
    OneBodyChannels = ms.OneBodyChannels;
    SortedTwoBodyChannels = ms.SortedTwoBodyChannels;
    SortedTwoBodyChannels_CC = ms.SortedTwoBodyChannels_CC;
+   PandyaPlans = ms.PandyaPlans;
+   InversePandyaPlans = ms.InversePandyaPlans;
+   pandya_plans_too_big = ms.pandya_plans_too_big;
    norbits = ms.norbits;
    hbar_omega = ms.hbar_omega;
    target_mass = ms.target_mass;
@@ -1040,6 +1119,9 @@ ModelSpace ModelSpace::operator=(ModelSpace&& ms)
    OneBodyChannels = move(ms.OneBodyChannels);
    SortedTwoBodyChannels = move(ms.SortedTwoBodyChannels);
    SortedTwoBodyChannels_CC = move(ms.SortedTwoBodyChannels_CC);
+   PandyaPlans = move(ms.PandyaPlans);
+   InversePandyaPlans = move(ms.InversePandyaPlans);
+   pandya_plans_too_big = ms.pandya_plans_too_big;
    norbits = move(ms.norbits);
    hbar_omega = move(ms.hbar_omega);
    target_mass = move(ms.target_mass);
@@ -1209,7 +1291,9 @@ void ModelSpace::SetupKets(string Sys)
    sort(SortedTwoBodyChannels_CC.begin(),SortedTwoBodyChannels_CC.end(),[this](int i, int j){ return TwoBodyChannels_CC[i].GetNumberKets() > TwoBodyChannels_CC[j].GetNumberKets(); }  );
    while (  TwoBodyChannels[ SortedTwoBodyChannels.back() ].GetNumberKets() <1 ) SortedTwoBodyChannels.pop_back();
    while (  TwoBodyChannels_CC[ SortedTwoBodyChannels_CC.back() ].GetNumberKets() <1 ) SortedTwoBodyChannels_CC.pop_back();
-  
+
+   PreCalculateSixJ();
+   PreCalculateNineJ_LS();
 }
 
 
@@ -1251,6 +1335,9 @@ void ModelSpace::ClearVectors()
    TwoBodyChannels_CC.clear();
    SortedTwoBodyChannels.clear();
    SortedTwoBodyChannels_CC.clear();
+   PandyaPlans.clear();
+   InversePandyaPlans.clear();
+   pandya_plans_too_big = false;
 }
 
 void ModelSpace::SetSystemType(string str)
@@ -1264,24 +1351,239 @@ void ModelSpace::SetSystemBasis(string str)
 }
 
 
+// Helpers for the dense angular momentum tables
+namespace
+{
+  // check the triangle condition and integer sum for doubled angular momenta
+  inline bool triad(int a, int b, int c)
+  {
+    return ( c>=abs(a-b) and c<=a+b and (a+b+c)%2==0 );
+  }
+  // position of the sorted triple i<=j<=k in a packed "tetrahedral" list
+  inline size_t tetra_index(int i, int j, int k)
+  {
+    return (size_t)k*(k+1)*(k+2)/6 + j*(j+1)/2 + i;
+  }
+  // key for SixJList, with the arguments doubled
+  inline unsigned long int sixj_key(int j1, int j2, int j3, int J1, int J2, int J3)
+  {
+    return (((unsigned long int) j1) << 35) + (((unsigned long int) j2) << 28) + (((unsigned long int) j3) << 21)
+         + (((unsigned long int) J1) << 14) + (((unsigned long int) J2) <<  7) +   (unsigned long int) J3;
+  }
+  // number of entries in the dense 6j tables for half-integer j up to j2max/2
+  inline size_t sixj_table_size(int j2max)
+  {
+    size_t nh = (j2max+1)/2;
+    size_t nJ = j2max+1;
+    return nh*nh*(nh*nh+1)/2 * nJ*nJ + tetra_index(0,0,nJ) * nh*nh*nh;
+  }
+}
+
+/// Fill the dense 6j tables SixJTable_hhi and SixJTable_iii for all half-integer arguments
+/// up to OneBodyJmax and integer arguments up to the largest two-body J. The tables are
+/// static, so this only does work if the model space has larger j than anything we've seen before.
+/// These two patterns cover everything needed by the Pandya transformations and the
+/// scalar-tensor commutators. Anything else is computed on the fly in GetSixJ().
+/// The dense tables grow like \f$ j^6 \f$, so they are cut off at the j where they would take more
+/// than sixj_table_max_memory MB. The nonzero { h h i ; h h i } symbols above that go in SixJList instead.
+void ModelSpace::PreCalculateSixJ()
+{
+   if (OneBodyJmax <= sixj_precalc_j2max) return;
+   double t_start = omp_get_wtime();
+   int j2max = OneBodyJmax;
+   while ( j2max>1 and sixj_table_size(j2max)*sizeof(double) > sixj_table_max_memory*1024*1024 ) j2max -= 2;
+   if (j2max < OneBodyJmax)
+   {
+     cout << "The dense 6j tables up to j = " << OneBodyJmax << "/2 would take more than " << sixj_table_max_memory
+          << " MB. Using them up to j = " << j2max << "/2." << endl;
+   }
+   if (j2max > sixj_table_j2max) PreCalculateSixJ_Tables(j2max);
+   if (j2max < OneBodyJmax) PreCalculateSixJ_Sparse(sixj_table_j2max, OneBodyJmax);
+   sixj_precalc_j2max = OneBodyJmax;
+   cout << "Precalculated 6j symbols up to j = " << OneBodyJmax << "/2  ("
+        << (SixJTable_hhi.size()+SixJTable_iii.size())*sizeof(double)/1024./1024. << " MB in tables, "
+        << SixJList.size() << " in SixJList, " << omp_get_wtime()-t_start << " s)" << endl;
+}
+
+/// Fill the dense 6j tables for half-integer j up to j2max/2.
+void ModelSpace::PreCalculateSixJ_Tables(int j2max)
+{
+   int nh = (j2max+1)/2;   // number of half-integer values 1/2 ... j2max/2
+   int nJ = j2max+1;       // number of integer values 0 ... j2max
+   int ncol = nh*nh;       // number of possible (top,bottom) half-integer columns
+
+   // { ja jb J ; jc jd J' } stored with the columns {ja,jc} <= {jb,jd}
+   vector<double> table_hhi( (size_t)ncol*(ncol+1)/2 * nJ*nJ, 0.0);
+   #pragma omp parallel for schedule(dynamic,1)
+   for (int c2=0; c2<ncol; ++c2)
+   {
+     int jb = 2*(c2/nh)+1;
+     int jd = 2*(c2%nh)+1;
+     for (int c1=0; c1<=c2; ++c1)
+     {
+       int ja = 2*(c1/nh)+1;
+       int jc = 2*(c1%nh)+1;
+       size_t offset = ((size_t)c2*(c2+1)/2 + c1) * nJ*nJ;
+       int Jmin = max(abs(ja-jb),abs(jc-jd))/2;
+       int Jmax = min(ja+jb,jc+jd)/2;
+       int Jpmin = max(abs(ja-jd),abs(jc-jb))/2;
+       int Jpmax = min(ja+jd,jc+jb)/2;
+       for (int J=Jmin; J<=Jmax; ++J)
+       {
+         for (int Jp=Jpmin; Jp<=Jpmax; ++Jp)
+         {
+           table_hhi[offset + J*nJ + Jp] = AngMom::SixJ(0.5*ja,0.5*jb,J,0.5*jc,0.5*jd,Jp);
+         }
+       }
+     }
+   }
+
+   // { J1 J2 J3 ; ja jb jc } stored with J1 <= J2 <= J3
+   vector<double> table_iii( tetra_index(0,0,nJ) * nh*nh*nh, 0.0);
+   #pragma omp parallel for schedule(dynamic,1)
+   for (int J3=0; J3<nJ; ++J3)
+   {
+     for (int J2=0; J2<=J3; ++J2)
+     {
+       for (int J1=0; J1<=J2; ++J1)
+       {
+         if ( not triad(2*J1,2*J2,2*J3) ) continue;
+         size_t offset = tetra_index(J1,J2,J3) * nh*nh*nh;
+         for (int a=0; a<nh; ++a)
+         {
+           for (int b=0; b<nh; ++b)
+           {
+             if ( not triad(2*a+1,2*b+1,2*J3) ) continue;
+             for (int c=0; c<nh; ++c)
+             {
+               if ( not (triad(2*J1,2*b+1,2*c+1) and triad(2*a+1,2*J2,2*c+1)) ) continue;
+               table_iii[offset + (a*nh+b)*nh+c] = AngMom::SixJ(J1,J2,J3,0.5*(2*a+1),0.5*(2*b+1),0.5*(2*c+1));
+             }
+           }
+         }
+       }
+     }
+   }
+   SixJTable_hhi = move(table_hhi);
+   SixJTable_iii = move(table_iii);
+   sixj_table_j2max = j2max;
+}
+
+/// Store the nonzero { ja jb J ; jc jd J' } with some j between table_j2max/2 and j2max/2 in SixJList,
+/// with the columns ordered the same way as in SixJTable_hhi, which is how GetSixJ() looks them up.
+void ModelSpace::PreCalculateSixJ_Sparse(int table_j2max, int j2max)
+{
+   int nh = (j2max+1)/2;
+   int ncol = nh*nh;
+   vector<vector<pair<unsigned long int,double>>> sixj_by_column(ncol);
+   #pragma omp parallel for schedule(dynamic,1)
+   for (int c2=0; c2<ncol; ++c2)
+   {
+     int jb = 2*(c2/nh)+1;
+     int jd = 2*(c2%nh)+1;
+     for (int c1=0; c1<=c2; ++c1)
+     {
+       int ja = 2*(c1/nh)+1;
+       int jc = 2*(c1%nh)+1;
+       if ( max(max(ja,jb),max(jc,jd)) <= table_j2max ) continue;
+       int Jmin = max(abs(ja-jb),abs(jc-jd))/2;
+       int Jmax = min(ja+jb,jc+jd)/2;
+       int Jpmin = max(abs(ja-jd),abs(jc-jb))/2;
+       int Jpmax = min(ja+jd,jc+jb)/2;
+       for (int J=Jmin; J<=Jmax; ++J)
+       {
+         for (int Jp=Jpmin; Jp<=Jpmax; ++Jp)
+         {
+           sixj_by_column[c2].push_back( make_pair( sixj_key(ja,jb,2*J,jc,jd,2*Jp), AngMom::SixJ(0.5*ja,0.5*jb,J,0.5*jc,0.5*jd,Jp)) );
+         }
+       }
+     }
+   }
+   for (auto& column : sixj_by_column)  SixJList.insert( column.begin(), column.end() );
+}
+
+
+/// Look up the 6j symbol
+/// \f[ \left\{ \begin{array}{lll} j_1 & j_2 & j_3 \\ J_1 & J_2 & J_3 \end{array} \right\} \f]
+/// in the dense tables, using the symmetries of the 6j symbol (any permutation of columns,
+/// exchange of upper and lower arguments in two columns) to bring it to one of the stored forms.
+/// Symbols which aren't covered by the tables are computed directly. They are only stored
+/// in SixJList when we're not in a parallel region, so that this is safe to call from anywhere.
 double ModelSpace::GetSixJ(double j1, double j2, double j3, double J1, double J2, double J3)
 {
 // { j1 j2 j3 }
 // { J1 J2 J3 }
+   int top[3] = { int(2*j1), int(2*j2), int(2*j3) };
+   int bot[3] = { int(2*J1), int(2*J2), int(2*J3) };
+   int j2max = sixj_table_j2max;
+   int nh = (j2max+1)/2;
+   int nJ = j2max+1;
+
+   int nodd_top = (top[0]&1) + (top[1]&1) + (top[2]&1);
+   int nodd_bot = (bot[0]&1) + (bot[1]&1) + (bot[2]&1);
+   if (nodd_top==2 and nodd_bot==2)
+   {
+     // { h h i ; h h i } up to permutation of columns
+     int k = (top[0]&1)==0 ? 0 : ( (top[1]&1)==0 ? 1 : 2 );
+     int p = k==0 ? 1 : 0;
+     int q = k==2 ? 1 : 2;
+     if ( (bot[k]&1)==0 and top[p]<=j2max and top[q]<=j2max and bot[p]<=j2max and bot[q]<=j2max )
+     {
+       int Jmin = max(abs(top[p]-top[q]),abs(bot[p]-bot[q]));
+       int Jmax = min(top[p]+top[q],bot[p]+bot[q]);
+       int Jpmin = max(abs(top[p]-bot[q]),abs(bot[p]-top[q]));
+       int Jpmax = min(top[p]+bot[q],bot[p]+top[q]);
+       // anything outside these bounds violates a triangle condition
+       if (top[k]<Jmin or top[k]>Jmax or bot[k]<Jpmin or bot[k]>Jpmax) return 0;
+       int cp = (top[p]/2)*nh + bot[p]/2;
+       int cq = (top[q]/2)*nh + bot[q]/2;
+       if (cp>cq) swap(cp,cq);
+       return SixJTable_hhi[ ((size_t)cq*(cq+1)/2 + cp)*nJ*nJ + (top[k]/2)*nJ + bot[k]/2 ];
+     }
+     if ( (bot[k]&1)==0 )
+     {
+       // put the columns in the order used by PreCalculateSixJ_Sparse()
+       if ( make_pair(top[p],bot[p]) > make_pair(top[q],bot[q]) ) swap(p,q);
+       int t[3] = { top[p], top[q], top[k] };
+       int b[3] = { bot[p], bot[q], bot[k] };
+       copy( t, t+3, top );
+       copy( b, b+3, bot );
+     }
+   }
+   else if ( nodd_top+nodd_bot==3 and ((top[0]^bot[0])&1) and ((top[1]^bot[1])&1) and ((top[2]^bot[2])&1) )
+   {
+     // { i i i ; h h h } after exchanging upper and lower arguments in two columns
+     if (nodd_top==2)
+     {
+       for (int i=0;i<3;++i)
+       {
+         if (top[i]&1) swap(top[i],bot[i]);
+       }
+     }
+     if (nodd_top==0 or nodd_top==2)
+     {
+       // sort the columns so that J1 <= J2 <= J3
+       if (top[0]>top[1]) { swap(top[0],top[1]); swap(bot[0],bot[1]); }
+       if (top[1]>top[2]) { swap(top[1],top[2]); swap(bot[1],bot[2]); }
+       if (top[0]>top[1]) { swap(top[0],top[1]); swap(bot[0],bot[1]); }
+       if ( top[2]<2*nJ and bot[0]<=j2max and bot[1]<=j2max and bot[2]<=j2max )
+       {
+         return SixJTable_iii[ tetra_index(top[0]/2,top[1]/2,top[2]/2)*nh*nh*nh + ((bot[0]/2)*nh + bot[1]/2)*nh + bot[2]/2 ];
+       }
+     }
+   }
 
+   // Not in the tables
 //   unsigned long long int key = 20000000000*j1 + 200000000*j2 + 2000000*j3 + 20000*J1 + 200*J2 + 2*J3;
-   unsigned long int key = (((unsigned long int) (2*j1)) << 30) +
-                           (((unsigned long int) (2*j2)) << 24) +
-                           (((unsigned long int) (2*j3)) << 18) +
-                           (((unsigned long int) (2*J1)) << 12) +
-                           (((unsigned long int) (2*J2)) <<  6) +
-                            ((unsigned long int) (2*J3));
+   unsigned long int key = sixj_key( top[0], top[1], top[2], bot[0], bot[1], bot[2] );
 
    auto it = SixJList.find(key);
    if (it != SixJList.end() ) return it->second;
-   double sixj = AngMom::SixJ(j1,j2,j3,J1,J2,J3);
-   #pragma omp critical
-   SixJList[key] = sixj;
+   double sixj;
+   if ( MappedSixJList.Find(key, sixj) ) return sixj;
+   sixj = AngMom::SixJ(0.5*top[0],0.5*top[1],0.5*top[2],0.5*bot[0],0.5*bot[1],0.5*bot[2]);
+   if (not omp_in_parallel())
+     SixJList[key] = sixj;
    return sixj;
 }
 
@@ -1294,6 +1596,7 @@ void ModelSpace::PreCalculateMoshinsky( string basis )
   cout << "systemBasis=" << basis << endl;
   if ( basis == "hydrogen" ) Nmax = 26; // just for testing;
   if ( basis == "harmonic" ) Nmax = E2max;
+  if ( Nmax <= mosh_list_Nmax or Nmax <= MappedMoshList.bound ) return; // Already have them
   #pragma omp parallel for schedule(dynamic,1)
   for (int N=0; N<=Nmax/2; ++N)
   {
@@ -1340,6 +1643,7 @@ void ModelSpace::PreCalculateMoshinsky( string basis )
    #pragma omp critical
    MoshList.insert( local_MoshList.begin(), local_MoshList.end() );
   }
+  mosh_list_Nmax = Nmax;
 }
 
 void ModelSpace::PreCalculateMoshinsky_FromList( vector<unsigned long long int>& mosh_list )
@@ -1496,6 +1800,8 @@ double ModelSpace::GetMoshinsky( int N, int Lam, int n, int lam, int n1, int l1,
 //                                +                 L;
    auto it = MoshList.find(key);
    if ( it != MoshList.end() )  return it->second * phase_mosh;
+   double mapped_mosh;
+   if ( MappedMoshList.Find(key, mapped_mosh) ) return mapped_mosh * phase_mosh;
 	/* unsigned long long int tkey = 0;
 			tkey += pow(100,8)*N;
 			tkey += pow(100,7)*Lam;
@@ -1522,175 +1828,321 @@ double ModelSpace::GetMoshinsky( int N, int Lam, int n, int lam, int n1, int l1,
 
 }
 
-struct my_f_params {int n; double l; int np; int Z;};
+//************************************************************************
+// Persistent cache of the symbol lists
+//************************************************************************
+
+// File layout (all little-endian, as written by WriteSymbolCache):
+//   char     magic[8] = "IMSRGSYM"
+//   uint32   version
+//   uint32   number of sections
+//   for each section:  char name[16], int32 value_size, int32 bound, double param[2], uint64 count, uint64 offset
+//   at each offset:    uint64 keys[count] (sorted), followed by the values[count]
+// param holds whatever the values depend on beyond the key, i.e. {Z, oscillator length} for OsToHydro.
+// The version must be bumped whenever the key encoding of one of the lists changes.
+#define SYMBOL_CACHE_VERSION 3
+
+namespace
+{
+  struct SymbolCacheSection
+  {
+    char name[16];
+    int32_t value_size;
+    int32_t bound;
+    double param[2];
+    uint64_t count;
+    uint64_t offset;
+  };
+
+  // Merge a mapped list with the entries of an in-memory list, and sort by key.
+  template <class K, class T>
+  vector<pair<unsigned long long int,T>> MergeSymbolList( const MappedSymbolList& mapped, const unordered_map<K,T>& newlist)
+  {
+    vector<pair<unsigned long long int,T>> merged;
+    merged.reserve( mapped.size + newlist.size() );
+    for (size_t i=0;i<mapped.size;++i) merged.push_back( make_pair(mapped.keys[i], (T) mapped.GetValue(i)) );
+    for (auto& it : newlist) merged.push_back( make_pair( (unsigned long long int) it.first, it.second) );
+    sort(merged.begin(), merged.end(), [](const pair<unsigned long long int,T>& a, const pair<unsigned long long int,T>& b){return a.first<b.first;} );
+    auto last = unique(merged.begin(), merged.end(), [](const pair<unsigned long long int,T>& a, const pair<unsigned long long int,T>& b){return a.first==b.first;} );
+    merged.erase(last, merged.end());
+    return merged;
+  }
+
+  // Write the keys, then the values, then pad to a multiple of 8 bytes
+  template <class T>
+  void WriteSymbolList( ofstream& outfile, const vector<pair<unsigned long long int,T>>& list)
+  {
+    for (auto& it : list) outfile.write((char*)&it.first, sizeof(uint64_t));
+    for (auto& it : list) outfile.write((char*)&it.second, sizeof(T));
+    size_t pos = outfile.tellp();
+    const char zeros[sizeof(uint64_t)] = {0};
+    outfile.write(zeros, (sizeof(uint64_t) - pos%sizeof(uint64_t)) % sizeof(uint64_t));
+  }
+}
+
+bool MappedSymbolList::Find(unsigned long long int key, double& val) const
+{
+  if (size==0) return false;
+  auto it = lower_bound(keys, keys+size, key);
+  if (it==keys+size or *it != key) return false;
+  val = GetValue(it-keys);
+  return true;
+}
 
-double
-OsToHydroCoeff( double x, void * p )
+long double MappedSymbolList::GetValue(size_t i) const
 {
-	struct my_f_params * params = (struct my_f_params *)p;
-        int n = (params->n);
-        double l = (params->l);
-	int np = (params->np);
-	int Z = (params->Z);//2;//GetTargetZ(); //Fix later
-	double c = Z / (n * BOHR_RADIUS); // 
-	double m = 1; 			// Electron mass, in atomic units
-	double h = 1; 			// Reduced plancks' constant, in atomic units
-	double w = 13.605 * 2 / h; 	// wavelength of oscillator 13.605 *2 ? 
-	double v = m*w/(2*h);
-	       
-	return pow( x, 2*l+2 ) * exp( -v*x*x - c*x ) * gsl_sf_laguerre_n(np, l+0.5, 2*v*x*x) * gsl_sf_laguerre_n(n-l-1, 2*l+1, 2*x*c);
+  if (value_size == sizeof(double))
+  {
+    double val;
+    memcpy(&val, values+i*value_size, sizeof(double));
+    return val;
+  }
+  long double val;
+  memcpy(&val, values+i*value_size, sizeof(long double));
+  return val;
 }
 
-void ModelSpace::GenerateOsToHydroCoeff(int nmax) {
-    cout << "Entering GenerateOsToHydroCoeff." << endl;
-    //OsToHydroCoeffList.resize(1000*46 + 10*nmax + 1*Lmax);
 
-    int size = 1000;
+/// Memory-map a cache file of 6j, 9j and Moshinsky symbols, and of the radial integrals and
+/// oscillator-to-hydrogen coefficients, written by a previous run with WriteSymbolCache().
+/// The file is mapped read-only and shared, so concurrent processes on a node share one copy.
+/// GetSixJ(), GetNineJ() and GetMoshinsky() look up symbols in the mapped file before
+/// computing them, and PreCalculateMoshinsky() is skipped if the file already covers the
+/// requested Nmax. The (small) radList and OsToHydroCoeffList are copied into memory.
+/// Anything computed in this run which isn't in the file is added by WriteSymbolCache().
+/// Returns false if the file doesn't exist yet or can't be used, in which case it will be created
+/// on the next call to WriteSymbolCache().
+bool ModelSpace::LoadSymbolCache(string filename)
+{
+  UnloadSymbolCache();
+  symbol_cache_file = filename;
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    cout << "Symbol cache " << filename << " not found. It will be created." << endl;
+    return false;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  size_t filesize = st.st_size;
+  void* map = filesize>16 ? mmap(nullptr, filesize, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    cout << "Failed to map symbol cache " << filename << ". Ignoring it." << endl;
+    return false;
+  }
+  const char* data = (const char*) map;
+  uint32_t version, nsections;
+  memcpy(&version, data+8, sizeof(uint32_t));
+  memcpy(&nsections, data+12, sizeof(uint32_t));
+  if ( strncmp(data, "IMSRGSYM", 8) != 0 or version != SYMBOL_CACHE_VERSION or 16+nsections*sizeof(SymbolCacheSection) > filesize )
+  {
+    cout << "Symbol cache " << filename << " has the wrong format or version. It will be overwritten." << endl;
+    munmap(map, filesize);
+    return false;
+  }
+  symbol_cache_map = map;
+  symbol_cache_map_size = filesize;
+
+  for (uint32_t isec=0; isec<nsections; ++isec)
+  {
+    SymbolCacheSection sec;
+    memcpy(&sec, data+16+isec*sizeof(SymbolCacheSection), sizeof(SymbolCacheSection));
+    if ( sec.offset + sec.count*(sizeof(uint64_t)+sec.value_size) > filesize or sec.offset%sizeof(uint64_t) != 0 ) continue;
+    if ( sec.value_size != sizeof(double) and sec.value_size != sizeof(long double) ) continue;
+    MappedSymbolList mapped;
+    mapped.keys = (const unsigned long long int*) (data + sec.offset);
+    mapped.values = data + sec.offset + sec.count*sizeof(uint64_t);
+    mapped.size = sec.count;
+    mapped.value_size = sec.value_size;
+    mapped.bound = sec.bound;
+    string name(sec.name, strnlen(sec.name,16));
+    if (name == "SixJ")           MappedSixJList = mapped;
+    else if (name == "NineJ")     MappedNineJList = mapped;
+    else if (name == "Moshinsky") MappedMoshList = mapped;
+    else if (name == "radial")
+    {
+      for (size_t i=0;i<mapped.size;++i) radList.emplace( mapped.keys[i], mapped.GetValue(i) );
+    }
+    else if (name == "OsToHydro")
+    {
+      OsToHydroCoeffList.clear();
+      ostohydro_Z = (int) sec.param[0];
+      ostohydro_b = sec.param[1];
+      for (size_t i=0;i<mapped.size;++i) OsToHydroCoeffList.emplace( mapped.keys[i], mapped.GetValue(i) );
+    }
+  }
+  cout << "Loaded symbol cache " << filename << ":  " << MappedSixJList.size << " 6j, " << MappedNineJList.size << " 9j, "
+       << MappedMoshList.size << " Moshinsky (Nmax = " << MappedMoshList.bound << ")" << endl;
+  return true;
+}
 
-    gsl_integration_workspace *work_ptr =
-    gsl_integration_workspace_alloc (size);
 
-    //gsl_set_error_handler_off();
+/// Write the symbols from the mapped cache file together with everything computed in this run
+/// back to the file named in LoadSymbolCache(). Nothing is written if no new symbols were computed.
+/// The new file is written under a temporary name and then renamed, so other processes which
+/// have the old file mapped are unaffected. If several processes extend the cache at the same time,
+/// the last one to finish wins, and the symbols which only the others computed are simply recomputed next time.
+void ModelSpace::WriteSymbolCache()
+{
+  if (symbol_cache_file == "") return;
+  int mosh_bound = max(mosh_list_Nmax, MappedMoshList.bound);
+  auto sixj = MergeSymbolList( MappedSixJList, SixJList );
+  auto ninej = MergeSymbolList( MappedNineJList, NineJList );
+  auto mosh = MergeSymbolList( MappedMoshList, MoshList );
+  MappedSymbolList nothing;
+  auto rad = MergeSymbolList( nothing, radList );
+  auto ostohydro = MergeSymbolList( nothing, OsToHydroCoeffList );
+  if ( sixj.size()==MappedSixJList.size and ninej.size()==MappedNineJList.size and mosh.size()==MappedMoshList.size
+       and mosh_bound==MappedMoshList.bound and symbol_cache_map != nullptr ) return;
+
+  ostringstream tmpname;
+  tmpname << symbol_cache_file << ".tmp." << getpid();
+  ofstream outfile(tmpname.str(), ios::binary);
+  if (not outfile.good())
+  {
+    cout << "Failed to open " << tmpname.str() << " for writing the symbol cache." << endl;
+    return;
+  }
+  uint32_t version = SYMBOL_CACHE_VERSION;
+  uint32_t nsections = 5;
+  outfile.write("IMSRGSYM", 8);
+  outfile.write((char*)&version, sizeof(uint32_t));
+  outfile.write((char*)&nsections, sizeof(uint32_t));
+
+  uint64_t offset = 16 + nsections*sizeof(SymbolCacheSection);
+  auto write_header = [&](const char* name, int value_size, int bound, size_t count, double param0=0, double param1=0)
+  {
+    SymbolCacheSection sec;
+    memset(&sec, 0, sizeof(sec));
+    strncpy(sec.name, name, 16);
+    sec.value_size = value_size;
+    sec.bound = bound;
+    sec.param[0] = param0;
+    sec.param[1] = param1;
+    sec.count = count;
+    sec.offset = offset;
+    offset += count * (sizeof(uint64_t) + value_size);
+    offset += (sizeof(uint64_t) - offset%sizeof(uint64_t)) % sizeof(uint64_t);
+    outfile.write((char*)&sec, sizeof(sec));
+  };
+  write_header("SixJ", sizeof(double), -1, sixj.size());
+  write_header("NineJ", sizeof(double), -1, ninej.size());
+  write_header("Moshinsky", sizeof(double), mosh_bound, mosh.size());
+  write_header("radial", sizeof(long double), -1, rad.size());
+  write_header("OsToHydro", sizeof(long double), -1, ostohydro.size(), ostohydro_Z, ostohydro_b);
+
+  WriteSymbolList(outfile, sixj);
+  WriteSymbolList(outfile, ninej);
+  WriteSymbolList(outfile, mosh);
+  WriteSymbolList(outfile, rad);
+  WriteSymbolList(outfile, ostohydro);
+  outfile.close();
+
+  if ( rename(tmpname.str().c_str(), symbol_cache_file.c_str()) != 0 )
+  {
+    cout << "Failed to move " << tmpname.str() << " to " << symbol_cache_file << endl;
+    remove(tmpname.str().c_str());
+    return;
+  }
+  cout << "Wrote symbol cache " << symbol_cache_file << ":  " << sixj.size() << " 6j, " << ninej.size() << " 9j, "
+       << mosh.size() << " Moshinsky (Nmax = " << mosh_bound << ")" << endl;
+}
 
-    double lower_limit = 0;	/* start integral from lower_limit (to infinity) */
-    double abs_error = 1.0e-6;	/* to avoid round-off problems */
-    double rel_error = 1.0e-6;	/* the result will usually be much better */
-    double result;		/* the result from the integration */
-    double error;		/* the estimated error from the integration */
 
-    gsl_function My_function;
-    struct my_f_params alpha = {1,0,1,1};
-    My_function.function = &OsToHydroCoeff;
-    My_function.params = &alpha;
-    int Z = GetTargetZ();
-    int npmax = min(32, 4*Emax);
+/// Unmap the symbol cache file. Anything read from it which is needed later will be recomputed.
+void ModelSpace::UnloadSymbolCache()
+{
+  if (symbol_cache_map != nullptr) munmap(symbol_cache_map, symbol_cache_map_size);
+  symbol_cache_map = nullptr;
+  symbol_cache_map_size = 0;
+  MappedSixJList = MappedSymbolList();
+  MappedNineJList = MappedSymbolList();
+  MappedMoshList = MappedSymbolList();
+}
+
 
-    //#pragma omp parallel for schedule(dynamic,1)
-    for (int n = 1.; n <= nmax; n++)
+void ModelSpace::GenerateOsToHydroCoeff(int nmax) {
+    cout << "Entering GenerateOsToHydroCoeff." << endl;
+    int npmax = min(32, 4*Emax);
+    vector<int> hy_list;
+    for (int n = 1; n <= nmax; n++)
     {
-	for (int l = 0.; l < n and l <= Lmax; l++)
+	for (int l = 0; l < n and l <= Lmax; l++)
 	{
-	    double hydrogenCoeff = sqrt( pow(2*Z/(n * BOHR_RADIUS),3) * GetFactorial(n-l-1)/((2*n*GetFactorial(n+l)) ) ) * pow(2*Z/(n * BOHR_RADIUS),l);
-	    //double temp = 0;
-	    //#pragma parallel for schedule(dynamic,1)
-	    for (int np = 0; np <= npmax; np++) // Should goto inf; throws NaN at np > 46; seems to throw at higher if you reduce errors
-	    {
-		alpha.n = n;
-		alpha.l = l;
-		alpha.np = np;
-		alpha.Z = Z;
-        	double OscilCoeff = sqrt( sqrt( 2* pow(13.605,3) / 3.14159 ) * pow(2, np+2*l+3) * GetFactorial(np) * pow(13.605,l) / gsl_sf_doublefact(2*np+2*l+1) ); // can split+cache
-		
-		//cout << "About to integrate; n=" << n << " l=" << l << " np=" << np << " hydrogenCoeff=" << hydrogenCoeff << " OscilCoeff=" << OscilCoeff << endl;
-
-		gsl_integration_qagiu (&My_function,
-					lower_limit,
-					abs_error,
-					rel_error,
-					size,
-					work_ptr,
-					&result,
-					&error);
-	        //if ( isnan(result) == 1 ) continue;
-		
-		if ( std::isnan( result ) ) {
-		    cout << "Hit NaN in Generating os Coeff." << endl;
-		    continue;
-		}
-		int index = 1000*np + 10*n + l;
-		cout << "Index =" << index << endl;
-		cout << "Result=" << result << endl;
-		//cout << "Hcoeff=" << hydrogenCoeff << endl;
-		//cout << "Ocoeff=" << OscilCoeff << endl;
-		//cout << "Coeff =" << OscilCoeff * hydrogenCoeff * result << endl;
-		//if( hydrogenCoeff == 0 or result == 0 or OscilCoeff == 0 ){ // coeffs should never be zero, but just in case of rounding
-		    //cout << "hydrogenCoeff=" << hydrogenCoeff << " temp=" << temp << endl;
-		  //  OsToHydroCoeffList[index] = 0;
-		//} else {
-		    //cout << "Adding " << 1/(hydrogenCoeff*temp) << " to OsToHydro." << endl;
-		if ( OsToHydroCoeffList[index] != 0 ) continue;
-		OsToHydroCoeffList[index] = ( OscilCoeff * hydrogenCoeff * result ); // indexing should be good up to n = 9
-		//cout << "OsToHydroCoeffList[index]=" << OsToHydroCoeffList[index] << endl;
-	    	//}
-	    	//temp += OscilCoeff*result;
-	    } // np
-	    //cout << "About to add for n=" << n << " l=" << l << endl;
-	    
-	    
-	} // l
-    } // n
-
+	    for (int np = 0; np <= npmax; np++) hy_list.push_back( 1000*np + 10*n + l );
+	}
+    }
+    GenerateOsToHydroCoeff_fromlist( hy_list );
     cout << "Exiting GenerateOsToHydroCoeff." << endl;
 }
 
+/// The coefficient with index 1000*np + 10*n + l is the overlap \f$ \int dr\, r^2 \phi_{n'l}(r) R_{nl}(r) \f$
+/// of an oscillator function, with \f$ m\omega/2\hbar = 13.605 \f$ in atomic units, and a hydrogen function.
+/// All of the oscillator and hydrogen functions are tabulated once on a common Gauss-Legendre grid,
+/// and the overlaps come from a single matrix product.
+/// The list only holds coefficients for one Z and oscillator length. If it was filled (or loaded
+/// from the symbol cache) for different ones, it is thrown away and regenerated.
 void ModelSpace::GenerateOsToHydroCoeff_fromlist( vector<int>& hy_list ) {
     cout << "Entering GenerateOsToHydroCoeff_fromList." << endl;
-    //OsToHydroCoeffList.resize(1000*46 + 10*Emax + 1*Lmax); //Arbitrarily large size.
-
-    int size = 1000;
-
-    gsl_integration_workspace *work_ptr =
-    gsl_integration_workspace_alloc (size);
-
-    //gsl_set_error_handler_off();
-
-    double lower_limit = 0;	/* start integral from lower_limit (to infinity) */
-    double abs_error = 1.0e-6;	/* to avoid round-off problems */
-    double rel_error = 1.0e-6;	/* the result will usually be much better */
-    double result;		/* the result from the integration */
-    double error;		/* the estimated error from the integration */
-
-    gsl_function My_function;
-    struct my_f_params alpha = {1,0,1,1};
-    My_function.function = &OsToHydroCoeff;
-    My_function.params = &alpha;
+    double v = 13.605;
+    double b = 1/sqrt(2*v); // oscillator length
     int Z = GetTargetZ();
+    if ( Z != ostohydro_Z or b != ostohydro_b )
+    {
+	if ( not OsToHydroCoeffList.empty() )
+	  cout << "OsToHydroCoeffList was made with Z = " << ostohydro_Z << ", b = " << ostohydro_b << ". Regenerating it for Z = " << Z << endl;
+	OsToHydroCoeffList.clear();
+	ostohydro_Z = Z;
+	ostohydro_b = b;
+    }
 
-    //#pragma omp parallel for
-    for ( unsigned long long int it=0; it<hy_list.size(); it++ )
+    vector<int> new_list;
+    vector<array<int,2>> os_nl;
+    vector<array<int,2>> hy_nl;
+    map<array<int,2>,int> os_row;
+    map<array<int,2>,int> hy_row;
+    int nlmax = 0;
+    for ( int index : hy_list )
     {
-	auto iter = OsToHydroCoeffList.find(hy_list[it]);
-	if (iter != OsToHydroCoeffList.end() ) continue;
-	int temp = hy_list[it];
-	if ( temp == 0 ) continue;
-	alpha.l = temp%10;
-	int l = alpha.l;
-	temp -= alpha.l;
-	temp /= 10;
-	alpha.n = temp%100;
-	int n = alpha.n;
-	temp -= alpha.n;
-	temp /= 100;
-	alpha.np = temp;
-	int np = alpha.np;
-	alpha.Z = Z;
-	double hydrogenCoeff = sqrt( pow(2*Z/(n * BOHR_RADIUS),3) * GetFactorial(n-l-1)/((2*n*GetFactorial(n+l)) ) ) * pow(2*Z/(n * BOHR_RADIUS),l);
-        double OscilCoeff = sqrt( sqrt( 2* pow(13.605,3) / 3.14159 ) * pow(2, np+2*l+3) * GetFactorial(np) * pow(13.605,l) / gsl_sf_doublefact(2*np+2*l+1) ); // can split+cache
-		
-	//cout << "About to integrate; n=" << n << " l=" << l << " np=" << np << " hydrogenCoeff=" << hydrogenCoeff << " OscilCoeff=" << OscilCoeff << endl;
-	gsl_integration_qagiu (&My_function,
-				lower_limit,
-				abs_error,
-				rel_error,
-				size,
-				work_ptr,
-				&result,
-				&error);
-        //if ( isnan(result) == 1 ) continue;
-	
-	if ( std::isnan( result ) ) {
-	    cout << "Hit NaN in Generating os Coeff." << endl;
-	    continue;
+	if ( index == 0 ) continue;
+	if ( OsToHydroCoeffList.find(index) != OsToHydroCoeffList.end() ) continue;
+	int l = index%10;
+	int n = (index/10)%100;
+	int np = index/1000;
+	array<int,2> os = {{np,l}};
+	array<int,2> hy = {{n,l}};
+	if ( os_row.find(os) == os_row.end() )
+	{
+	    os_row[os] = os_nl.size();
+	    os_nl.push_back(os);
+	}
+	if ( hy_row.find(hy) == hy_row.end() )
+	{
+	    hy_row[hy] = hy_nl.size();
+	    hy_nl.push_back(hy);
 	}
-	//int index = 1000*np + 10*n + l;
-	//cout << "Index =" << index << endl;
-	//cout << "Result=" << result << endl;
+	nlmax = max(nlmax, np+l);
+	new_list.push_back(index);
+    }
+    if ( new_list.empty() ) return;
 
+    // The oscillator functions fall off like x^(2np+2l+2) exp(-x^2), with x=r/b.
+    // The panels have to resolve the smaller of b and the size of the hydrogen 1s orbit.
+    vector<double> R, W;
+    RadialBasis::GaussLegendre( b*sqrt(60+4*nlmax), min(b, BOHR_RADIUS/Z), 16, R, W );
+    RadialBasis oscillator("harmonic", b, os_nl, R, W);
+    RadialBasis hydrogen("hydrogen", Z, hy_nl, R, W);
+    arma::mat overlap = oscillator.Overlap(hydrogen);
 
-	#pragma omp critical
-	OsToHydroCoeffList[hy_list[it]] = ( OscilCoeff * hydrogenCoeff * result ); // indexing should be good up to n = 99
-    } // np
-    //cout << "About to add for n=" << n << " l=" << l << endl;
+    for ( int index : new_list )
+    {
+	int l = index%10;
+	int n = (index/10)%100;
+	int np = index/1000;
+	OsToHydroCoeffList[index] = overlap( os_row.at({{np,l}}), hy_row.at({{n,l}}) );
+    }
     cout << "Exiting GenerateOsToHydroCoeff_fromList." << endl;
 }
 
@@ -1824,6 +2276,242 @@ void ModelSpace::PrecalculateNineJ( vector<unsigned long long int>& ninejList )
     }
 }
 
+/// Fill the dense table NineJTable_LS of 9j symbols
+/// \f[ \left\{ \begin{array}{lll} l_a & 1/2 & j_a \\ l_b & 1/2 & j_b \\ L & S & J \end{array} \right\} \f]
+/// used for LS to jj recoupling, for all orbits in the model space.
+void ModelSpace::PreCalculateNineJ_LS()
+{
+   int lmax = 0;
+   for (auto& orb : Orbits) lmax = max(lmax, orb.l);
+   int j2max = OneBodyJmax;
+   if (lmax <= ninej_table_lmax and j2max <= ninej_table_j2max) return;
+   lmax = max(lmax, ninej_table_lmax);
+   j2max = max(j2max, ninej_table_j2max);
+   int nl = lmax+1;
+   int nL = 2*lmax+1;
+   int nJ = j2max+1;
+   vector<double> table( nl*2*nl*2*nL*2*nJ, 0.0);
+   #pragma omp parallel for schedule(dynamic,1) collapse(2)
+   for (int la=0; la<nl; ++la)
+   {
+     for (int lb=0; lb<nl; ++lb)
+     {
+       for (int a=0; a<2; ++a)
+       {
+         int ja2 = 2*la+2*a-1;
+         if (ja2<0) continue;
+         for (int b=0; b<2; ++b)
+         {
+           int jb2 = 2*lb+2*b-1;
+           if (jb2<0) continue;
+           for (int L=abs(la-lb); L<=la+lb; ++L)
+           {
+             for (int S=0; S<=1; ++S)
+             {
+               for (int J=max(abs(L-S),abs(ja2-jb2)/2); J<=min(L+S,(ja2+jb2)/2) and J<nJ; ++J)
+               {
+                 size_t index = (((((la*2+a)*nl + lb)*2 + b)*nL + L)*2 + S)*nJ + J;
+                 table[index] = AngMom::NineJ(la,0.5,0.5*ja2, lb,0.5,0.5*jb2, L,S,J);
+               }
+             }
+           }
+         }
+       }
+     }
+   }
+   NineJTable_LS = move(table);
+   ninej_table_lmax = lmax;
+   ninej_table_j2max = j2max;
+}
+
+
+/// Add to plan the terms of the 6j recoupling
+/// \f[ -\sum_{J} (2J+1) \left\{ \begin{array}{lll} j_1 & j_2 & J_{cc} \\ j_3 & j_4 & J \end{array} \right\} \tilde{\Gamma}^{J}_{pqrs} \f]
+/// where the matrix element is looked up as in TwoBodyME::GetTBME_J().
+/// Terms which are zero by the selection rules or the 6j symbol are left out.
+static void AddPandyaTerms(ModelSpace& ms, PandyaPlan& plan, double j1, double j2, int J_cc, double j3, double j4, int p, int q, int r, int s)
+{
+   Orbit& op = ms.GetOrbit(p);
+   Orbit& oq = ms.GetOrbit(q);
+   Orbit& or_ = ms.GetOrbit(r);
+   Orbit& os = ms.GetOrbit(s);
+   int parity = (op.l+oq.l)%2;
+   int Tz = (op.tz2+oq.tz2)/2;
+   if ( parity != (or_.l+os.l)%2 or Tz != (or_.tz2+os.tz2)/2 ) return;
+   int jmin = max(abs(j1-j4),abs(j3-j2));
+   int jmax = min(j1+j4,j3+j2);
+   for (int J=jmin; J<=jmax; ++J)
+   {
+      double sixj = ms.GetSixJ(j1,j2,J_cc,j3,j4,J);
+      if (abs(sixj) < 1e-8) continue;
+      int ch = ms.GetTwoBodyChannelIndex(J,parity,Tz);
+      TwoBodyChannel& tbc = ms.GetTwoBodyChannel(ch);
+      int bra_ind = tbc.GetLocalIndex(min(p,q),max(p,q));
+      int ket_ind = tbc.GetLocalIndex(min(r,s),max(r,s));
+      if (bra_ind < 0 or ket_ind < 0) continue;
+      double w = -(2*J+1) * sixj;
+      if (p==q) w *= SQRT2;
+      if (r==s) w *= SQRT2;
+      if (p>q) w *= tbc.GetKet(bra_ind).Phase(J);
+      if (r>s) w *= tbc.GetKet(ket_ind).Phase(J);
+      plan.channel.push_back(ch);
+      plan.index.push_back(bra_ind + ket_ind*tbc.GetNumberKets());
+      plan.weight.push_back(w);
+   }
+}
+
+/// Add to plan the terms of the inverse Pandya transformation for \f$ \bar{Z}_{il,kj} \f$ coupled to J',
+/// with weight factor times \f$ (2J'+1) \{ j_i j_j J ; j_k j_l J' \} \f$.
+/// Zbar for cross-coupled channel ch_cc is assumed to be a \f$ 2N \times 2N \f$ matrix, with N the number of kets in the channel.
+static void AddInversePandyaTerms(ModelSpace& ms, PandyaPlan& plan, int i, int j, int k, int l, int J, double factor)
+{
+   Orbit& oi = ms.GetOrbit(i);
+   Orbit& oj = ms.GetOrbit(j);
+   Orbit& ok = ms.GetOrbit(k);
+   Orbit& ol = ms.GetOrbit(l);
+   double ji = oi.j2/2.;
+   double jj = oj.j2/2.;
+   double jk = ok.j2/2.;
+   double jl = ol.j2/2.;
+   int parity_cc = (oi.l+ol.l)%2;
+   int Tz_cc = abs(oi.tz2+ol.tz2)/2;
+   int jmin = max(abs(int(ji-jl)),abs(int(jk-jj)));
+   int jmax = min(int(ji+jl),int(jk+jj));
+   for (int Jprime=jmin; Jprime<=jmax; ++Jprime)
+   {
+      double sixj = ms.GetSixJ(ji,jj,J,jk,jl,Jprime);
+      if (abs(sixj)<1e-8) continue;
+      int ch_cc = ms.GetTwoBodyChannelIndex(Jprime,parity_cc,Tz_cc);
+      TwoBodyChannel_CC& tbc_cc = ms.GetTwoBodyChannel_CC(ch_cc);
+      int nKets_cc = tbc_cc.GetNumberKets();
+      int indx_il = tbc_cc.GetLocalIndex(min(i,l),max(i,l));
+      int indx_kj = tbc_cc.GetLocalIndex(min(j,k),max(j,k));
+      if (indx_il == -1 or indx_kj == -1) continue;
+      if (i>l) indx_il += nKets_cc;
+      if (k>j) indx_kj += nKets_cc;
+      plan.channel.push_back(ch_cc);
+      plan.index.push_back(indx_il + indx_kj*2*nKets_cc);
+      plan.weight.push_back( factor * (2*Jprime+1) * sixj );
+   }
+}
+
+/// Precompute the orbit lookups, 6j symbols, phases and matrix element positions used by
+/// Operator::DoPandyaTransformation() and Operator::AddInversePandyaTransformation(),
+/// so that the transformations become sums over flat lists of (channel, position, weight).
+/// The forward plans have two output elements, direct and exchange, for each ph or hh bra and each ket
+/// of the cross-coupled channel. The inverse plans have one for each bra and each ket at or above it.
+/// The plans take several times the memory of the transformed matrices, so building stops
+/// and pandya_plans_too_big is set if they would take more than pandya_plans_max_memory MB.
+/// The Pandya transformations then go back to working out the recoupling on the fly.
+/// The plans depend on the reference, so they're thrown away by ClearVectors().
+void ModelSpace::BuildPandyaPlans()
+{
+   double t_start = omp_get_wtime();
+   vector<PandyaPlan> plans(nTwoBodyChannels);
+   size_t memory = 0;
+   size_t max_memory = pandya_plans_max_memory * 1024 * 1024;
+   auto over_budget = [&]()
+   {
+      cout << "Pandya plans would take more than " << pandya_plans_max_memory << " MB. Not using them." << endl;
+      PandyaPlans.clear();
+      InversePandyaPlans.clear();
+      pandya_plans_too_big = true;
+   };
+   for (int ch_cc : SortedTwoBodyChannels_CC)
+   {
+      TwoBodyChannel_CC& tbc_cc = TwoBodyChannels_CC[ch_cc];
+      PandyaPlan& plan = plans[ch_cc];
+      int nKets_cc = tbc_cc.GetNumberKets();
+      arma::uvec kets_ph = arma::join_cols(tbc_cc.GetKetIndex_hh(), tbc_cc.GetKetIndex_ph() );
+      int J_cc = tbc_cc.J;
+      plan.start.push_back(0);
+      for (index_t ibra=0; ibra<kets_ph.n_rows; ++ibra)
+      {
+         Ket & bra_cc = tbc_cc.GetKet( kets_ph[ibra] );
+         int a = bra_cc.p;
+         int b = bra_cc.q;
+         double ja = Orbits[a].j2*0.5;
+         double jb = Orbits[b].j2*0.5;
+         for (int iket_cc=0; iket_cc<nKets_cc; ++iket_cc)
+         {
+            Ket & ket_cc = tbc_cc.GetKet(iket_cc);
+            int c = ket_cc.p;
+            int d = ket_cc.q;
+            double jc = Orbits[c].j2*0.5;
+            double jd = Orbits[d].j2*0.5;
+            plan.phase.push_back( phase(ja+jb+jc+jd) );
+            AddPandyaTerms(*this, plan, ja, jb, J_cc, jc, jd, a, d, c, b);
+            plan.start.push_back( plan.weight.size() );
+            AddPandyaTerms(*this, plan, jb, ja, J_cc, jc, jd, b, d, c, a); // exchange a <-> b
+            plan.start.push_back( plan.weight.size() );
+         }
+         if ( memory + plan.Memory() > max_memory )  return over_budget();
+      }
+      memory += plan.Memory();
+   }
+
+   vector<PandyaPlan> inverse_plans(nTwoBodyChannels);
+   for (int ch : SortedTwoBodyChannels)
+   {
+      TwoBodyChannel& tbc = TwoBodyChannels[ch];
+      PandyaPlan& plan = inverse_plans[ch];
+      int J = tbc.J;
+      int nKets = tbc.GetNumberKets();
+      plan.start.push_back(0);
+      for (int ibra=0; ibra<nKets; ++ibra)
+      {
+         Ket & bra = tbc.GetKet(ibra);
+         int i = bra.p;
+         int j = bra.q;
+         double ji = Orbits[i].j2/2.;
+         double jj = Orbits[j].j2/2.;
+         for (int iket=ibra; iket<nKets; ++iket)
+         {
+            Ket & ket = tbc.GetKet(iket);
+            int k = ket.p;
+            int l = ket.q;
+            double norm = bra.delta_pq()==ket.delta_pq() ? 1+bra.delta_pq() : SQRT2;
+            AddInversePandyaTerms(*this, plan, i, j, k, l, J, 1.0/norm);
+            AddInversePandyaTerms(*this, plan, j, i, k, l, J, -phase(ji+jj-J)/norm);
+            plan.start.push_back( plan.weight.size() );
+         }
+         if ( memory + plan.Memory() > max_memory )  return over_budget();
+      }
+      memory += plan.Memory();
+   }
+
+   PandyaPlans = move(plans);
+   InversePandyaPlans = move(inverse_plans);
+   cout << "Built Pandya plans  (" << memory/1024./1024. << " MB, "
+        << omp_get_wtime()-t_start << " s)" << endl;
+}
+
+/// Build the plans if they haven't been yet. This is safe to call from a parallel region.
+/// The list is empty if the plans are over the memory budget.
+const vector<PandyaPlan>& ModelSpace::GetPandyaPlans()
+{
+   #pragma omp critical(PandyaPlans)
+   {
+     if (PandyaPlans.empty() and not pandya_plans_too_big) BuildPandyaPlans();
+   }
+   return PandyaPlans;
+}
+
+const vector<PandyaPlan>& ModelSpace::GetInversePandyaPlans()
+{
+   #pragma omp critical(PandyaPlans)
+   {
+     if (InversePandyaPlans.empty() and not pandya_plans_too_big) BuildPandyaPlans();
+   }
+   return InversePandyaPlans;
+}
+
+
+/// Look up the 9j symbol
+/// \f[ \left\{ \begin{array}{lll} j_1 & j_2 & J_{12} \\ j_3 & j_4 & J_{34} \\ J_{13} & J_{24} & J \end{array} \right\} \f]
+/// LS-jj recoupling symbols are read from the dense table NineJTable_LS. Anything else is
+/// brought to a canonical form and cached in NineJList, but (as with GetSixJ()) new entries are
+/// only stored outside of parallel regions, so this is safe to call from anywhere.
 double ModelSpace::GetNineJ(double j1, double j2, double J12, double j3, double j4, double J34, double J13, double J24, double J)
 {
 //   cout << "Calling GetNineJ" << endl;
@@ -1837,6 +2525,19 @@ double ModelSpace::GetNineJ(double j1, double j2, double J12, double j3, double
    int K24 = 2*J24;
    int K = 2*J;
 
+   // { la 1/2 ja ; lb 1/2 jb ; L S J }
+   if ( k2==1 and k4==1 and k1%2==0 and k3%2==0 and K24<=2 and K24%2==0 and K13%2==0 and K%2==0
+        and k1<=2*ninej_table_lmax and k3<=2*ninej_table_lmax and K<=2*ninej_table_j2max
+        and abs(K12-k1)==1 and abs(K34-k3)==1 )
+   {
+     int nl = ninej_table_lmax+1;
+     int nL = 2*ninej_table_lmax+1;
+     int nJ = ninej_table_j2max+1;
+     if ( K13 >= 2*nL ) return 0;
+     size_t index = ((((((k1/2)*2+(K12-k1+1)/2)*nl + k3/2)*2 + (K34-k3+1)/2)*nL + K13/2)*2 + K24/2)*nJ + K/2;
+     return NineJTable_LS[index];
+   }
+
    array<int,9> klist = {k1,k2,K12,k3,k4,K34,K13,K24,K};
    array<double,9> jlist = {j1,j2,J12,j3,j4,J34,J13,J24,J};
    int imin = min_element(klist.begin(),klist.end()) - klist.begin();
@@ -1890,11 +2591,13 @@ double ModelSpace::GetNineJ(double j1, double j2, double J12, double j3, double
    {
      return it->second;
    }
+   double ninej;
+   if ( MappedNineJList.Find(key, ninej) ) return ninej;
    //cout << "Missing NineJ, making a new one; key=" << key << endl;
-   double ninej = AngMom::NineJ(jlist[0],jlist[1],jlist[2],jlist[3],jlist[4],jlist[5],jlist[6],jlist[7],jlist[8]);
+   ninej = AngMom::NineJ(jlist[0],jlist[1],jlist[2],jlist[3],jlist[4],jlist[5],jlist[6],jlist[7],jlist[8]);
    //cout << "NineJ calculated." << endl;
-   #pragma omp critical
-   NineJList[key] = ninej;
+   if (not omp_in_parallel())
+     NineJList[key] = ninej;
    //cout << "Nine J added to list, returning." << endl;
    return ninej;
 
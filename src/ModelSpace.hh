@@ -126,6 +126,9 @@ class TwoBodyChannel
    arma::uvec& GetKetIndex_vv();
    arma::uvec& GetKetIndex_qv();
    arma::uvec& GetKetIndex_qq();
+   arma::uvec& GetKetIndexFromClass(string ketclass); ///< e.g. "cc" returns GetKetIndex_cc()
+   static bool IsContiguous(const arma::uvec& kets);
+   static bool order_kets_by_class; ///< If false, the kets stay in ModelSpace order. Only for imsrg_util::KetOrderingTest().
 
 
 // private:
@@ -136,6 +139,7 @@ class TwoBodyChannel
    vector<int> KetMap;  // eg [ -1, -1, 0, -1, 1, -1, -1, 2 ...] Used for asking what is the local index of this ket. -1 means the ket doesn't participate in this channel
    //Methods
    virtual bool CheckChannel_ket(Orbit* op, Orbit* oq) const;  // check if |pq> participates in this channel
+   int KetClassRank(int ketindex) const; // sort key which keeps the kets of each class together
    bool CheckChannel_ket(Ket &ket) const {return CheckChannel_ket(ket.op,ket.oq);};  // check if |pq> participates in this channel
    
 };
@@ -156,6 +160,50 @@ class TwoBodyChannel_CC : public TwoBodyChannel
 
 
 
+/// A sorted list of (key,value) pairs in a memory-mapped symbol cache file.
+/// See ModelSpace::LoadSymbolCache().
+struct MappedSymbolList
+{
+  const unsigned long long int* keys = nullptr;
+  const char* values = nullptr;
+  size_t size = 0;
+  int value_size = 0;
+  int bound = -1; ///< for lists which are complete up to some bound, e.g. E2max for the Moshinsky brackets
+  bool Find(unsigned long long int key, double& val) const;
+  long double GetValue(size_t i) const;
+};
+
+
+
+/// Precomputed recoupling for a Pandya transformation in one channel, see ModelSpace::BuildPandyaPlans().
+/// Output element e of the transformation is \f$ \sum_t w_t M^{ch_t}[i_t] \f$ for t in [start[e],start[e+1]),
+/// where \f$ M^{ch_t} \f$ is the (column-major) matrix of channel ch_t that is being transformed.
+/// The weights include the 6j symbol, the (2J+1) factor and the phases and normalization of the matrix elements.
+/// The number of terms in a channel can exceed the range of an int for large emax, so start and index are size_t.
+struct PandyaPlan
+{
+  vector<size_t> start;
+  vector<int> channel;
+  vector<size_t> index;
+  vector<double> weight;
+  vector<int> phase; ///< For the forward transformation, \f$ (-1)^{j_a+j_b+j_c+j_d} \f$ for each <ab|cd>
+
+  /// Sum over the terms of output element e, where blocks[ch] points to the matrix of channel ch
+  double Sum(size_t e, const double* const* blocks) const
+  {
+    double sm = 0;
+    for (size_t t=start[e]; t<start[e+1]; ++t) sm += weight[t] * blocks[channel[t]][index[t]];
+    return sm;
+  };
+  size_t Memory() const
+  {
+    return start.size()*sizeof(size_t) + channel.size()*sizeof(int) + index.size()*sizeof(size_t)
+         + weight.size()*sizeof(double) + phase.size()*sizeof(int);
+  };
+};
+
+
+
 class ModelSpace
 {
 
@@ -247,7 +295,6 @@ class ModelSpace
    double GetSixJ(double j1, double j2, double j3, double J1, double J2, double J3);
    double GetNineJ(double j1, double j2, double j3, double j4, double j5, double j6, double j7, double j8, double j9);
    double GetMoshinsky( int N, int Lam, int n, int lam, int n1, int l1, int n2, int l2, int L); // Inconsistent notation. Not ideal.
-   bool SixJ_is_empty(){ return SixJList.empty(); };
    double GetFactorial(double m);
 
    int GetOrbitIndex(string);
@@ -269,6 +316,19 @@ class ModelSpace
    void GenerateOsToHydroCoeff( int nmax );
    void GenerateOsToHydroCoeff_fromlist( vector<int>& hy_list );
    void PrecalculateNineJ( vector<unsigned long long int>& ninejList );
+   void PreCalculateSixJ(); ///< Fill the dense 6j tables up to the largest j in the model space
+   void PreCalculateSixJ_Tables(int j2max);
+   void PreCalculateSixJ_Sparse(int table_j2max, int j2max);
+   static void SetSixJTableMaxMemory(double mb){sixj_table_max_memory = mb;};
+   void PreCalculateNineJ_LS(); ///< Fill the dense table of LS-jj recoupling 9j symbols
+   void BuildPandyaPlans();
+   const vector<PandyaPlan>& GetPandyaPlans(); ///< Indexed by cross-coupled channel, built on first use
+   const vector<PandyaPlan>& GetInversePandyaPlans(); ///< Indexed by two-body channel, built on first use
+   static void SetPandyaPlansMaxMemory(double mb){pandya_plans_max_memory = mb;};
+
+   static bool LoadSymbolCache(string filename);
+   static void WriteSymbolCache();
+   static void UnloadSymbolCache();
 
    // Data members
    vector<index_t> holes;           // in the reference Slater determinant
@@ -314,6 +374,11 @@ class ModelSpace
    vector<unsigned int> SortedTwoBodyChannels;
    vector<unsigned int> SortedTwoBodyChannels_CC;
 
+   vector<PandyaPlan> PandyaPlans; ///< For Operator::DoPandyaTransformation()
+   vector<PandyaPlan> InversePandyaPlans; ///< For Operator::AddInversePandyaTransformation()
+   bool pandya_plans_too_big = false; ///< Set if building the plans went over pandya_plans_max_memory, so they aren't tried again
+   static double pandya_plans_max_memory; ///< in MB
+
    static map<string,vector<string>> ValenceSpaces;
 
 
@@ -335,12 +400,35 @@ class ModelSpace
    static unordered_map<long long unsigned int, long double> radList;
     
    static unordered_map<long long unsigned int, long double> OsToHydroCoeffList;
+   static int ostohydro_Z; ///< target Z for which OsToHydroCoeffList was generated
+   static double ostohydro_b; ///< oscillator length for which OsToHydroCoeffList was generated
    //static unordered_map<long long unsigned int,double> OsToHydroCoeffList; // convert to map?
 
 
    static unordered_map<unsigned long int,double> SixJList;
    static unordered_map<long long unsigned int,double> NineJList;
+
+   // Dense, read-only tables of 6j and 9j symbols, filled once at setup so that
+   // GetSixJ() and GetNineJ() can be called from parallel regions without locking.
+   // Half-integer j are indexed by (2j-1)/2 and integer J by J.
+   static vector<double> SixJTable_hhi; ///< { ja jb J ; jc jd J' }, packed over the column pair ({ja,jc},{jb,jd})
+   static vector<double> SixJTable_iii; ///< { J1 J2 J3 ; ja jb jc }, with J1<=J2<=J3
+   static vector<double> NineJTable_LS; ///< { la 1/2 ja ; lb 1/2 jb ; L S J }
+   static int sixj_table_j2max; ///< Largest 2j of the half-integer arguments in the 6j tables
+   static int sixj_precalc_j2max; ///< Largest 2j for which PreCalculateSixJ() has been done
+   static double sixj_table_max_memory; ///< in MB. Above this, the { h h i ; h h i } symbols go in SixJList
+   static int ninej_table_lmax; ///< Largest l in the LS-jj 9j table
+   static int ninej_table_j2max; ///< Largest 2j in the LS-jj 9j table
    static unordered_map<long long unsigned int,double> MoshList;
+   static int mosh_list_Nmax; ///< MoshList holds every bracket with 2N+Lam+2n+lam up to this
+
+   // Persistent cache of the lists above, see LoadSymbolCache()
+   static string symbol_cache_file;
+   static void* symbol_cache_map;
+   static size_t symbol_cache_map_size;
+   static MappedSymbolList MappedSixJList;
+   static MappedSymbolList MappedNineJList;
+   static MappedSymbolList MappedMoshList;
 
 };
 
@@ -2,6 +2,7 @@
 #include "Operator.hh"
 #include "AngMom.hh"
 #include "IMSRGProfiler.hh"
+#include "ChannelScheduler.hh"
 #include <cmath>
 #include <iostream>
 #include <iomanip>
@@ -22,14 +23,104 @@ using namespace std;
 //double  Operator::bch_transform_threshold = 1e-6;
 double  Operator::bch_transform_threshold = 1e-9;
 double  Operator::bch_product_threshold = 1e-4;
-bool Operator::tensor_transform_first_pass = true; // Flag to check if we've calculated a commutator yet
 bool Operator::use_brueckner_bch = false;
+bool Operator::use_pandya_bch_cache = true;
+bool Operator::use_pandya_plans = false;
+double Operator::commutator_screening_threshold = 0; // by default, only skip blocks which are exactly zero
+int Operator::small_channel_dimension = 16;
 
-Operator& Operator::TempOp(size_t n)
+/// Estimated cost of a matrix multiplication in each of the SortedTwoBodyChannels, for ChannelScheduler::Run()
+static vector<double> GEMMCost(ModelSpace* modelspace)
 {
-  static deque<Operator> TempArray;
-  if (n >= TempArray.size()) TempArray.resize(n+1,*this);
-  return TempArray[n];
+  vector<double> cost;
+  for (int ch : modelspace->SortedTwoBodyChannels)
+  {
+    double nkets = modelspace->GetTwoBodyChannel(ch).GetNumberKets();
+    cost.push_back( nkets*nkets*nkets );
+  }
+  return cost;
+}
+
+/// Shapes (rows, inner dimension, columns) of the matrix products in each of the SortedTwoBodyChannels,
+/// for ChannelScheduler::BucketByShape()
+static vector<array<int,3>> GEMMShapes(ModelSpace* modelspace)
+{
+  vector<array<int,3>> shapes;
+  for (int ch : modelspace->SortedTwoBodyChannels)
+  {
+    int nkets = modelspace->GetTwoBodyChannel(ch).GetNumberKets();
+    shapes.push_back( {{nkets,nkets,nkets}} );
+  }
+  return shapes;
+}
+
+/// Estimated cost of a Pandya transformation in each of the SortedTwoBodyChannels (_CC if cc is true),
+/// for ChannelScheduler::Run(). This is the number of bra-ket pairs times the typical range of the recoupled J.
+static vector<double> PandyaCost(ModelSpace* modelspace, bool cc)
+{
+  vector<double> cost;
+  for (int ch : (cc ? modelspace->SortedTwoBodyChannels_CC : modelspace->SortedTwoBodyChannels) )
+  {
+    TwoBodyChannel& tbc = cc ? modelspace->GetTwoBodyChannel_CC(ch) : modelspace->GetTwoBodyChannel(ch);
+    int nkets = tbc.GetNumberKets();
+    double jrange = 0;
+    for (int iket=0; iket<nkets; ++iket)
+    {
+      Ket& ket = tbc.GetKet(iket);
+      jrange += min(ket.op->j2, ket.oq->j2) + 1;
+    }
+    cost.push_back( nkets * jrange );
+  }
+  return cost;
+}
+
+//////////////////// COMMUTATOR WORKSPACE ////////////////////////////////
+
+int CommutatorWorkspace::tensor_first_pass_generation = 0;
+
+CommutatorWorkspace::CommutatorWorkspace()
+: pandya_cache_owner(NULL), tensor_pass_generation(-1)
+{}
+
+CommutatorWorkspace& CommutatorWorkspace::Default()
+{
+  static CommutatorWorkspace ws;
+  return ws;
+}
+
+void CommutatorWorkspace::SetUpIntermediates(ModelSpace* ms)
+{
+  if (Mpp.modelspace == ms and Mhh.modelspace == ms) return;
+  Mpp = TwoBodyME(ms);
+  Mhh = TwoBodyME(ms);
+}
+
+/// The cache is keyed on the address of X, so it must be cleared
+/// with ClearPandyaCache() before X is modified.
+void CommutatorWorkspace::BuildPandyaCache(const Operator& X)
+{
+  double t_start = omp_get_wtime();
+  X.InitializePandya( pandya_cache, X.nChannels, "transpose");
+  X.DoPandyaTransformation( pandya_cache, "transpose");
+  pandya_cache_owner = &X;
+  X.profiler.timer["DoPandyaTransformation"] += omp_get_wtime() - t_start;
+}
+
+void CommutatorWorkspace::ClearPandyaCache()
+{
+  pandya_cache_owner = NULL;
+}
+
+/// The next commutator using this workspace will allocate everything again.
+void CommutatorWorkspace::Release()
+{
+  Mpp = TwoBodyME();
+  Mhh = TwoBodyME();
+  deque<arma::mat>().swap(X_bar);
+  deque<arma::mat>().swap(Y_bar);
+  deque<arma::mat>().swap(Z_bar);
+  deque<arma::mat>().swap(pandya_cache);
+  pandya_cache_owner = NULL;
 }
 
 //vector<arma::mat>& Operator::TempMatVec(size_t n)
@@ -90,7 +181,7 @@ Operator::Operator(const Operator& op)
   rank_J(op.rank_J), rank_T(op.rank_T), parity(op.parity), particle_rank(op.particle_rank),
   E2max(op.E2max), E3max(op.E3max), 
   hermitian(op.hermitian), antihermitian(op.antihermitian),
-  nChannels(op.nChannels), OneBodyChannels(op.OneBodyChannels)
+  nChannels(op.nChannels), OneBodyChannels(op.OneBodyChannels), TwoBodyKetClasses(op.TwoBodyKetClasses)
 {
   profiler.counter["N_Operators"] ++;
 }
@@ -101,7 +192,7 @@ Operator::Operator(Operator&& op)
   rank_J(op.rank_J), rank_T(op.rank_T), parity(op.parity), particle_rank(op.particle_rank),
   E2max(op.E2max), E3max(op.E3max), 
   hermitian(op.hermitian), antihermitian(op.antihermitian),
-  nChannels(op.nChannels), OneBodyChannels(op.OneBodyChannels)
+  nChannels(op.nChannels), OneBodyChannels(op.OneBodyChannels), TwoBodyKetClasses(op.TwoBodyKetClasses)
 {
   profiler.counter["N_Operators"] ++;
 }
@@ -160,7 +251,10 @@ Operator& Operator::operator+=(const Operator& rhs)
    ZeroBody += rhs.ZeroBody;
    OneBody  += rhs.OneBody;
    if (rhs.GetParticleRank() > 1)
+   {
      TwoBody  += rhs.TwoBody;
+     if (rhs.TwoBodyKetClasses != TwoBodyKetClasses) TwoBodyKetClasses.clear();
+   }
    return *this;
 }
 
@@ -189,7 +283,10 @@ Operator& Operator::operator-=(const Operator& rhs)
    ZeroBody -= rhs.ZeroBody;
    OneBody -= rhs.OneBody;
    if (rhs.GetParticleRank() > 1)
+   {
      TwoBody -= rhs.TwoBody;
+     if (rhs.TwoBodyKetClasses != TwoBodyKetClasses) TwoBodyKetClasses.clear();
+   }
    return *this;
 }
 
@@ -219,6 +316,7 @@ Operator Operator::operator-() const
 
 void Operator::SetUpOneBodyChannels()
 {
+  OneBodyChannels.clear();
   for ( int i=0; i<modelspace->GetNumberOrbits(); ++i )
   {
     Orbit& oi = modelspace->GetOrbit(i);
@@ -242,6 +340,24 @@ void Operator::SetUpOneBodyChannels()
   for (auto& it: OneBodyChannels)  it.second.shrink_to_fit();
 }
 
+/// Since the generators only fill specific blocks of the two-body matrices,
+/// they record which ones with this, so the commutators can skip the rest.
+/// Eta is antihermitian, so the transposed blocks are marked as well.
+void Operator::AddTwoBodyKetClasses(vector<string> bras, vector<string> kets)
+{
+  for (auto& bra : bras)
+  {
+    for (auto& ket : kets)
+    {
+      for ( array<string,2> block : { array<string,2>{bra,ket}, array<string,2>{ket,bra} } )
+      {
+        if ( find(TwoBodyKetClasses.begin(),TwoBodyKetClasses.end(),block) == TwoBodyKetClasses.end() )
+          TwoBodyKetClasses.push_back(block);
+      }
+    }
+  }
+}
+
 
 size_t Operator::Size()
 {
@@ -281,7 +397,7 @@ double Operator::GetTwoBody(int ch_bra, int ch_ket, int ibra, int iket)
 }
 
 
-void Operator::WriteBinary(ofstream& ofs)
+void Operator::WriteBinary(ostream& ofs)
 {
   double tstart = omp_get_wtime();
   ofs.write((char*)&rank_J,sizeof(rank_J));
@@ -303,7 +419,7 @@ void Operator::WriteBinary(ofstream& ofs)
 }
 
 
-void Operator::ReadBinary(ifstream& ifs)
+void Operator::ReadBinary(istream& ifs)
 {
   double tstart = omp_get_wtime();
   ifs.read((char*)&rank_J,sizeof(rank_J));
@@ -316,6 +432,7 @@ void Operator::ReadBinary(ifstream& ifs)
   ifs.read((char*)&antihermitian,sizeof(antihermitian));
   ifs.read((char*)&nChannels,sizeof(nChannels));
   SetUpOneBodyChannels();
+  TwoBodyKetClasses.clear();
   ifs.read((char*)&ZeroBody,sizeof(ZeroBody));
   ifs.read((char*)OneBody.memptr(),OneBody.size()*sizeof(double));
   if (particle_rank > 1)
@@ -611,7 +728,7 @@ void Operator::Erase()
 {
   EraseZeroBody();
   EraseOneBody();
-  TwoBody.Erase();
+  EraseTwoBody();
   if (particle_rank >=3)
     ThreeBody.Erase();
 }
@@ -624,6 +741,7 @@ void Operator::EraseOneBody()
 void Operator::EraseTwoBody()
 {
  TwoBody.Erase();
+ TwoBodyKetClasses.clear(); // whatever fills it next sets its own structure
 }
 
 void Operator::EraseThreeBody()
@@ -911,13 +1029,13 @@ double Operator::GetMP3_Energy()
              int J3max = min(jc+jb,jk+jj)/2;
              for (int J1=J1min;J1<=J1max;++J1)
              {
-               double tbme_abij = (2*J1+1)*TwoBody.GetTBME_J(J1,a,b,i,j);
+               double tbme_abij = (2*J1+1)*TwoBody.GetTBME_J<true>(J1,J1,a,b,i,j);
                for (int J2=J2min;J2<=J2max;++J2)
                {
-                 double tbme_cjak = (2*J2+1)*TwoBody.GetTBME_J(J2,c,j,a,k);
+                 double tbme_cjak = (2*J2+1)*TwoBody.GetTBME_J<true>(J2,J2,c,j,a,k);
                  for (int J3=J3min;J3<=J3max;++J3)
                  {
-                   double tbme_ikcb = (2*J3+1)*TwoBody.GetTBME_J(J3,i,k,c,b);
+                   double tbme_ikcb = (2*J3+1)*TwoBody.GetTBME_J<true>(J3,J3,i,k,c,b);
                    Emp3 -=  modelspace->GetNineJ(ji,jj,J1,jk,J2,ja,J3,jc,jb) * tbme_abij * tbme_cjak * tbme_ikcb / (Delta_abij * Delta_cbik);
                  } // for J3
                } // for J2
@@ -1079,17 +1197,17 @@ double Operator::MP1_Eval(Operator& H)
 /// We use the [Baker-Campbell-Hausdorff formula](http://en.wikipedia.org/wiki/Baker-Campbell-Hausdorff_formula)
 /// \f[ Z = X + [Y,X] + \frac{1}{2!}[Y,[Y,X]] + \frac{1}{3!}[Y,[Y,[Y,X]]] + \ldots \f]
 /// with all commutators truncated at the two-body level.
-Operator Operator::BCH_Transform( const Operator &Omega)
+Operator Operator::BCH_Transform( const Operator &Omega, CommutatorWorkspace& ws)
 {
-   if (use_brueckner_bch) return Brueckner_BCH_Transform( Omega );
-   else return Standard_BCH_Transform( Omega );
+   if (use_brueckner_bch) return Brueckner_BCH_Transform( Omega, ws );
+   else return Standard_BCH_Transform( Omega, ws );
 }
 
 /// X.BCH_Transform(Y) returns \f$ Z = e^{Y} X e^{-Y} \f$.
 /// We use the [Baker-Campbell-Hausdorff formula](http://en.wikipedia.org/wiki/Baker-Campbell-Hausdorff_formula)
 /// \f[ Z = X + [Y,X] + \frac{1}{2!}[Y,[Y,X]] + \frac{1}{3!}[Y,[Y,[Y,X]]] + \ldots \f]
 /// with all commutators truncated at the two-body level.
-Operator Operator::Standard_BCH_Transform( const Operator &Omega)
+Operator Operator::Standard_BCH_Transform( const Operator &Omega, CommutatorWorkspace& ws)
 {
    double t_start = omp_get_wtime();
    int max_iter = 40;
@@ -1099,11 +1217,21 @@ Operator Operator::Standard_BCH_Transform( const Operator &Omega)
    Operator OpOut = *this;
    if (nx>bch_transform_threshold)
    {
+     // Omega is the left operand of every nested commutator, so its
+     // Pandya transformation only needs to be done once per transform.
+     bool built_cache = false;
+     if (use_pandya_bch_cache and ws.pandya_cache_owner != &Omega
+          and Omega.particle_rank>1 and particle_rank>1
+          and Omega.rank_J+Omega.rank_T+Omega.parity==0)
+     {
+       ws.BuildPandyaCache(Omega);
+       built_cache = true;
+     }
      Operator OpNested = *this;
      double epsilon = nx * exp(-2*ny) * bch_transform_threshold / (2*ny);
      for (int i=1; i<=max_iter; ++i)
      {
-        Operator tmp1 = Commutator(Omega,OpNested);
+        Operator tmp1 = Commutator(Omega,OpNested,ws);
          tmp1 /= i;
         OpNested = tmp1;
         OpOut += OpNested;
@@ -1117,6 +1245,7 @@ Operator Operator::Standard_BCH_Transform( const Operator &Omega)
         if (i == warn_iter)  cout << "Warning: BCH_Transform not converged after " << warn_iter << " nested commutators" << endl;
         else if (i == max_iter)   cout << "Warning: BCH_Transform didn't coverge after "<< max_iter << " nested commutators" << endl;
      }
+     if (built_cache) ws.ClearPandyaCache();
    }
    profiler.timer["BCH_Transform"] += omp_get_wtime() - t_start;
    return OpOut;
@@ -1126,14 +1255,14 @@ Operator Operator::Standard_BCH_Transform( const Operator &Omega)
 /// \f[ e^{\Omega_1 + \Omega_2} X e^{-\Omega_1 - \Omega_2}
 ///    \rightarrow 
 ///  e^{\Omega_2} e^{\Omega_1}  X e^{-\Omega_1} e^{-\Omega_2} \f]
-Operator Operator::Brueckner_BCH_Transform( const Operator &Omega)
+Operator Operator::Brueckner_BCH_Transform( const Operator &Omega, CommutatorWorkspace& ws)
 {
    Operator Omega1 = Omega;
    Operator Omega2 = Omega;
    Omega1.SetParticleRank(1);
    Omega2.EraseOneBody();
-   Operator OpOut = this->Standard_BCH_Transform(Omega1);
-   OpOut = OpOut.Standard_BCH_Transform(Omega2);
+   Operator OpOut = this->Standard_BCH_Transform(Omega1, ws);
+   OpOut = OpOut.Standard_BCH_Transform(Omega2, ws);
    return OpOut;
 }
 
@@ -1270,17 +1399,24 @@ void Operator::AntiSymmetrize()
 /// Returns \f$ Z = [X,Y] \f$
 /// @relates Operator
 Operator Commutator( const Operator& X, const Operator& Y)
+{
+  return Commutator(X,Y,CommutatorWorkspace::Default());
+}
+
+/// Returns \f$ Z = [X,Y] \f$, using the scratch space in ws.
+/// @relates Operator
+Operator Commutator( const Operator& X, const Operator& Y, CommutatorWorkspace& ws)
 {
   int jrank = max(X.rank_J,Y.rank_J);
   int trank = max(X.rank_T,Y.rank_T);
   int parity = (X.parity+Y.parity)%2;
   int particlerank = max(X.particle_rank,Y.particle_rank);
   Operator Z(*(X.modelspace),jrank,trank,parity,particlerank);
-  Z.SetToCommutator(X,Y);
+  Z.SetToCommutator(X,Y,ws);
   return Z;
 }
 
-void Operator::SetToCommutator( const Operator& X, const Operator& Y)
+void Operator::SetToCommutator( const Operator& X, const Operator& Y, CommutatorWorkspace& ws)
 {
    //cout << "Entering SetToCommutator." << endl;
    profiler.counter["N_Commutators"] += 1;
@@ -1294,16 +1430,16 @@ void Operator::SetToCommutator( const Operator& X, const Operator& Y)
    {
       if (yrank==0)
       {
-         Z.CommutatorScalarScalar(X,Y); // [S,S]
+         Z.CommutatorScalarScalar(X,Y,ws); // [S,S]
       }
       else
       {
-         Z.CommutatorScalarTensor(X,Y); // [S,T]
+         Z.CommutatorScalarTensor(X,Y,ws); // [S,T]
       }
    }
    else if(yrank==0)
    {
-      Z.CommutatorScalarTensor(Y,X); // [T,S]
+      Z.CommutatorScalarTensor(Y,X,ws); // [T,S]
       Z *= -1;
    }
    else
@@ -1311,6 +1447,7 @@ void Operator::SetToCommutator( const Operator& X, const Operator& Y)
       cout << "In Tensor-Tensor because X.rank_J = " << X.rank_J << "  and Y.rank_J = " << Y.rank_J << endl;
       cout << " Tensor-Tensor commutator not yet implemented." << endl;
    }
+   Z.TwoBodyKetClasses.clear();
    profiler.timer["Commutator"] += omp_get_wtime() - t_start;
    //cout << "Leaving SetToCommutator." << endl;
 }
@@ -1318,7 +1455,7 @@ void Operator::SetToCommutator( const Operator& X, const Operator& Y)
 
 /// Commutator where \f$ X \f$ and \f$Y\f$ are scalar operators.
 /// Should be called through Commutator()
-void Operator::CommutatorScalarScalar( const Operator& X, const Operator& Y) 
+void Operator::CommutatorScalarScalar( const Operator& X, const Operator& Y, CommutatorWorkspace& ws) 
 {
    //cout << "Entering CommunatorScalarScalar." << endl;
    double t_css = omp_get_wtime();
@@ -1332,38 +1469,80 @@ void Operator::CommutatorScalarScalar( const Operator& X, const Operator& Y)
    else if ( (X.IsHermitian() and Y.IsAntiHermitian()) or (X.IsAntiHermitian() and Y.IsHermitian()) ) Z.SetHermitian();
    else Z.SetNonHermitian();
 
-   if ( not Z.IsAntiHermitian() )
+   // The terms are run as tasks in a single parallel region, and the channel loops
+   // inside them become taskloops (see ChannelScheduler::Run()). Every term adds directly into Z.
+   // comm122ss, comm222_phss and comm222_pp_hh_221ss all write to Z.TwoBody at the same time,
+   // so each channel is added in under its own lock in ws.twobody_locks. The one-body part of
+   // comm222_pp_hh_221ss waits for its intermediates, and for comm111ss+comm121ss to finish with Z.OneBody.
+   // BLAS can't have the threads inside the parallel region, so the Pandya transformations
+   // and the channels of the matrix products which are too expensive to share the threads
+   // (see ChannelScheduler::BigChannels()) are done first, each with all the threads given to BLAS.
+   bool do_222 = X.particle_rank>1 and Y.particle_rank>1;
+   vector<int> zbar_done, pphh_done;
+   if (do_222)
    {
-      Z.comm110ss(X, Y);
-      Z.comm220ss(X, Y) ;
-   }
-   //cout << "About to do a bunch of commNNNss." << endl;
-   double t_start = omp_get_wtime();
-   Z.comm111ss(X, Y);
-   profiler.timer["comm111ss"] += omp_get_wtime() - t_start;
-   //cout << "comm111ss passed." << endl;
-    t_start = omp_get_wtime();
-   Z.comm121ss(X,Y);
-   profiler.timer["comm121ss"] += omp_get_wtime() - t_start;
-   //cout << "comm121ss passed." << endl;
-
-    t_start = omp_get_wtime();
-   Z.comm122ss(X,Y); 
-   profiler.timer["comm122ss"] += omp_get_wtime() - t_start;
-   //cout << "comm122ss passed." << endl;
-   if (X.particle_rank>1 and Y.particle_rank>1)
-   {
-     //cout << "both ranks>1." << endl;
-     t_start = omp_get_wtime();
-     Z.comm222_pp_hh_221ss(X, Y);
-     profiler.timer["comm222_pp_hh_221ss"] += omp_get_wtime() - t_start;
-     //cout << "comm222_pp_hh_221ss passed." << endl;
-     t_start = omp_get_wtime();
-     Z.comm222_phss(X, Y);
-     profiler.timer["comm222_phss"] += omp_get_wtime() - t_start;
-     //cout << "comm222_phss passed." << endl;
+     double t_start = omp_get_wtime();
+     Z.comm222_phss_Pandya(X, Y, ws);
+     zbar_done = ChannelScheduler::BigChannels( Z.comm222_phss_ZbarCost(X, ws) );
+     for (int ich : zbar_done) Z.comm222_phss_Zbar(X, ws, ich);
+     ws.SetUpIntermediates(modelspace);
+     pphh_done = ChannelScheduler::BigChannels( GEMMCost(modelspace) );
+     for (int ich : pphh_done) Z.comm222_pp_hh_221ss_Channel(X, Y, ws, ich);
+     profiler.timer["comm222 big channels"] += omp_get_wtime() - t_start;
    }
 
+   ChannelScheduler::SerialBLAS serial_blas; // BLAS calls inside the tasks shouldn't start threads of their own
+   #pragma omp parallel
+   #pragma omp single
+   {
+     if (omp_get_num_threads()>1) ws.twobody_locks.Resize(nChannels);
+     if ( not Z.IsAntiHermitian() )
+     {
+       #pragma omp task
+       {
+         Z.comm110ss(X, Y);
+         Z.comm220ss(X, Y) ;
+       }
+     }
+     #pragma omp task depend(inout: Z.OneBody)
+     {
+       double t_start = omp_get_wtime();
+       Z.comm111ss(X, Y);
+       profiler.timer["comm111ss"] += omp_get_wtime() - t_start;
+       t_start = omp_get_wtime();
+       Z.comm121ss(X,Y);
+       profiler.timer["comm121ss"] += omp_get_wtime() - t_start;
+     }
+     #pragma omp task
+     {
+       double t_start = omp_get_wtime();
+       Z.comm122ss(X, Y, ws);
+       profiler.timer["comm122ss"] += omp_get_wtime() - t_start;
+     }
+     if (do_222)
+     {
+       #pragma omp task
+       {
+         double t_start = omp_get_wtime();
+         Z.comm222_phss_Finish(X, Y, ws, zbar_done);
+         profiler.timer["comm222_phss"] += omp_get_wtime() - t_start;
+       }
+       #pragma omp task depend(out: ws.Mpp)
+       {
+         double t_start = omp_get_wtime();
+         Z.comm222_pp_hh_221ss_TwoBody(X, Y, ws, pphh_done);
+         profiler.timer["comm222_pp_hh_221ss"] += omp_get_wtime() - t_start;
+       }
+       #pragma omp task depend(in: ws.Mpp) depend(inout: Z.OneBody)
+       {
+         double t_start = omp_get_wtime();
+         Z.comm222_pp_hh_221ss_OneBody(ws);
+         profiler.timer["comm222_pp_hh_221ss"] += omp_get_wtime() - t_start;
+       }
+     }
+   } // the tasks are all complete at the implicit barrier
+   ws.twobody_locks.Resize(0);
+
    //cout << "About to symmeterize (or anti)." << endl;
    if ( Z.IsHermitian() ) {
       //cout << "Z is hermitian, symmetrizing." << endl;
@@ -1379,7 +1558,7 @@ void Operator::CommutatorScalarScalar( const Operator& X, const Operator& Y)
 
 /// Commutator \f$[X,Y]\f$ where \f$ X \f$ is a scalar operator and \f$Y\f$ is a tensor operator.
 /// Should be called through Commutator()
-void Operator::CommutatorScalarTensor( const Operator& X, const Operator& Y) 
+void Operator::CommutatorScalarTensor( const Operator& X, const Operator& Y, CommutatorWorkspace& ws) 
 {
    double t_start = omp_get_wtime();
    Operator& Z = *this;
@@ -1402,7 +1581,7 @@ void Operator::CommutatorScalarTensor( const Operator& X, const Operator& Y)
 //   cout << "comm222_pp_hh_st" << endl;
    Z.comm222_pp_hh_221st(X, Y);
 //   cout << "comm222_phst" << endl;
-   Z.comm222_phst(X, Y);
+   Z.comm222_phst(X, Y, ws);
 
 //   cout << "symmetrize" << endl;
    if ( Z.IsHermitian() )
@@ -1530,8 +1709,7 @@ void Operator::comm121ss( const Operator& X, const Operator& Y)
 {
    Operator& Z = *this;
    index_t norbits = modelspace->GetNumberOrbits();
-   #pragma omp parallel for 
-   for (index_t i=0;i<norbits;++i)
+   ChannelScheduler::Run( vector<double>(norbits,1.0), [&](index_t i)
    {
       Orbit &oi = modelspace->GetOrbit(i);
       index_t jmin = Z.IsNonHermitian() ? 0 : i;
@@ -1555,9 +1733,220 @@ void Operator::comm121ss( const Operator& X, const Operator& Y)
              }
           }
       }
+   });
+}
+
+
+
+/// Add \f$ A_{rg} w_g B_{gc} \f$ to M, where g runs over the kets in group ig (hh, ph or pp),
+/// times factor, and w is an optional vector of occupation factors, which are between 0 and 1.
+/// Only the row groups r of A and column groups c of B for which the bound
+/// \f$ ||A_{rg}|| \cdot ||B_{gc}|| \f$ is above commutator_screening_threshold are included,
+/// so that e.g. with a White generator as A only the hh rows are multiplied.
+/// An and Bn are the sub-block norms from TwoBodyME::GetSubBlockNorms().
+/// Used by AddPPHHProducts().
+static void AddScreenedProduct( arma::mat& M, const arma::mat& A, const arma::mat& B, const arma::uvec (&groups)[3],
+                                int ig, const arma::vec* w, const arma::mat& An, const arma::mat& Bn, double threshold, double factor=1)
+{
+   if (groups[ig].n_elem==0) return;
+   double Amax = An.col(ig).max();
+   double Bmax = Bn.row(ig).max();
+   vector<int> rowgroups,colgroups;
+   size_t nrows = 0;
+   size_t ncols = 0;
+   for (int g=0;g<3;++g)
+   {
+     if (groups[g].n_elem==0) continue;
+     if ( An(g,ig)*Bmax > threshold) { rowgroups.push_back(g); nrows += groups[g].n_elem; }
+     if ( Amax*Bn(ig,g) > threshold) { colgroups.push_back(g); ncols += groups[g].n_elem; }
+   }
+   if (nrows==0 or ncols==0) return;
+   // If all the rows and columns contribute, skip the gather and scatter.
+   // Also do that if some kets are in none of the groups (occupation right at OCC_CUT).
+   size_t nkets = groups[0].n_elem + groups[1].n_elem + groups[2].n_elem;
+   const arma::uvec& inner = groups[ig];
+   bool contiguous = TwoBodyChannel::IsContiguous(inner);
+   if ( (nrows==M.n_rows and ncols==M.n_cols) or nkets != M.n_rows )
+   {
+     if (contiguous)
+     {
+       // The columns of A are used in place
+       const arma::mat Ainner( const_cast<double*>(A.colptr(inner(0))), A.n_rows, inner.n_elem, false, true);
+       arma::span s(inner(0), inner(inner.n_elem-1));
+       if (w==NULL)   M += factor * Ainner * B.rows(s);
+       else           M += factor * Ainner * arma::diagmat(*w) * B.rows(s);
+     }
+     else
+     {
+       if (w==NULL)   M += factor * A.cols(inner) * B.rows(inner);
+       else           M += factor * A.cols(inner) * arma::diagmat(*w) * B.rows(inner);
+     }
+     return;
+   }
+   arma::uvec rows = groups[rowgroups[0]];
+   arma::uvec cols = groups[colgroups[0]];
+   for (size_t g=1;g<rowgroups.size();++g) rows = arma::join_cols(rows,groups[rowgroups[g]]);
+   for (size_t g=1;g<colgroups.size();++g) cols = arma::join_cols(cols,groups[colgroups[g]]);
+   if (contiguous and TwoBodyChannel::IsContiguous(rows) and TwoBodyChannel::IsContiguous(cols))
+   {
+     arma::span r(rows(0), rows(rows.n_elem-1));
+     arma::span c(cols(0), cols(cols.n_elem-1));
+     arma::span s(inner(0), inner(inner.n_elem-1));
+     if (w==NULL)  M(r,c) += factor * A(r,s) * B(s,c);
+     else          M(r,c) += factor * A(r,s) * arma::diagmat(*w) * B(s,c);
+     return;
+   }
+   if (w==NULL)  M.submat(rows,cols) += factor * A.submat(rows,inner) * B.submat(inner,cols);
+   else          M.submat(rows,cols) += factor * A.submat(rows,inner) * arma::diagmat(*w) * B.submat(inner,cols);
+}
+
+
+/// Same product as AddScreenedProduct(), for the case where A or B has a known block
+/// structure (see Operator::TwoBodyKetClasses), e.g. when one of them is a generator.
+/// For each block {r,c} of A, only the rows r of M and the kets of class c in group g
+/// need to be multiplied. If only B is structured, the same is done with its columns.
+static void AddStructuredProduct( arma::mat& M, const arma::mat& A, const arma::mat& B, TwoBodyChannel& tbc,
+                                  const vector<array<string,2>>& Aclasses, const vector<array<string,2>>& Bclasses,
+                                  const arma::uvec& g, const arma::vec* w, double factor)
+{
+   if (g.n_elem==0) return;
+   bool use_A = not Aclasses.empty();
+   auto& blocks = use_A ? Aclasses : Bclasses;
+   vector<int> position_in_g(tbc.GetNumberKets(),-1);
+   for (arma::uword i=0;i<g.n_elem;++i) position_in_g[g(i)] = i;
+   for (auto& block : blocks)
+   {
+      arma::uvec& outer = tbc.GetKetIndexFromClass( use_A ? block[0] : block[1] );
+      arma::uvec& inner_class = tbc.GetKetIndexFromClass( use_A ? block[1] : block[0] );
+      if (outer.n_elem==0) continue;
+      vector<arma::uword> inner_list, inner_pos;
+      for (auto k : inner_class)
+      {
+        if (position_in_g[k]<0) continue;
+        inner_list.push_back(k);
+        inner_pos.push_back(position_in_g[k]);
+      }
+      if (inner_list.empty()) continue;
+      arma::uvec inner(inner_list);
+      arma::mat Binner = use_A ? arma::mat(B.rows(inner)) : arma::mat(B.submat(inner,outer));
+      if (w != NULL)
+      {
+        arma::vec w_inner = w->elem(arma::uvec(inner_pos));
+        Binner.each_col() %= w_inner;
+      }
+      if (use_A)  M.rows(outer) += factor * A.submat(outer,inner) * Binner;
+      else        M.cols(outer) += factor * A.cols(inner) * Binner;
+   }
+}
+
+/// Plain loops for \f$ \mathcal{M}_{pp} \f$ += \f$ A\,\mathrm{diag}(w_{pp}) B \f$ and
+/// \f$ \mathcal{M}_{hh} \f$ += \f$ A\,\mathrm{diag}(w_{hh}) B \f$, with all matrices \f$ n\times n \f$.
+/// For N>0 the dimension is fixed at compile time (and n is ignored), so the loops can be unrolled.
+template <int N>
+static void SmallPPHHKernel(int n, double* Mpp, double* Mhh, const double* A, const double* B, const double* wpp, const double* whh)
+{
+   const int dim = N>0 ? N : n;
+   for (int j=0; j<dim; ++j)
+   {
+     for (int k=0; k<dim; ++k)
+     {
+       double bpp = wpp[k] * B[k+j*dim];
+       double bhh = whh[k] * B[k+j*dim];
+       if (bpp==0 and bhh==0) continue;
+       for (int i=0; i<dim; ++i)
+       {
+         Mpp[i+j*dim] += A[i+k*dim] * bpp;
+         Mhh[i+j*dim] += A[i+k*dim] * bhh;
+       }
+     }
+   }
+}
+
+/// Pick the fixed-size SmallPPHHKernel for n <= N, and the general one otherwise.
+template <int N>
+static void SmallPPHHDispatch(int n, double* Mpp, double* Mhh, const double* A, const double* B, const double* wpp, const double* whh)
+{
+   if (n==N) SmallPPHHKernel<N>(n,Mpp,Mhh,A,B,wpp,whh);
+   else      SmallPPHHDispatch<N-1>(n,Mpp,Mhh,A,B,wpp,whh);
+}
+
+template <>
+void SmallPPHHDispatch<0>(int n, double* Mpp, double* Mhh, const double* A, const double* B, const double* wpp, const double* whh)
+{
+   SmallPPHHKernel<0>(n,Mpp,Mhh,A,B,wpp,whh);
+}
+
+/// The same products as AddPPHHProducts(), for a channel with at most Operator::small_channel_dimension kets.
+/// Here the call overhead of BLAS and the gathering of sub-blocks outweighs the arithmetic,
+/// so the occupation factors are instead put in one weight per ket and the full matrices are multiplied directly.
+static void AddSmallPPHHProducts( arma::mat& Matrixpp, arma::mat& Matrixhh, const arma::mat& A, const arma::mat& B, TwoBodyChannel& tbc, double factor)
+{
+   int n = tbc.GetNumberKets();
+   if (n==0) return;
+   vector<double> wpp(n,0.0), whh(n,0.0);
+   arma::uvec& kets_hh = tbc.GetKetIndex_hh();
+   arma::uvec& kets_ph = tbc.GetKetIndex_ph();
+   arma::uvec& kets_pp = tbc.GetKetIndex_pp();
+   for (arma::uword i=0; i<kets_pp.n_elem; ++i) wpp[kets_pp(i)] = factor;
+   for (arma::uword i=0; i<kets_ph.n_elem; ++i) wpp[kets_ph(i)] = factor * tbc.Ket_unocc_ph(i);
+   for (arma::uword i=0; i<kets_hh.n_elem; ++i)
+   {
+     wpp[kets_hh(i)] = factor * tbc.Ket_unocc_hh(i);
+     whh[kets_hh(i)] = factor * tbc.Ket_occ_hh(i);
+   }
+   SmallPPHHDispatch<8>(n, Matrixpp.memptr(), Matrixhh.memptr(), A.memptr(), B.memptr(), wpp.data(), whh.data());
+}
+
+/// C = A*B with plain loops, for matrices too small for BLAS to pay off.
+static void SmallGEMM( arma::mat& C, const arma::mat& A, const arma::mat& B)
+{
+   C.zeros(A.n_rows, B.n_cols);
+   for (arma::uword j=0; j<B.n_cols; ++j)
+   {
+     for (arma::uword k=0; k<A.n_cols; ++k)
+     {
+       double bkj = B(k,j);
+       if (bkj==0) continue;
+       for (arma::uword i=0; i<A.n_rows; ++i)  C(i,j) += A(i,k) * bkj;
+     }
    }
 }
 
+/// The intermediate products needed by comm221ss(), comm222_pp_hhss() and comm222_pp_hh_221ss(),
+/// \f$ \mathcal{M}_{pp} \f$ += factor * \f$ A (\mathcal{P}_{pp} + \bar{n}_a\bar{n}_b(\mathcal{P}_{hh}+\mathcal{P}_{ph})) B \f$
+/// and \f$ \mathcal{M}_{hh} \f$ += factor * \f$ A n_an_b\mathcal{P}_{hh} B \f$.
+/// An and Bn are the sub-block norms, which are only used if neither A nor B is structured.
+static void AddPPHHProducts( arma::mat& Matrixpp, arma::mat& Matrixhh, const arma::mat& A, const arma::mat& B, TwoBodyChannel& tbc,
+                             const vector<array<string,2>>& Aclasses, const vector<array<string,2>>& Bclasses,
+                             const arma::mat& An, const arma::mat& Bn, double factor)
+{
+   if (tbc.GetNumberKets() <= Operator::small_channel_dimension)
+   {
+     AddSmallPPHHProducts( Matrixpp, Matrixhh, A, B, tbc, factor);
+     return;
+   }
+
+   auto& nanb = tbc.Ket_occ_hh;
+   auto& nbarnbar_hh = tbc.Ket_unocc_hh;
+   auto& nbarnbar_ph = tbc.Ket_unocc_ph;
+   const arma::uvec groups[3] = {tbc.GetKetIndex_hh(), tbc.GetKetIndex_ph(), tbc.GetKetIndex_pp()};
+
+   if (Aclasses.empty() and Bclasses.empty())
+   {
+     double thresh = Operator::commutator_screening_threshold;
+     AddScreenedProduct( Matrixpp, A, B, groups, 2, NULL, An, Bn, thresh, factor);
+     AddScreenedProduct( Matrixhh, A, B, groups, 0, &nanb, An, Bn, thresh, factor);
+     AddScreenedProduct( Matrixpp, A, B, groups, 0, &nbarnbar_hh, An, Bn, thresh, factor);
+     AddScreenedProduct( Matrixpp, A, B, groups, 1, &nbarnbar_ph, An, Bn, thresh, factor);
+   }
+   else
+   {
+     AddStructuredProduct( Matrixpp, A, B, tbc, Aclasses, Bclasses, groups[2], NULL, factor);
+     AddStructuredProduct( Matrixhh, A, B, tbc, Aclasses, Bclasses, groups[0], &nanb, factor);
+     AddStructuredProduct( Matrixpp, A, B, tbc, Aclasses, Bclasses, groups[0], &nbarnbar_hh, factor);
+     AddStructuredProduct( Matrixpp, A, B, tbc, Aclasses, Bclasses, groups[1], &nbarnbar_ph, factor);
+   }
+}
 
 
 //*****************************************************************************************
@@ -1589,22 +1978,18 @@ void Operator::comm121ss( const Operator& X, const Operator& Y)
 /// \f]
 /// With the intermediate matrix \f[ \mathcal{M}^{J}_{pp} \equiv \frac{1}{2} (X^{J}\mathcal{P}_{pp} Y^{J} - Y^{J}\mathcal{P}_{pp}X^{J}) \f]
 /// and likewise for \f$ \mathcal{M}^{J}_{hh} \f$
-void Operator::comm221ss( const Operator& X, const Operator& Y) 
+void Operator::comm221ss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws)
 {
 
    Operator& Z = *this;
    int norbits = modelspace->GetNumberOrbits();
 
-   static TwoBodyME Mpp = Z.TwoBody;
-   static TwoBodyME Mhh = Z.TwoBody;
+   ws.SetUpIntermediates(modelspace);
+   TwoBodyME& Mpp = ws.Mpp;
+   TwoBodyME& Mhh = ws.Mhh;
 
-   // Don't use omp, because the matrix multiplication is already
-   // parallelized by armadillo.
-   int nch = modelspace->SortedTwoBodyChannels.size();
-   #ifndef OPENBLAS_NOUSEOMP
-   #pragma omp parallel for schedule(dynamic,1)
-   #endif
-   for (int ich=0; ich<nch; ++ich)
+   vector<vector<int>> buckets = ChannelScheduler::BucketByShape( GEMMShapes(modelspace), small_channel_dimension);
+   ChannelScheduler::RunBuckets( buckets, GEMMCost(modelspace), [&](int ich)
    {
       int ch = modelspace->SortedTwoBodyChannels[ich];
       TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
@@ -1615,42 +2000,38 @@ void Operator::comm221ss( const Operator& X, const Operator& Y)
       auto& Matrixpp = Mpp.GetMatrix(ch,ch);
       auto& Matrixhh = Mhh.GetMatrix(ch,ch);
 
-      auto& kets_pp = tbc.GetKetIndex_pp();
-      auto& kets_hh = tbc.GetKetIndex_hh();
-      auto& kets_ph = tbc.GetKetIndex_ph();
-      auto& nanb = tbc.Ket_occ_hh;
-      auto& nbarnbar_hh = tbc.Ket_unocc_hh;
-      auto& nbarnbar_ph = tbc.Ket_unocc_ph;
-      
-      Matrixpp =  LHS.cols(kets_pp) * RHS.rows(kets_pp);
-      Matrixhh =  LHS.cols(kets_hh) * arma::diagmat(nanb) *  RHS.rows(kets_hh) ;
-      if (kets_hh.size()>0)
-        Matrixpp +=  LHS.cols(kets_hh) * arma::diagmat(nbarnbar_hh) *  RHS.rows(kets_hh); 
-      if (kets_ph.size()>0)
-        Matrixpp += LHS.cols(kets_ph) * arma::diagmat(nbarnbar_ph) *  RHS.rows(kets_ph) ;
+      // Products are done sub-block by sub-block, skipping those that can't contribute.
+      // The norms are only needed if neither operator has a known block structure,
+      // and the channel is too big for AddSmallPPHHProducts().
+      arma::mat Xnorms,Ynorms;
+      if (X.TwoBodyKetClasses.empty() and Y.TwoBodyKetClasses.empty() and tbc.GetNumberKets() > small_channel_dimension)
+      {
+        Xnorms = X.TwoBody.GetSubBlockNorms(ch);
+        Ynorms = Y.TwoBody.GetSubBlockNorms(ch);
+      }
+
+      Matrixpp.zeros();
+      Matrixhh.zeros();
+      AddPPHHProducts( Matrixpp, Matrixhh, LHS, RHS, tbc, X.TwoBodyKetClasses, Y.TwoBodyKetClasses, Xnorms, Ynorms, 1);
 
 
       if (Z.IsHermitian())
       {
-         Matrixpp +=  Matrixpp.t();
-         Matrixhh +=  Matrixhh.t();
+         Matrixpp += Matrixpp.t();
+         Matrixhh += Matrixhh.t();
       }
       else if (Z.IsAntiHermitian()) // i.e. LHS and RHS are both hermitian or ant-hermitian
       {
-         Matrixpp -=  Matrixpp.t();
-         Matrixhh -=  Matrixhh.t();
+         Matrixpp -= Matrixpp.t();
+         Matrixhh -= Matrixhh.t();
       }
       else
       {
-        Matrixpp -=  RHS.cols(kets_pp) * LHS.rows(kets_pp);
-        Matrixhh -=  RHS.cols(kets_hh) * arma::diagmat(nanb) *  LHS.rows(kets_hh) ;
-        Matrixpp -=  RHS.cols(kets_hh) * arma::diagmat(nbarnbar_hh) *  LHS.rows(kets_hh) ;
-        if (kets_ph.size()>0)
-          Matrixpp -=  RHS.cols(kets_ph) * arma::diagmat(nbarnbar_ph) *  LHS.rows(kets_ph) ;
+        AddPPHHProducts( Matrixpp, Matrixhh, RHS, LHS, tbc, Y.TwoBodyKetClasses, X.TwoBodyKetClasses, Ynorms, Xnorms, -1);
       }
 
 
-   } //for ch
+   }, true); //for ch
 
    #pragma omp parallel for schedule(dynamic,1)
    for (int i=0;i<norbits;++i)
@@ -1705,24 +2086,31 @@ void Operator::comm221ss( const Operator& X, const Operator& Y)
 /// here, all TBME are unnormalized, i.e. they should have a tilde.
 // This is still too slow...
 //void Operator::comm122ss( Operator& Y, Operator& Z ) 
-void Operator::comm122ss( const Operator& X, const Operator& Y ) 
+void Operator::comm122ss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws ) 
 {
    Operator& Z = *this;
    auto& X1 = X.OneBody;
    auto& Y1 = Y.OneBody;
 
-   int n_nonzero = modelspace->SortedTwoBodyChannels.size();
-   #pragma omp parallel for schedule(dynamic,1)
-   for (int ich=0; ich<n_nonzero; ++ich)
+   vector<double> cost;
+   for (int ch : modelspace->SortedTwoBodyChannels)
+   {
+     double npq = modelspace->GetTwoBodyChannel(ch).GetNumberKets();
+     cost.push_back( npq*npq );
+   }
+   ChannelScheduler::Run( cost, [&](int ich)
    {
       int ch = modelspace->SortedTwoBodyChannels[ich];
       TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
       auto& X2 = X.TwoBody.GetMatrix(ch,ch);
       auto& Y2 = Y.TwoBody.GetMatrix(ch,ch);
-      auto& Z2 = Z.TwoBody.GetMatrix(ch,ch);
-
-
       int npq = tbc.GetNumberKets();
+      // If other terms are adding to Z at the same time, the channel is built up separately and added at the end.
+      bool shared = not ws.twobody_locks.empty();
+      arma::mat Z2_local;
+      if (shared) Z2_local.zeros(npq,npq);
+      arma::mat& Z2 = shared ? Z2_local : Z.TwoBody.GetMatrix(ch,ch);
+
       for (int indx_ij = 0;indx_ij<npq; ++indx_ij)
       {
          Ket & bra = tbc.GetKet(indx_ij);
@@ -1784,7 +2172,12 @@ void Operator::comm122ss( const Operator& X, const Operator& Y )
             Z2(indx_ij,indx_kl) += cijkl / norm;
          }
       }
-   }
+      if (shared)
+      {
+        ChannelScheduler::ChannelLocks::Guard guard(ws.twobody_locks, ch);
+        Z.TwoBody.GetMatrix(ch,ch) += Z2;
+      }
+   });
 
 }
 
@@ -1817,21 +2210,17 @@ void Operator::comm122ss( const Operator& X, const Operator& Y )
 /// \f]
 /// and likewise for \f$ \mathcal{M}^{J}_{hh} \f$.
 //void Operator::comm222_pp_hhss( Operator& opright, Operator& opout ) 
-void Operator::comm222_pp_hhss( const Operator& X, const Operator& Y ) 
+void Operator::comm222_pp_hhss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws)
 {
    Operator& Z = *this;
 
-   static TwoBodyME Mpp = Z.TwoBody;
-   static TwoBodyME Mhh = Z.TwoBody;
+   ws.SetUpIntermediates(modelspace);
+   TwoBodyME& Mpp = ws.Mpp;
+   TwoBodyME& Mhh = ws.Mhh;
 
    double t = omp_get_wtime();
-   // Don't use omp, because the matrix multiplication is already
-   // parallelized by armadillo.
-   int nch = modelspace->SortedTwoBodyChannels.size();
-   #ifndef OPENBLAS_NOUSEOMP
-   #pragma omp parallel for schedule(dynamic,1)
-   #endif
-   for (int ich=0; ich<nch; ++ich)
+   vector<vector<int>> buckets = ChannelScheduler::BucketByShape( GEMMShapes(modelspace), small_channel_dimension);
+   ChannelScheduler::RunBuckets( buckets, GEMMCost(modelspace), [&](int ich)
    {
       int ch = modelspace->SortedTwoBodyChannels[ich];
       TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
@@ -1843,45 +2232,40 @@ void Operator::comm222_pp_hhss( const Operator& X, const Operator& Y )
       auto& Matrixpp = Mpp.GetMatrix(ch,ch);
       auto& Matrixhh = Mhh.GetMatrix(ch,ch);
 
-      auto& kets_pp = tbc.GetKetIndex_pp();
-      auto& kets_hh = tbc.GetKetIndex_hh();
-      auto& kets_ph = tbc.GetKetIndex_ph();
-      auto& nanb = tbc.Ket_occ_hh;
-//      auto& nabar_nbbar = tbc.Ket_unocc_hh;
-      auto& nbarnbar_hh = tbc.Ket_unocc_hh;
-      auto& nbarnbar_ph = tbc.Ket_unocc_ph;
-      
-      Matrixpp =  LHS.cols(kets_pp) * RHS.rows(kets_pp);
-      Matrixhh =  LHS.cols(kets_hh) * arma::diagmat(nanb) *  RHS.rows(kets_hh) ;
-      if (kets_hh.size()>0)
-        Matrixpp +=  LHS.cols(kets_hh) * arma::diagmat(nbarnbar_hh) *  RHS.rows(kets_hh); 
-      if (kets_ph.size()>0)
-        Matrixpp += LHS.cols(kets_ph) * arma::diagmat(nbarnbar_ph) *  RHS.rows(kets_ph) ;
+      // Products are done sub-block by sub-block, skipping those that can't contribute.
+      // The norms are only needed if neither operator has a known block structure,
+      // and the channel is too big for AddSmallPPHHProducts().
+      arma::mat Xnorms,Ynorms;
+      if (X.TwoBodyKetClasses.empty() and Y.TwoBodyKetClasses.empty() and tbc.GetNumberKets() > small_channel_dimension)
+      {
+        Xnorms = X.TwoBody.GetSubBlockNorms(ch);
+        Ynorms = Y.TwoBody.GetSubBlockNorms(ch);
+      }
+
+      Matrixpp.zeros();
+      Matrixhh.zeros();
+      AddPPHHProducts( Matrixpp, Matrixhh, LHS, RHS, tbc, X.TwoBodyKetClasses, Y.TwoBodyKetClasses, Xnorms, Ynorms, 1);
 
 
       if (Z.IsHermitian())
       {
-         Matrixpp +=  Matrixpp.t();
-         Matrixhh +=  Matrixhh.t();
+         Matrixpp += Matrixpp.t();
+         Matrixhh += Matrixhh.t();
       }
       else if (Z.IsAntiHermitian()) // i.e. LHS and RHS are both hermitian or ant-hermitian
       {
-         Matrixpp -=  Matrixpp.t();
-         Matrixhh -=  Matrixhh.t();
+         Matrixpp -= Matrixpp.t();
+         Matrixhh -= Matrixhh.t();
       }
       else
       {
-        Matrixpp -=  RHS.cols(kets_pp) * LHS.rows(kets_pp);
-        Matrixhh -=  RHS.cols(kets_hh) * arma::diagmat(nanb) *  LHS.rows(kets_hh) ;
-        Matrixpp -=  RHS.cols(kets_hh) * arma::diagmat(nbarnbar_hh) *  LHS.rows(kets_hh) ;
-        if (kets_ph.size()>0)
-          Matrixpp -=  RHS.cols(kets_ph) * arma::diagmat(nbarnbar_ph) *  LHS.rows(kets_ph) ;
+        AddPPHHProducts( Matrixpp, Matrixhh, RHS, LHS, tbc, Y.TwoBodyKetClasses, X.TwoBodyKetClasses, Ynorms, Xnorms, -1);
       }
 
 
       // The two body part
       OUT += Matrixpp - Matrixhh;
-   } //for ch
+   }, true); //for ch
    profiler.timer["pphh TwoBody bit"] += omp_get_wtime() - t;
 }
 
@@ -1894,79 +2278,89 @@ void Operator::comm222_pp_hhss( const Operator& X, const Operator& Y )
 /// Since comm222_pp_hhss() and comm221ss() both require the construction of 
 /// the intermediate matrices \f$\mathcal{M}_{pp} \f$ and \f$ \mathcal{M}_{hh} \f$, we can combine them and
 /// only calculate the intermediates once.
-void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y )  
+void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws)
 {
+   ws.SetUpIntermediates(modelspace);
+   comm222_pp_hh_221ss_TwoBody(X, Y, ws, vector<int>());
+   comm222_pp_hh_221ss_OneBody(ws);
+}
 
-//   int herm = Z.IsHermitian() ? 1 : -1;
+/// The part of comm222_pp_hh_221ss() for channel SortedTwoBodyChannels[ich]:
+/// fill \f$ \mathcal{M}_{pp} \f$ and \f$ \mathcal{M}_{hh} \f$ and add \f$ \mathcal{M}_{pp}-\mathcal{M}_{hh} \f$ to the two-body part.
+/// ws.SetUpIntermediates() must have been called.
+void Operator::comm222_pp_hh_221ss_Channel( const Operator& X, const Operator& Y, CommutatorWorkspace& ws, int ich)
+{
    Operator& Z = *this;
-   int norbits = modelspace->GetNumberOrbits();
-
-   static TwoBodyME Mpp = Z.TwoBody;
-   static TwoBodyME Mhh = Z.TwoBody;
-
-   double t = omp_get_wtime();
-   // Don't use omp, because the matrix multiplication is already
-   // parallelized by armadillo.
-   int nch = modelspace->SortedTwoBodyChannels.size();
-   #ifndef OPENBLAS_NOUSEOMP
-   #pragma omp parallel for schedule(dynamic,1)
-   #endif
-   for (int ich=0; ich<nch; ++ich)
+   TwoBodyME& Mpp = ws.Mpp;
+   TwoBodyME& Mhh = ws.Mhh;
+   int ch = modelspace->SortedTwoBodyChannels[ich];
+   TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
+
+   auto& LHS = X.TwoBody.GetMatrix(ch,ch);
+   auto& RHS = Y.TwoBody.GetMatrix(ch,ch);
+   auto& Matrixpp = Mpp.GetMatrix(ch,ch);
+   auto& Matrixhh = Mhh.GetMatrix(ch,ch);
+
+   // Products are done sub-block by sub-block, skipping those that can't contribute.
+   // The norms are only needed if neither operator has a known block structure,
+   // and the channel is too big for AddSmallPPHHProducts().
+   arma::mat Xnorms,Ynorms;
+   if (X.TwoBodyKetClasses.empty() and Y.TwoBodyKetClasses.empty() and tbc.GetNumberKets() > small_channel_dimension)
    {
-      int ch = modelspace->SortedTwoBodyChannels[ich];
-      TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
-
-      auto& LHS = X.TwoBody.GetMatrix(ch,ch);
-      auto& RHS = Y.TwoBody.GetMatrix(ch,ch);
-      auto& OUT = Z.TwoBody.GetMatrix(ch,ch);
+     Xnorms = X.TwoBody.GetSubBlockNorms(ch);
+     Ynorms = Y.TwoBody.GetSubBlockNorms(ch);
+   }
 
-      auto& Matrixpp = Mpp.GetMatrix(ch,ch);
-      auto& Matrixhh = Mhh.GetMatrix(ch,ch);
+   Matrixpp.zeros();
+   Matrixhh.zeros();
+   AddPPHHProducts( Matrixpp, Matrixhh, LHS, RHS, tbc, X.TwoBodyKetClasses, Y.TwoBodyKetClasses, Xnorms, Ynorms, 1);
 
-      auto& kets_pp = tbc.GetKetIndex_pp();
-      auto& kets_hh = tbc.GetKetIndex_hh();
-      auto& kets_ph = tbc.GetKetIndex_ph();
-      auto& nanb = tbc.Ket_occ_hh;
-      auto& nbarnbar_hh = tbc.Ket_unocc_hh;
-      auto& nbarnbar_ph = tbc.Ket_unocc_ph;
-      
-      Matrixpp =  LHS.cols(kets_pp) * RHS.rows(kets_pp);
-      Matrixhh =  LHS.cols(kets_hh) * arma::diagmat(nanb) *  RHS.rows(kets_hh) ;
-      if (kets_hh.size()>0)
-        Matrixpp +=  LHS.cols(kets_hh) * arma::diagmat(nbarnbar_hh) *  RHS.rows(kets_hh); 
-      if (kets_ph.size()>0)
-        Matrixpp += LHS.cols(kets_ph) * arma::diagmat(nbarnbar_ph) *  RHS.rows(kets_ph) ;
 
+   if (Z.IsHermitian())
+   {
+      Matrixpp += Matrixpp.t();
+      Matrixhh += Matrixhh.t();
+   }
+   else if (Z.IsAntiHermitian()) // i.e. LHS and RHS are both hermitian or ant-hermitian
+   {
+      Matrixpp -= Matrixpp.t();
+      Matrixhh -= Matrixhh.t();
+   }
+   else
+   {
+     AddPPHHProducts( Matrixpp, Matrixhh, RHS, LHS, tbc, Y.TwoBodyKetClasses, X.TwoBodyKetClasses, Ynorms, Xnorms, -1);
+   }
 
-      if (Z.IsHermitian())
-      {
-         Matrixpp +=  Matrixpp.t();
-         Matrixhh +=  Matrixhh.t();
-      }
-      else if (Z.IsAntiHermitian()) // i.e. LHS and RHS are both hermitian or ant-hermitian
-      {
-         Matrixpp -=  Matrixpp.t();
-         Matrixhh -=  Matrixhh.t();
-      }
-      else
-      {
-        Matrixpp -=  RHS.cols(kets_pp) * LHS.rows(kets_pp);
-        Matrixhh -=  RHS.cols(kets_hh) * arma::diagmat(nanb) *  LHS.rows(kets_hh) ;
-        Matrixpp -=  RHS.cols(kets_hh) * arma::diagmat(nbarnbar_hh) *  LHS.rows(kets_hh) ;
-        if (kets_ph.size()>0)
-          Matrixpp -=  RHS.cols(kets_ph) * arma::diagmat(nbarnbar_ph) *  LHS.rows(kets_ph) ;
-      }
 
+   // The two body part
+   ChannelScheduler::ChannelLocks::Guard guard(ws.twobody_locks, ch);
+   Z.TwoBody.GetMatrix(ch,ch) += Matrixpp - Matrixhh;
+}
 
-      // The two body part
-      OUT += Matrixpp - Matrixhh;
-   } //for ch
+/// comm222_pp_hh_221ss_Channel() for all the channels except the ones in done.
+void Operator::comm222_pp_hh_221ss_TwoBody( const Operator& X, const Operator& Y, CommutatorWorkspace& ws, const vector<int>& done)
+{
+   double t = omp_get_wtime();
+   vector<vector<int>> buckets = ChannelScheduler::BucketByShape( GEMMShapes(modelspace), small_channel_dimension);
+   ChannelScheduler::RunBuckets( buckets, GEMMCost(modelspace), [&](int ich)
+   {
+      comm222_pp_hh_221ss_Channel(X, Y, ws, ich);
+   }, true, done); //for ch
    profiler.timer["pphh TwoBody bit"] += omp_get_wtime() - t;
+}
 
-   t = omp_get_wtime();
+/// The one-body part of comm222_pp_hh_221ss(), from the intermediates of comm222_pp_hh_221ss_TwoBody()
+void Operator::comm222_pp_hh_221ss_OneBody( CommutatorWorkspace& ws)
+{
+//   int herm = Z.IsHermitian() ? 1 : -1;
+   Operator& Z = *this;
+   int norbits = modelspace->GetNumberOrbits();
+   TwoBodyME& Mpp = ws.Mpp;
+   TwoBodyME& Mhh = ws.Mhh;
+
+   double t = omp_get_wtime();
    // The one body part
-   #pragma omp parallel for schedule(dynamic,1)
-   for (int i=0;i<norbits;++i)
+   ChannelScheduler::Run( vector<double>(norbits,1.0), [&](int i)
    {
       Orbit &oi = modelspace->GetOrbit(i);
       int jmin = Z.IsNonHermitian() ? 0 : i;
@@ -1993,7 +2387,7 @@ void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y )
          }
          Z.OneBody(i,j) += cijJ /(oi.j2+1.0);
       } // for j
-   } // for i
+   }); // for i
    profiler.timer["pphh One Body bit"] += omp_get_wtime() - t;
 }
 
@@ -2022,10 +2416,12 @@ void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y )
 void Operator::DoPandyaTransformation(deque<arma::mat>& TwoBody_CC_ph, string orientation="normal") const
 {
    // loop over cross-coupled channels
-   int n_nonzero = modelspace->SortedTwoBodyChannels_CC.size();
    int herm = IsHermitian() ? 1 : -1;
-   #pragma omp parallel for schedule(dynamic,1) if (not modelspace->SixJ_is_empty())
-   for (int ich=0; ich<n_nonzero; ++ich)
+   const vector<PandyaPlan>* plans = use_pandya_plans ? &modelspace->GetPandyaPlans() : NULL;
+   if (plans != NULL and plans->empty()) plans = NULL; // over the memory budget
+   vector<const double*> blocks(nChannels,NULL);
+   for (int ch : modelspace->SortedTwoBodyChannels) blocks[ch] = TwoBody.GetMatrix(ch,ch).memptr();
+   ChannelScheduler::Run( PandyaCost(modelspace,true), [&](int ich)
    {
       int ch_cc = modelspace->SortedTwoBodyChannels_CC[ich];
       TwoBodyChannel& tbc_cc = modelspace->GetTwoBodyChannel_CC(ch_cc);
@@ -2051,103 +2447,128 @@ void Operator::DoPandyaTransformation(deque<arma::mat>& TwoBody_CC_ph, string or
          // we go to 2*nKets to include |cd> and |dc>
          for (int iket_cc=0; iket_cc<nKets_cc; ++iket_cc)
          {
-            Ket & ket_cc = tbc_cc.GetKet(iket_cc%nKets_cc);
-            int c = iket_cc < nKets_cc ? ket_cc.p : ket_cc.q;
-            int d = iket_cc < nKets_cc ? ket_cc.q : ket_cc.p;
-            Orbit & oc = modelspace->GetOrbit(c);
-            Orbit & od = modelspace->GetOrbit(d);
-            double jc = oc.j2*0.5;
-            double jd = od.j2*0.5;
-
-
-            int jmin = max(abs(ja-jd),abs(jc-jb));
-            int jmax = min(ja+jd,jc+jb);
-            double sm = 0;
-            for (int J_std=jmin; J_std<=jmax; ++J_std)
+            double sm_direct, sm_exchange, phase_abcd;
+            if (plans != NULL)
             {
-               double sixj = modelspace->GetSixJ(ja,jb,J_cc,jc,jd,J_std);
-               if (abs(sixj) < 1e-8) continue;
-               double tbme = TwoBody.GetTBME_J(J_std,a,d,c,b);
-               sm -= (2*J_std+1) * sixj * tbme ;
+              // Everything but the matrix elements has been worked out in advance
+              const PandyaPlan& plan = (*plans)[ch_cc];
+              size_t e = (size_t)ibra*nKets_cc + iket_cc;
+              sm_direct = plan.Sum(2*e, blocks.data());
+              sm_exchange = plan.Sum(2*e+1, blocks.data());
+              phase_abcd = plan.phase[e];
             }
-            if (orientation=="normal")
-            {
-              TwoBody_CC_ph[ch_cc](ibra,iket_cc) = sm;
-              TwoBody_CC_ph[ch_cc](ibra+nph_kets,iket_cc+nKets_cc) = herm* modelspace->phase(ja+jb+jc+jd) * sm;
-            }
-            else if (orientation=="transpose")
+            else
             {
+              Ket & ket_cc = tbc_cc.GetKet(iket_cc);
+              int c = ket_cc.p;
+              int d = ket_cc.q;
+              Orbit & oc = modelspace->GetOrbit(c);
+              Orbit & od = modelspace->GetOrbit(d);
+              double jc = oc.j2*0.5;
+              double jd = od.j2*0.5;
+              phase_abcd = modelspace->phase(ja+jb+jc+jd);
 
-              TwoBody_CC_ph[ch_cc](iket_cc,ibra) = herm * sm * na_nb_factor;
-              TwoBody_CC_ph[ch_cc](iket_cc+nKets_cc,ibra+nph_kets) =  modelspace->phase(ja+jb+jc+jd) * sm * -na_nb_factor;
-            }
+              int jmin = max(abs(ja-jd),abs(jc-jb));
+              int jmax = min(ja+jd,jc+jb);
+              sm_direct = 0;
+              for (int J_std=jmin; J_std<=jmax; ++J_std)
+              {
+                 double sixj = modelspace->GetSixJ(ja,jb,J_cc,jc,jd,J_std);
+                 if (abs(sixj) < 1e-8) continue;
+                 double tbme = TwoBody.GetTBME_J<true>(J_std,J_std,a,d,c,b);
+                 sm_direct -= (2*J_std+1) * sixj * tbme ;
+              }
 
-            // Exchange (a <-> b) to account for the (n_a - n_b) term
-            // Get Tz,parity and range of J for <bd || ca > coupling
-            jmin = max(abs(jb-jd),abs(jc-ja));
-            jmax = min(jb+jd,jc+ja);
-            sm = 0;
-            for (int J_std=jmin; J_std<=jmax; ++J_std)
-            {
-               double sixj = modelspace->GetSixJ(jb,ja,J_cc,jc,jd,J_std);
-               if (abs(sixj) < 1e-8) continue;
-               double tbme = TwoBody.GetTBME_J(J_std,b,d,c,a);
-               sm -= (2*J_std+1) * sixj * tbme ;
+              // Exchange (a <-> b) to account for the (n_a - n_b) term
+              // Get Tz,parity and range of J for <bd || ca > coupling
+              jmin = max(abs(jb-jd),abs(jc-ja));
+              jmax = min(jb+jd,jc+ja);
+              sm_exchange = 0;
+              for (int J_std=jmin; J_std<=jmax; ++J_std)
+              {
+                 double sixj = modelspace->GetSixJ(jb,ja,J_cc,jc,jd,J_std);
+                 if (abs(sixj) < 1e-8) continue;
+                 double tbme = TwoBody.GetTBME_J<true>(J_std,J_std,b,d,c,a);
+                 sm_exchange -= (2*J_std+1) * sixj * tbme ;
+              }
             }
+
             if (orientation=="normal")
             {
-              TwoBody_CC_ph[ch_cc](ibra+nph_kets,iket_cc) = sm;
-              TwoBody_CC_ph[ch_cc](ibra,iket_cc+nKets_cc) = herm* modelspace->phase(ja+jb+jc+jd) * sm;
+              TwoBody_CC_ph[ch_cc](ibra,iket_cc) = sm_direct;
+              TwoBody_CC_ph[ch_cc](ibra+nph_kets,iket_cc+nKets_cc) = herm* phase_abcd * sm_direct;
+              TwoBody_CC_ph[ch_cc](ibra+nph_kets,iket_cc) = sm_exchange;
+              TwoBody_CC_ph[ch_cc](ibra,iket_cc+nKets_cc) = herm* phase_abcd * sm_exchange;
             }
             else if (orientation=="transpose")
             {
-              TwoBody_CC_ph[ch_cc](iket_cc,ibra+nph_kets) = herm * sm * -na_nb_factor;
-              TwoBody_CC_ph[ch_cc](iket_cc+nKets_cc,ibra) =  modelspace->phase(ja+jb+jc+jd) * sm * na_nb_factor;
+              TwoBody_CC_ph[ch_cc](iket_cc,ibra) = herm * sm_direct * na_nb_factor;
+              TwoBody_CC_ph[ch_cc](iket_cc+nKets_cc,ibra+nph_kets) =  phase_abcd * sm_direct * -na_nb_factor;
+              TwoBody_CC_ph[ch_cc](iket_cc,ibra+nph_kets) = herm * sm_exchange * -na_nb_factor;
+              TwoBody_CC_ph[ch_cc](iket_cc+nKets_cc,ibra) =  phase_abcd * sm_exchange * na_nb_factor;
             }
 
          }
       }
-   }
+   });
 }
 
 
 
-void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar)
+/// Zbar[ch_cc] should be a \f$ 2N \times 2N \f$ matrix, with N the number of kets in cross-coupled channel ch_cc,
+/// as made by comm222_phss().
+void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar, CommutatorWorkspace& ws)
 {
     // Do the inverse Pandya transform
-    // Only go parallel if we've previously calculated the SixJ's. Otherwise, it's not thread safe.
-   int n_nonzeroChannels = modelspace->SortedTwoBodyChannels.size();
-   #pragma omp parallel for schedule(dynamic,1) if (not modelspace->SixJ_is_empty())
-   for (int ich = 0; ich < n_nonzeroChannels; ++ich)
+   const vector<PandyaPlan>* plans = use_pandya_plans ? &modelspace->GetInversePandyaPlans() : NULL;
+   if (plans != NULL and plans->empty()) plans = NULL; // over the memory budget
+   // The plans cover the upper triangle, which is all that's needed if Z is hermitian or anti-hermitian.
+   // Otherwise every element is filled, so that the result doesn't depend on the order of the kets.
+   if (not (IsHermitian() or IsAntiHermitian())) plans = NULL;
+   vector<const double*> Zbar_blocks(nChannels,NULL);
+   if (plans != NULL)
+   {
+     for (int ch_cc : modelspace->SortedTwoBodyChannels_CC) Zbar_blocks[ch_cc] = Zbar[ch_cc].memptr();
+   }
+   ChannelScheduler::Run( PandyaCost(modelspace,false), [&](int ich)
    {
       int ch = modelspace->SortedTwoBodyChannels[ich];
       TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
-      //cout << "iterating over channels; ch=" << ch << " ich=" << ich << endl;
       int J = tbc.J;
-      //cout << "J=" << J << endl;
       int nKets = tbc.GetNumberKets();
-      //cout << "nKets=" << nKets << endl;
+      // If other terms are adding to this operator at the same time, the channel is built up separately and added at the end.
+      bool shared = not ws.twobody_locks.empty();
+      arma::mat Zmat_local;
+      if (shared) Zmat_local.zeros(nKets,nKets);
+      arma::mat& Zmat = shared ? Zmat_local : TwoBody.GetMatrix(ch,ch);
+      size_t e = 0; // element of the plan, which covers all iket >= ibra
 
       for (int ibra=0; ibra<nKets; ++ibra)
       {
-	 //cout << "Iterating over bras; ibra=" << ibra << endl;
          Ket & bra = tbc.GetKet(ibra);
          int i = bra.p;
          int j = bra.q;
-	 //cout << "Getting orbits for i=" << i << " j=" << j << endl;
          Orbit & oi = modelspace->GetOrbit(i);
          Orbit & oj = modelspace->GetOrbit(j);
          double ji = oi.j2/2.;
          double jj = oj.j2/2.;
-         int ketmin = IsHermitian() ? ibra : ibra+1;
-	 //cout << "About to enter iket loop; ketmin=" << ketmin << endl;
+         int ketmin = IsHermitian() ? ibra : IsAntiHermitian() ? ibra+1 : 0;
+         if (plans != NULL)
+         {
+           // Everything but Zbar has been worked out in advance, including the normalization
+           const PandyaPlan& plan = (*plans)[ch];
+           if (ketmin > ibra) ++e;
+           for (int iket=ketmin; iket<nKets; ++iket)
+           {
+             Zmat(ibra,iket) += plan.Sum(e++, Zbar_blocks.data());
+           }
+           continue;
+         }
          for (int iket=ketmin; iket<nKets; ++iket)
          {
-	    //cout << "Looping through iket loop; iket=" << iket << endl;
             Ket & ket = tbc.GetKet(iket);
             int k = ket.p;
             int l = ket.q;
-	    //cout << "Getting orbits for k=" << k << " l=" << l << endl;
             Orbit & ok = modelspace->GetOrbit(k);
             Orbit & ol = modelspace->GetOrbit(l);
             double jk = ok.j2/2.;
@@ -2160,28 +2581,19 @@ void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar)
             int Tz_cc = abs(oi.tz2+ol.tz2)/2;
             int jmin = max(abs(int(ji-jl)),abs(int(jk-jj)));
             int jmax = min(int(ji+jl),int(jk+jj));
-	    //cout << "About to loop through first Jprime; jmin=" << jmin << " jmax=" << jmax << endl;
             for (int Jprime=jmin; Jprime<=jmax; ++Jprime)
             {
-	       //cout << "in Jprime loop; Jprime=" << Jprime << endl;
                double sixj = modelspace->GetSixJ(ji,jj,J,jk,jl,Jprime);
-	       //cout << "Got sixj; sixj=" << sixj << endl;
                if (abs(sixj)<1e-8) continue;
                int ch_cc = modelspace->GetTwoBodyChannelIndex(Jprime,parity_cc,Tz_cc);
-	       //cout << "Got ch_cc; ch_cc=" << ch_cc << endl;
                TwoBodyChannel_CC& tbc_cc = modelspace->GetTwoBodyChannel_CC(ch_cc);
-	       //cout << "Got tbc_cc." << endl;
                int indx_il = tbc_cc.GetLocalIndex(min(i,l),max(i,l));
-	       //cout << "Got indx_il=" << indx_il << endl;
                int indx_kj = tbc_cc.GetLocalIndex(min(j,k),max(j,k));
-	       //cout << "Got indx_kj=" << indx_kj << endl;
 	       if (indx_il == -1 or indx_kj == -1) continue;
                if (i>l) indx_il += tbc_cc.GetNumberKets();
                if (k>j) indx_kj += tbc_cc.GetNumberKets();
                double me1 = Zbar[ch_cc](indx_il,indx_kj);
-	       //cout << "Got past the pair of 'ifs'; me1=" << me1 << endl;
                commij += (2*Jprime+1) * sixj * me1;
-
             }
 
             // now loop over the cross coupled TBME's
@@ -2189,37 +2601,31 @@ void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar)
             Tz_cc = abs(oi.tz2+ok.tz2)/2;
             jmin = max(abs(int(jj-jl)),abs(int(jk-ji)));
             jmax = min(int(jj+jl),int(jk+ji));
-	    //cout << "Leaving first Jprime Loop, moving to second; jmin=" << jmin << " jmax=" << jmax << endl;
             for (int Jprime=jmin; Jprime<=jmax; ++Jprime)
             {
-	       //cout << "in Jprime loop; Jprime=" << Jprime << endl;
                double sixj = modelspace->GetSixJ(jj,ji,J,jk,jl,Jprime);
-	       //cout << "Got sixj; sixj=" << sixj << endl;
                if (abs(sixj)<1e-8) continue;
                int ch_cc = modelspace->GetTwoBodyChannelIndex(Jprime,parity_cc,Tz_cc);
-	       //cout << "Got ch_cc; ch_cc=" << ch_cc << endl;
                TwoBodyChannel_CC& tbc_cc = modelspace->GetTwoBodyChannel_CC(ch_cc);
-	       //cout << "Got tbc_cc." << endl;
                int indx_jl = tbc_cc.GetLocalIndex(min(j,l),max(j,l));
-	       //cout << "Got indx_jl=" << indx_jl << endl;
                int indx_ki = tbc_cc.GetLocalIndex(min(i,k),max(i,k));
-	       //cout << "Got indx_ki=" << indx_ki << endl;
 	       if (indx_jl == -1 or indx_ki == -1) continue;
                if (j>l) indx_jl += tbc_cc.GetNumberKets();
                if (k>i) indx_ki += tbc_cc.GetNumberKets();
                double me1 = Zbar[ch_cc](indx_jl,indx_ki);
-	       //cout << "Got past the pair of 'ifs'; me1=" << me1 << endl;
                commji += (2*Jprime+1) *  sixj * me1;
-
             }
 
             double norm = bra.delta_pq()==ket.delta_pq() ? 1+bra.delta_pq() : SQRT2;
-	    //cout << "Got past second Jprime loop; norm=" << norm << endl;
-            TwoBody.GetMatrix(ch,ch)(ibra,iket) += (commij - modelspace->phase(ji+jj-J)*commji) / norm;
-	    //cout << "Got TwoBody.GetMatrix(ch,ch)..." << endl;
+            Zmat(ibra,iket) += (commij - modelspace->phase(ji+jj-J)*commji) / norm;
          }
       }
-   }
+      if (shared)
+      {
+        ChannelScheduler::ChannelLocks::Guard guard(ws.twobody_locks, ch);
+        TwoBody.GetMatrix(ch,ch) += Zmat;
+      }
+   });
  
 }
 
@@ -2227,9 +2633,18 @@ void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar)
 /// convenience function
 /// called by comm222_phss
 ///*************************************
-deque<arma::mat> Operator::InitializePandya(size_t nch, string orientation="normal")
+deque<arma::mat> Operator::InitializePandya(size_t nch, string orientation="normal") const
+{
+   deque<arma::mat> X;
+   InitializePandya(X, nch, orientation);
+   return X;
+}
+
+/// DoPandyaTransformation() sets every element, so the matrices are only resized here.
+/// If X already has the right shape (e.g. it's in a CommutatorWorkspace), nothing is allocated.
+void Operator::InitializePandya(deque<arma::mat>& X, size_t nch, string orientation) const
 {
-   deque<arma::mat> X(nch);
+   X.resize(nch);
    int n_nonzero = modelspace->SortedTwoBodyChannels_CC.size();
    for (int ich=0; ich<n_nonzero; ++ich)
    {
@@ -2239,11 +2654,10 @@ deque<arma::mat> Operator::InitializePandya(size_t nch, string orientation="norm
       arma::uvec kets_ph = arma::join_cols(tbc_cc.GetKetIndex_hh(), tbc_cc.GetKetIndex_ph() ); // Lets see if this works...
       int nph_kets = kets_ph.n_rows;
       if (orientation=="normal")
-         X[ch_cc] = arma::mat(2*nph_kets,   2*nKets_cc, arma::fill::zeros);
+         X[ch_cc].set_size(2*nph_kets,   2*nKets_cc);
       else if (orientation=="transpose")
-         X[ch_cc] = arma::mat(2*nKets_cc, 2*nph_kets,   arma::fill::zeros);
+         X[ch_cc].set_size(2*nKets_cc, 2*nph_kets);
    }
-   return X;
 }
 
 //*****************************************************************************************
@@ -2309,42 +2723,90 @@ deque<arma::mat> Operator::InitializePandya(size_t nch, string orientation="norm
 ///  \right]
 ///  \f]
 ///
-void Operator::comm222_phss( const Operator& X, const Operator& Y ) 
+void Operator::comm222_phss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws ) 
 {
+   comm222_phss_Pandya(X, Y, ws);
+   comm222_phss_Finish(X, Y, ws, vector<int>());
+}
 
-   Operator& Z = *this;
+/// Pandya transformations of X and Y for comm222_phss(), into ws.X_bar (unless X is in the Pandya cache) and ws.Y_bar.
+void Operator::comm222_phss_Pandya( const Operator& X, const Operator& Y, CommutatorWorkspace& ws )
+{
    // Create Pandya-transformed hp and ph matrix elements
-   deque<arma::mat> Y_bar_ph (InitializePandya( nChannels, "normal"));
-   deque<arma::mat> Xt_bar_ph (InitializePandya( nChannels, "transpose"));
+   deque<arma::mat>& Y_bar_ph = ws.Y_bar;
+   InitializePandya( Y_bar_ph, nChannels, "normal");
 
    double t_start = omp_get_wtime();
    Y.DoPandyaTransformation(Y_bar_ph, "normal" );
-   X.DoPandyaTransformation(Xt_bar_ph ,"transpose");
+   if (ws.pandya_cache_owner != &X)
+   {
+     InitializePandya( ws.X_bar, nChannels, "transpose");
+     X.DoPandyaTransformation(ws.X_bar ,"transpose");
+   }
    profiler.timer["DoPandyaTransformation"] += omp_get_wtime() - t_start;
+   ws.Z_bar.resize(nChannels);
+}
 
-   // Construct the intermediate matrix Z_bar
-   t_start = omp_get_wtime();
-   deque<arma::mat> Z_bar (nChannels );
+/// Estimated cost of the Z_bar product in each of the SortedTwoBodyChannels_CC, for ChannelScheduler::Run()
+vector<double> Operator::comm222_phss_ZbarCost( const Operator& X, const CommutatorWorkspace& ws ) const
+{
+   const deque<arma::mat>& Xt_bar_ph = (ws.pandya_cache_owner == &X) ? ws.pandya_cache : ws.X_bar;
+   vector<double> cost;
+   for (int ch : modelspace->SortedTwoBodyChannels_CC)
+   {
+     cost.push_back( double(Xt_bar_ph[ch].n_rows) * Xt_bar_ph[ch].n_cols * ws.Y_bar[ch].n_cols );
+   }
+   return cost;
+}
 
-   int nch = modelspace->SortedTwoBodyChannels_CC.size();
-   #ifndef OPENBLAS_NOUSEOMP
-   #pragma omp parallel for schedule(dynamic,1)
-   #endif
-   for (int ich=0; ich<nch; ++ich )
-   {
-      int ch = modelspace->SortedTwoBodyChannels_CC[ich];
-      Z_bar[ch] =  (Xt_bar_ph[ch] * Y_bar_ph[ch]);
-      // If Z is hermitian, then XY is anti-hermitian, and so XY - YX = XY + (XY)^T
-      if ( Z.IsHermitian() )
-         Z_bar[ch] += Z_bar[ch].t();
-      else
-         Z_bar[ch] -= Z_bar[ch].t();
+/// The intermediate matrix Z_bar of comm222_phss() in channel SortedTwoBodyChannels_CC[ich]
+void Operator::comm222_phss_Zbar( const Operator& X, CommutatorWorkspace& ws, int ich )
+{
+   Operator& Z = *this;
+   const deque<arma::mat>& Xt_bar_ph = (ws.pandya_cache_owner == &X) ? ws.pandya_cache : ws.X_bar;
+   const deque<arma::mat>& Y_bar_ph = ws.Y_bar;
+   deque<arma::mat>& Z_bar = ws.Z_bar;
+   int ch = modelspace->SortedTwoBodyChannels_CC[ich];
+   if ( arma::norm(Xt_bar_ph[ch],"fro") * arma::norm(Y_bar_ph[ch],"fro") <= commutator_screening_threshold )
+   {
+     Z_bar[ch].zeros( Xt_bar_ph[ch].n_rows, Y_bar_ph[ch].n_cols );
+     return;
    }
+   if ( max(Xt_bar_ph[ch].n_rows, max(Xt_bar_ph[ch].n_cols, Y_bar_ph[ch].n_cols)) <= (arma::uword)small_channel_dimension )
+     SmallGEMM( Z_bar[ch], Xt_bar_ph[ch], Y_bar_ph[ch] );
+   else
+     Z_bar[ch] =  (Xt_bar_ph[ch] * Y_bar_ph[ch]);
+   // If Z is hermitian, then XY is anti-hermitian, and so XY - YX = XY + (XY)^T
+   if ( Z.IsHermitian() )
+      Z_bar[ch] += Z_bar[ch].t();
+   else
+      Z_bar[ch] -= Z_bar[ch].t();
+}
+
+/// The rest of comm222_phss(), after comm222_phss_Pandya(), and comm222_phss_Zbar() for the channels in done.
+void Operator::comm222_phss_Finish( const Operator& X, const Operator& Y, CommutatorWorkspace& ws, const vector<int>& done )
+{
+   Operator& Z = *this;
+   const deque<arma::mat>& Xt_bar_ph = (ws.pandya_cache_owner == &X) ? ws.pandya_cache : ws.X_bar;
+   const deque<arma::mat>& Y_bar_ph = ws.Y_bar;
+
+   // Construct the intermediate matrix Z_bar
+   double t_start = omp_get_wtime();
+   vector<array<int,3>> shapes;
+   for (int ch : modelspace->SortedTwoBodyChannels_CC)
+   {
+     shapes.push_back( {{int(Xt_bar_ph[ch].n_rows), int(Xt_bar_ph[ch].n_cols), int(Y_bar_ph[ch].n_cols)}} );
+   }
+   vector<vector<int>> buckets = ChannelScheduler::BucketByShape( shapes, small_channel_dimension);
+   ChannelScheduler::RunBuckets( buckets, comm222_phss_ZbarCost(X, ws), [&](int ich)
+   {
+      Z.comm222_phss_Zbar(X, ws, ich);
+   }, true, done);
    profiler.timer["Build Z_bar"] += omp_get_wtime() - t_start;
    // Perform inverse Pandya transform on Z_bar to get Z
    t_start = omp_get_wtime();
    // << "About to AddInvers..." << endl;
-   Z.AddInversePandyaTransformation(Z_bar);
+   Z.AddInversePandyaTransformation(ws.Z_bar, ws);
    profiler.timer["InversePandyaTransformation"] += omp_get_wtime() - t_start;
 
 }
@@ -2428,7 +2890,7 @@ void Operator::comm121st( const Operator& X, const Operator& Y)
                     {
                       if ( ! ( J2>=abs(ja-jj) and J2<=ja+jj )) continue;
                       double prefactor = nanb*phasefactor * sqrt((2*J1+1)*(2*J2+1)) * modelspace->GetSixJ(J1,J2,Lambda,jj,ji,ja);
-                      Zij +=  prefactor * ( X.OneBody(a,b) * Y.TwoBody.GetTBME_J(J1,J2,b,i,a,j) - X.OneBody(b,a) * Y.TwoBody.GetTBME_J(J1,J2,a,i,b,j ));
+                      Zij +=  prefactor * ( X.OneBody(a,b) * Y.TwoBody.GetTBME_J<false>(J1,J2,b,i,a,j) - X.OneBody(b,a) * Y.TwoBody.GetTBME_J<false>(J1,J2,a,i,b,j ));
                     }
                   }
              }
@@ -2445,14 +2907,14 @@ void Operator::comm121st( const Operator& X, const Operator& Y)
                 double zij = 0;
                 for (int J1=J1min; J1<=J1max; ++J1)
                 {
-                  zij -= modelspace->phase(ji+jb+J1) * (2*J1+1) * modelspace->GetSixJ(ja,jb,Lambda,ji,jj,J1) * X.TwoBody.GetTBME_J(J1,J1,b,i,a,j);
+                  zij -= modelspace->phase(ji+jb+J1) * (2*J1+1) * modelspace->GetSixJ(ja,jb,Lambda,ji,jj,J1) * X.TwoBody.GetTBME_J<true>(J1,J1,b,i,a,j);
                 }
 
                 J1min = max(abs(ji-ja),abs(jj-jb));
                 J1max = min(ji+ja,jj+jb);
                 for (int J1=J1min; J1<=J1max; ++J1)
                 {
-                  zij += modelspace->phase(ji+jb+J1) * (2*J1+1) * modelspace->GetSixJ(jb,ja,Lambda,ji,jj,J1) * X.TwoBody.GetTBME_J(J1,J1,a,i,b,j) ;
+                  zij += modelspace->phase(ji+jb+J1) * (2*J1+1) * modelspace->GetSixJ(jb,ja,Lambda,ji,jj,J1) * X.TwoBody.GetTBME_J<true>(J1,J1,a,i,b,j) ;
                 }
 
                 Zij += nanb * Y.OneBody(a,b) * zij;
@@ -2693,7 +3155,7 @@ void Operator::comm222_pp_hh_221st( const Operator& X, const Operator& Y )
                 double hatfactor = sqrt( (2*J1+1)*(2*J2+1) );
                 double sixj = modelspace->GetSixJ(J1, J2, Lambda, jj, ji, jc);
                 cijJ += hatfactor * sixj * modelspace->phase(jj + jc + J1 + Lambda)
-                        * ( oc.occ * Mpp.GetTBME_J(J1,J2,c,i,c,j) + (1-oc.occ) * Mhh.GetTBME_J(J1,J2,c,i,c,j));
+                        * ( oc.occ * Mpp.GetTBME_J<false>(J1,J2,c,i,c,j) + (1-oc.occ) * Mhh.GetTBME_J<false>(J1,J2,c,i,c,j));
 //                cijJ += hatfactor * sixj * modelspace->phase(jj + jc + J1 + Lambda) * (1-oc.occ) * Mhh.GetTBME_J(J1,J2,c,i,c,j);  // This is probably right???
                }
               }
@@ -2713,7 +3175,7 @@ void Operator::comm222_pp_hh_221st( const Operator& X, const Operator& Y )
                {
                 double hatfactor = sqrt( (2*J1+1)*(2*J2+1) );
                 double sixj = modelspace->GetSixJ(J1, J2, Lambda, jj, ji, jc);
-                cijJ += hatfactor * sixj * modelspace->phase(jj + jc + J1 + Lambda) * Mhh.GetTBME_J(J1,J2,c,i,c,j);
+                cijJ += hatfactor * sixj * modelspace->phase(jj + jc + J1 + Lambda) * Mhh.GetTBME_J<false>(J1,J2,c,i,c,j);
                }
               }
            }
@@ -2748,7 +3210,7 @@ void Operator::comm222_pp_hh_221st( const Operator& X, const Operator& Y )
 /// two arrays of matrices, one for hp terms and one for ph terms.
 //void Operator::DoTensorPandyaTransformation(vector<arma::mat>& TwoBody_CC_hp, vector<arma::mat>& TwoBody_CC_ph)
 //void Operator::DoTensorPandyaTransformation(map<array<int,2>,arma::mat>& TwoBody_CC_hp, map<array<int,2>,arma::mat>& TwoBody_CC_ph) const
-void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBody_CC_ph) const
+void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBody_CC_ph, CommutatorWorkspace& ws) const
 {
    int Lambda = rank_J;
    // loop over cross-coupled channels
@@ -2771,7 +3233,7 @@ void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBod
       }
    }
 
-   #pragma omp parallel for schedule(dynamic,1) if (not this->tensor_transform_first_pass)
+   #pragma omp parallel for schedule(dynamic,1) if (not ws.TensorFirstPass())
    for (int ich=0;ich<nch;++ich)
    {
       int ch_bra_cc = modelspace->SortedTwoBodyChannels_CC[ich];
@@ -2828,7 +3290,7 @@ void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBod
                   double ninej = modelspace->GetNineJ(ja,jd,J1,jb,jc,J2,Jbra_cc,Jket_cc,Lambda);
                   if (abs(ninej) < 1e-8) continue;
                   double hatfactor = sqrt( (2*J1+1)*(2*J2+1)*(2*Jbra_cc+1)*(2*Jket_cc+1) );
-                  double tbme = TwoBody.GetTBME_J(J1,J2,a,d,c,b);
+                  double tbme = TwoBody.GetTBME_J<false>(J1,J2,a,d,c,b);
                   sm -= hatfactor * modelspace->phase(jb+jd+Jket_cc+J2) * ninej * tbme ;
                 }
               }
@@ -2849,7 +3311,7 @@ void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBod
                   double ninej = modelspace->GetNineJ(jb,jd,J1,ja,jc,J2,Jbra_cc,Jket_cc,Lambda);
                   if (abs(ninej) < 1e-8) continue;
                   double hatfactor = sqrt( (2*J1+1)*(2*J2+1)*(2*Jbra_cc+1)*(2*Jket_cc+1) );
-                  double tbme = TwoBody.GetTBME_J(J1,J2,b,d,c,a);
+                  double tbme = TwoBody.GetTBME_J<false>(J1,J2,b,d,c,a);
                   sm -= hatfactor * modelspace->phase(ja+jd+Jket_cc+J2) * ninej * tbme ;
                 }
               }
@@ -2863,7 +3325,7 @@ void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBod
 }
 
 
-void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>& Zbar)
+void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>& Zbar, CommutatorWorkspace& ws)
 {
     // Do the inverse Pandya transform
     // Only go parallel if we've previously calculated the SixJ's. Otherwise, it's not thread safe.
@@ -2873,15 +3335,13 @@ void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&
 //   for (int ich = 0; ich < n_nonzeroChannels; ++ich)
    Operator& Z = *this;
    int Lambda = Z.rank_J;
-   vector<map<array<int,2>,arma::mat>::iterator> iteratorlist;
-   for (map<array<int,2>,arma::mat>::iterator iter= Z.TwoBody.MatEl.begin(); iter!= Z.TwoBody.MatEl.end(); ++iter) iteratorlist.push_back(iter);
-   int niter = iteratorlist.size();
+   int niter = Z.TwoBody.MatEl.size();
 //   for (auto& iter : Z.TwoBody.MatEl)
-   #pragma omp parallel for schedule(dynamic,1) if (not this->tensor_transform_first_pass)
+   #pragma omp parallel for schedule(dynamic,1) if (not ws.TensorFirstPass())
 //   for (auto iter=Z.TwoBody.MatEl.begin(); iter<Z.TwoBody.MatEl.end(); ++iter)
    for (int i=0; i<niter; ++i)
    {
-      auto iter = iteratorlist[i];
+      auto iter = Z.TwoBody.MatEl.begin()+i;
       int ch_bra = iter->first[0];
       int ch_ket = iter->first[1];
       TwoBodyChannel& tbc_bra = modelspace->GetTwoBodyChannel(ch_bra);
@@ -2996,7 +3456,7 @@ void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&
       }
    }
  
-   tensor_transform_first_pass = false;
+   ws.tensor_pass_generation = CommutatorWorkspace::tensor_first_pass_generation;
 }
 
 
@@ -3071,22 +3531,27 @@ void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&
 ///  \f]
 ///
 //void Operator::comm222_phst( Operator& Y, Operator& Z ) 
-void Operator::comm222_phst( const Operator& X, const Operator& Y ) 
+void Operator::comm222_phst( const Operator& X, const Operator& Y, CommutatorWorkspace& ws ) 
 {
 
    Operator& Z = *this;
    // Create Pandya-transformed hp and ph matrix elements
 //   deque<arma::mat> X_bar_hp = InitializePandya( nChannels, "transpose");
-   deque<arma::mat> Xt_bar_ph = InitializePandya( nChannels, "transpose");
+   bool use_cache = (ws.pandya_cache_owner == &X);
 
 //   map<array<int,2>,arma::mat> Y_bar_hp;
    map<array<int,2>,arma::mat> Y_bar_ph;
 
    double t_start = omp_get_wtime();
-   X.DoPandyaTransformation(Xt_bar_ph, "transpose" );
+   if (not use_cache)
+   {
+     InitializePandya( ws.X_bar, nChannels, "transpose");
+     X.DoPandyaTransformation(ws.X_bar, "transpose" );
+   }
+   const deque<arma::mat>& Xt_bar_ph = use_cache ? ws.pandya_cache : ws.X_bar;
 //   X.DoPandyaTransformation(X_bar_hp, X_bar_ph, "transpose" );
 //   Y.DoTensorPandyaTransformation(Y_bar_hp, Y_bar_ph );
-   Y.DoTensorPandyaTransformation(Y_bar_ph );
+   Y.DoTensorPandyaTransformation(Y_bar_ph, ws );
    profiler.timer["DoTensorPandyaTransformation"] += omp_get_wtime() - t_start;
 
 
@@ -3128,7 +3593,7 @@ void Operator::comm222_phst( const Operator& X, const Operator& Y )
    profiler.timer["Build Z_bar_tensor"] += omp_get_wtime() - t_start;
 
    t_start = omp_get_wtime();
-   Z.AddInverseTensorPandyaTransformation(Z_bar);
+   Z.AddInverseTensorPandyaTransformation(Z_bar, ws);
    profiler.timer["InverseTensorPandyaTransformation"] += omp_get_wtime() - t_start;
 
 }
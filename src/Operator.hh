@@ -6,6 +6,7 @@
 #include "TwoBodyME.hh"
 #include "ThreeBodyME.hh"
 #include "IMSRGProfiler.hh"
+#include "ChannelScheduler.hh"
 #include <armadillo>
 #include <string>
 #include <vector>
@@ -14,6 +15,37 @@
 
 using namespace std;
 
+class Operator;
+
+/// Scratch space for the commutator routines, so that they don't need any static storage.
+/// CommutatorWorkspace::Default() is used by commutators called from serial code.
+/// Commutators which run concurrently, e.g. when transforming several operators, each need
+/// their own workspace, owned by the caller (see IMSRGSolver::TransformMany()).
+/// The matrices are kept between calls, and only reallocated when the sizes change,
+/// until Release() is called.
+class CommutatorWorkspace
+{
+ public:
+  TwoBodyME Mpp; ///< The intermediate \f$ \mathcal{M}_{pp} \f$ of comm221ss() and comm222_pp_hhss()
+  TwoBodyME Mhh; ///< The intermediate \f$ \mathcal{M}_{hh} \f$ of comm221ss() and comm222_pp_hhss()
+  deque<arma::mat> X_bar; ///< "transpose" Pandya transformation of X in comm222_phss() and comm222_phst()
+  deque<arma::mat> Y_bar; ///< "normal" Pandya transformation of Y in comm222_phss()
+  deque<arma::mat> Z_bar; ///< Cross-coupled intermediate of comm222_phss()
+  ChannelScheduler::ChannelLocks twobody_locks; ///< Set up while several terms of CommutatorScalarScalar() add into the two-body part of the result at once
+  const Operator* pandya_cache_owner; ///< The operator whose Pandya transformation is held in pandya_cache, if any
+  deque<arma::mat> pandya_cache; ///< "transpose" Pandya transformation of pandya_cache_owner, reused for all nested commutators of a BCH transform
+  int tensor_pass_generation; ///< Equal to tensor_first_pass_generation once this workspace has done a tensor Pandya transformation
+  static int tensor_first_pass_generation; ///< Changed by Operator::ResetTensorTransformFirstPass(), so every workspace does a first pass again
+
+  CommutatorWorkspace();
+  void SetUpIntermediates(ModelSpace* ms); ///< Allocate Mpp and Mhh for this model space, if they aren't already
+  void BuildPandyaCache(const Operator& X); ///< Store the "transpose" Pandya transformation of X for reuse in comm222_phss() and comm222_phst()
+  void ClearPandyaCache();
+  void Release(); ///< Free all the matrices
+  bool TensorFirstPass() const {return tensor_pass_generation != tensor_first_pass_generation;}; ///< The first tensor Pandya transformation is done in serial, so that the 6j and 9j symbols get stored
+  static CommutatorWorkspace& Default(); ///< The workspace for commutators called from serial code
+};
+
 /// The Operator class provides a generic operator up to three-body, scalar or tensor.
 /// The class contains lots of methods and overloaded operators so that the resulting
 /// code that uses the operators can look as close as possible to the math that is
@@ -42,12 +74,16 @@ class Operator
 
 
   map<array<int,3>,vector<index_t> > OneBodyChannels;
+  vector<array<string,2>> TwoBodyKetClasses; ///< If not empty, the {bra,ket} ket classes ("cc","vc","qc","vv","qv","qq") outside of which the two-body part is zero. Set by Generator.
   IMSRGProfiler profiler;
 
   static double bch_transform_threshold;
   static double bch_product_threshold;
-  static bool tensor_transform_first_pass;
   static bool use_brueckner_bch;
+  static bool use_pandya_bch_cache; ///< Reuse the Pandya-transformed Omega for all nested commutators of a BCH transform
+  static bool use_pandya_plans; ///< Do the Pandya transformations with the precomputed ModelSpace::PandyaPlans, at the cost of some memory. Off by default.
+  static double commutator_screening_threshold; ///< Two-body sub-block products with norm bound below this are skipped in the commutators
+  static int small_channel_dimension; ///< Channel products no bigger than this are grouped by shape and done without BLAS
 
 
 
@@ -78,8 +114,6 @@ class Operator
   Operator& operator=(Operator&& rhs);
 
   //Methods
-  Operator& TempOp(size_t n); ///< Static scratch space for calculations
-
   // One body setter/getters
   double GetOneBody(int i,int j) {return OneBody(i,j);};
 //  void SetOneBody(int i, int j, double val) { OneBody(i,j) = val;};
@@ -113,7 +147,7 @@ class Operator
   int GetTRank()const {return rank_T;};
   int GetParity()const {return parity;};
   void SetParticleRank(int pr) {particle_rank = pr;};
-  void ResetTensorTransformFirstPass(){tensor_transform_first_pass=true;};
+  void ResetTensorTransformFirstPass(){CommutatorWorkspace::tensor_first_pass_generation++;};
 
   void MakeReduced();
   void MakeNotReduced();
@@ -124,10 +158,11 @@ class Operator
   void Symmetrize(); ///< Copy the upper-half triangle to the lower-half triangle for each matrix
   void AntiSymmetrize(); ///< Copy the upper-half triangle to the lower-half triangle with a minus sign.
   void SetUpOneBodyChannels();
+  void AddTwoBodyKetClasses(vector<string> bras, vector<string> kets); ///< Mark the blocks bras x kets and kets x bras as possibly nonzero
   size_t Size();
 
-  void WriteBinary(ofstream& ofs);
-  void ReadBinary(ifstream& ifs);
+  void WriteBinary(ostream& ofs);
+  void ReadBinary(istream& ifs);
 
 
   // The actually interesting methods
@@ -137,17 +172,18 @@ class Operator
   Operator UndoNormalOrdering(); ///< Returns the operator normal-ordered wrt the vacuum
   Operator Truncate(ModelSpace& ms_new); ///< Returns the operator trunacted to the new model space
 
-  void SetToCommutator(const Operator& X, const Operator& Y);
-  void CommutatorScalarScalar( const Operator& X, const Operator& Y) ;
-  void CommutatorScalarTensor( const Operator& X, const Operator& Y) ;
+  void SetToCommutator(const Operator& X, const Operator& Y, CommutatorWorkspace& ws=CommutatorWorkspace::Default());
+  void CommutatorScalarScalar( const Operator& X, const Operator& Y, CommutatorWorkspace& ws) ;
+  void CommutatorScalarTensor( const Operator& X, const Operator& Y, CommutatorWorkspace& ws) ;
   friend Operator Commutator(const Operator& X, const Operator& Y) ; 
+  friend Operator Commutator(const Operator& X, const Operator& Y, CommutatorWorkspace& ws) ; 
 //  friend Operator CommutatorScalarScalar( const Operator& X, const Operator& Y) ;
 //  friend Operator CommutatorScalarTensor( const Operator& X, const Operator& Y) ;
 
   Operator BCH_Product(  Operator& )  ; 
-  Operator BCH_Transform( const Operator& ) ; 
-  Operator Standard_BCH_Transform( const Operator& ) ; 
-  Operator Brueckner_BCH_Transform( const Operator& ) ; 
+  Operator BCH_Transform( const Operator&, CommutatorWorkspace& ws=CommutatorWorkspace::Default() ) ; 
+  Operator Standard_BCH_Transform( const Operator&, CommutatorWorkspace& ws=CommutatorWorkspace::Default() ) ; 
+  Operator Brueckner_BCH_Transform( const Operator&, CommutatorWorkspace& ws=CommutatorWorkspace::Default() ) ; 
 
   void CalculateKineticEnergy();
   void Eye(); ///< set to identity operator
@@ -171,34 +207,46 @@ class Operator
   static void Set_BCH_Transform_Threshold(double x){bch_transform_threshold=x;};
   static void Set_BCH_Product_Threshold(double x){bch_product_threshold=x;};
   static void SetUseBruecknerBCH(bool tf){use_brueckner_bch = tf;};
-
-  deque<arma::mat> InitializePandya(size_t nch, string orientation);
+  static void SetUsePandyaBCHCache(bool tf){use_pandya_bch_cache = tf;};
+  static void SetUsePandyaPlans(bool tf){use_pandya_plans = tf;};
+  static void Set_Commutator_Screening_Threshold(double x){commutator_screening_threshold=x;};
+  static void SetSmallChannelDimension(int n){small_channel_dimension=n;};
+  deque<arma::mat> InitializePandya(size_t nch, string orientation) const;
+  void InitializePandya(deque<arma::mat>& X, size_t nch, string orientation) const; ///< Size the matrices in X, keeping the storage if it's already allocated
 //  void DoPandyaTransformation(deque<arma::mat>&, deque<arma::mat>&, string orientation) const ;
   void DoPandyaTransformation(deque<arma::mat>&, string orientation) const ;
-  void AddInversePandyaTransformation(deque<arma::mat>&);
+  void AddInversePandyaTransformation(deque<arma::mat>&, CommutatorWorkspace& ws=CommutatorWorkspace::Default());
 
 
   void comm110ss( const Operator& X, const Operator& Y) ; 
   void comm220ss( const Operator& X, const Operator& Y) ;
   void comm111ss( const Operator& X, const Operator& Y) ;
   void comm121ss( const Operator& X, const Operator& Y) ;
-  void comm221ss( const Operator& X, const Operator& Y) ;
-  void comm122ss( const Operator& X, const Operator& Y) ;
-  void comm222_pp_hhss( const Operator& X, const Operator& Y) ;
-  void comm222_phss( const Operator& X, const Operator& Y) ;
-  void comm222_pp_hh_221ss( const Operator& X, const Operator& Y) ;
+  void comm221ss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws=CommutatorWorkspace::Default()) ;
+  void comm122ss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws=CommutatorWorkspace::Default()) ;
+  void comm222_pp_hhss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws=CommutatorWorkspace::Default()) ;
+  void comm222_phss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws=CommutatorWorkspace::Default()) ;
+  void comm222_pp_hh_221ss( const Operator& X, const Operator& Y, CommutatorWorkspace& ws=CommutatorWorkspace::Default()) ;
+  // The stages of comm222_phss() and comm222_pp_hh_221ss(), so that CommutatorScalarScalar() can do the big channels first
+  void comm222_phss_Pandya( const Operator& X, const Operator& Y, CommutatorWorkspace& ws) ;
+  vector<double> comm222_phss_ZbarCost( const Operator& X, const CommutatorWorkspace& ws) const;
+  void comm222_phss_Zbar( const Operator& X, CommutatorWorkspace& ws, int ich) ;
+  void comm222_phss_Finish( const Operator& X, const Operator& Y, CommutatorWorkspace& ws, const vector<int>& done) ;
+  void comm222_pp_hh_221ss_Channel( const Operator& X, const Operator& Y, CommutatorWorkspace& ws, int ich) ;
+  void comm222_pp_hh_221ss_TwoBody( const Operator& X, const Operator& Y, CommutatorWorkspace& ws, const vector<int>& done) ;
+  void comm222_pp_hh_221ss_OneBody( CommutatorWorkspace& ws) ;
 
 // scalar-tensor commutators
 
 //  void DoTensorPandyaTransformation(map<array<int,2>,arma::mat>&, map<array<int,2>,arma::mat>&) const;
-  void DoTensorPandyaTransformation(map<array<int,2>,arma::mat>&) const;
-  void AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&);
+  void DoTensorPandyaTransformation(map<array<int,2>,arma::mat>&, CommutatorWorkspace& ws=CommutatorWorkspace::Default()) const;
+  void AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&, CommutatorWorkspace& ws=CommutatorWorkspace::Default());
 
   void comm111st( const Operator& X, const Operator& Y) ;
   void comm121st( const Operator& X, const Operator& Y) ;
   void comm122st( const Operator& X, const Operator& Y) ;
   void comm222_pp_hh_221st( const Operator& X, const Operator& Y) ;
-  void comm222_phst( const Operator& X, const Operator& Y) ;
+  void comm222_phst( const Operator& X, const Operator& Y, CommutatorWorkspace& ws=CommutatorWorkspace::Default()) ;
 
 };
 
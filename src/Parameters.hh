@@ -47,7 +47,12 @@ map<string,string> Parameters::string_par = {
   {"denominator_delta_orbit",	"none"},	// pick specific orbit to apply the delta
   {"LECs",			"EM2.0_2.0"}, 	// low energy constants for the interaction, only used with Johannes' hdf5 file format
   {"scratch",			""},    	// scratch directory for writing operators in binary format
+  {"symbol_cache",		"none"},	// file for caching 6j, 9j and Moshinsky symbols between runs
+  {"checkpoint",		"none"},	// file for periodically saving the state of the Magnus flow
+  {"resume",			"false"},	// restart the flow from the checkpoint file, if there is one
+  {"pack_omegas",		"false"},	// store finished Omegas as upper triangles in the Magnus flow, to save memory
   {"use_brueckner_bch",          "false"}, 	// switch to Brueckner version of BCH
+  {"use_pandya_plans",		"false"},	// precompute the Pandya recoupling, see pandya_plans_max_memory
   {"valence_file_format",       "nushellx"}, 	// file format for valence space interaction
   {"occ_file",			"none"}, 	// name of file containing orbit occupations
   {"systemtype",		"nuclear"},	// nuclear, atomic, etc.
@@ -65,6 +70,9 @@ map<string,double> Parameters::double_par = {
   {"ode_tolerance",	1e-6},	// error tolerance for the ode solver
   {"denominator_delta",	0},	// offset added to the denominator in the generator
   {"BetaCM",		0},	// Prefactor for Lawson-Glockner term
+  {"commutator_screening_threshold",	0},	// skip two-body sub-block products with norm bound below this in commutators
+  {"pandya_plans_max_memory",	4000},	// in MB. Above this, the Pandya plans aren't used
+  {"sixj_table_max_memory",	256},	// in MB. Above this, the dense 6j tables are cut off and the rest go in a sparse list
 
 };
 
@@ -82,6 +90,8 @@ map<string,int> Parameters::int_par = {
   {"file3e2max",	24},
   {"file3e3max",	12},
   {"state",		0}, // Which state, 0= ground, 1= first excited, etc
+  {"checkpoint_interval",	10}, // number of Magnus steps between checkpoints. 0 means only at the end of the flow.
+  {"hf_diis_history",	8}, // number of iterations kept for DIIS in Hartree-Fock. 0 means simple iteration.
 };
 
 map<string,vector<string>> Parameters::vec_par = {
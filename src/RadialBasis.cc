@@ -0,0 +1,150 @@
+#include "RadialBasis.hh"
+#include "imsrg_util.hh" // for BOHR_RADIUS
+#include <gsl/gsl_integration.h>
+#include <gsl/gsl_math.h>
+#include <cmath>
+#include <map>
+
+
+/// Tabulate the radial functions for the (n,l) in nl_list, one row each, at the points R.
+RadialBasis::RadialBasis(string basis, double scale, const vector<array<int,2>>& nl_list, const vector<double>& R, const vector<double>& W)
+: r(R), w(W)
+{
+  Tabulate(basis, scale, nl_list);
+}
+
+/// Tabulate the radial functions of all the orbits in modelspace, one row per orbit.
+RadialBasis::RadialBasis(string basis, double scale, ModelSpace& modelspace, const vector<double>& R, const vector<double>& W)
+: r(R), w(W)
+{
+  int norbits = modelspace.GetNumberOrbits();
+  vector<array<int,2>> nl_list(norbits);
+  for (int i=0; i<norbits; ++i)
+  {
+    Orbit& oi = modelspace.GetOrbit(i);
+    nl_list[i] = {{oi.n, oi.l}};
+  }
+  Tabulate(basis, scale, nl_list);
+}
+
+
+/// Generalized Laguerre polynomials \f$ L_n^{\alpha}(x) \f$ for n=0...nmax (rows) at all the points x (columns), from
+/// \f[ (n+1) L_{n+1}^{\alpha}(x) = (2n+1+\alpha-x) L_n^{\alpha}(x) - (n+\alpha) L_{n-1}^{\alpha}(x) \f]
+arma::mat RadialBasis::Laguerre(int nmax, double alpha, const arma::rowvec& x)
+{
+  arma::mat L(nmax+1, x.n_elem);
+  L.row(0).ones();
+  if (nmax>0) L.row(1) = 1+alpha-x;
+  for (int n=1; n<nmax; ++n)
+  {
+    L.row(n+1) = ( (2*n+1+alpha-x) % L.row(n) - (n+alpha)*L.row(n-1) ) / (n+1);
+  }
+  return L;
+}
+
+
+/// Rows with the same l share the Laguerre polynomials, except for hydrogen, where the argument depends on n.
+/// The normalizations are done with lgamma, so that they don't overflow for large n.
+void RadialBasis::Tabulate(string basis, double scale, const vector<array<int,2>>& nl_list)
+{
+  int npoints = r.n_elem;
+  psi.zeros(nl_list.size(), npoints);
+  arma::rowvec rrow = r.t();
+
+  if (basis == "hydrogen")
+  {
+    for (size_t i=0; i<nl_list.size(); ++i)
+    {
+      int n = nl_list[i][0];
+      int l = nl_list[i][1];
+      double c = scale/(n*BOHR_RADIUS);
+      arma::rowvec x = 2*c*rrow;
+      double lognorm = 0.5*( 3*log(2*c) + lgamma(n-l) - log(2*n) - lgamma(n+l+1) );
+      psi.row(i) = exp(lognorm) * arma::pow(x,l) % arma::exp(-0.5*x) % Laguerre(n-l-1, 2*l+1, x).row(n-l-1);
+    }
+    return;
+  }
+
+  arma::rowvec x;
+  if (basis == "harmonic")
+  {
+    x = rrow/scale;
+  }
+  else if (basis == "sturmian")
+  {
+    x = 2*scale*rrow;
+  }
+  else
+  {
+    cout << "RadialBasis: unknown basis " << basis << ". Choose harmonic, hydrogen or sturmian." << endl;
+    return;
+  }
+
+  map<int,int> nmax; // the largest n for each l
+  for (auto& nl : nl_list) nmax[nl[1]] = max(nmax[nl[1]], nl[0]);
+
+  for (auto& it : nmax)
+  {
+    int l = it.first;
+    arma::mat L;
+    arma::rowvec common;
+    if (basis == "harmonic")
+    {
+      L = Laguerre(it.second, l+0.5, x%x);
+      common = arma::pow(x,l) % arma::exp(-0.5*x%x);
+    }
+    else
+    {
+      L = Laguerre(it.second, 2*l+2, x);
+      common = arma::pow(x,l) % arma::exp(-0.5*x);
+    }
+    for (size_t i=0; i<nl_list.size(); ++i)
+    {
+      int n = nl_list[i][0];
+      if (nl_list[i][1] != l) continue;
+      double lognorm;
+      if (basis == "harmonic")
+      {
+        // (2n+2l+1)!! = (2n+2l+1)! / (2^(n+l) (n+l)!)
+        double log_dfact = lgamma(2*n+2*l+2) - (n+l)*M_LN2 - lgamma(n+l+1);
+        lognorm = M_LN2 + 0.5*( lgamma(n+1) + (n+l)*M_LN2 - 0.5*log(M_PI) - log_dfact - 3*log(scale) );
+      }
+      else
+      {
+        lognorm = 0.5*( 3*log(2*scale) + lgamma(n+1) - lgamma(n+2*l+3) );
+      }
+      psi.row(i) = exp(lognorm) * common % L.row(n);
+    }
+  }
+}
+
+
+/// \f$ \rho(r_k) = \sum_{ij} D_{ij} \psi_i(r_k) \psi_j(r_k) \f$
+arma::rowvec RadialBasis::Density(const arma::mat& D) const
+{
+  return arma::sum( psi % (D*psi), 0 );
+}
+
+
+/// \f$ \int dr\, r^2 \psi_i(r) \phi_j(r) \f$ for the functions of this basis and another, on the same grid.
+arma::mat RadialBasis::Overlap(const RadialBasis& other) const
+{
+  return psi * arma::diagmat(w%r%r) * other.psi.t();
+}
+
+
+/// A quadrature grid on [0,rmax]: panels of equal width (no wider than panel_width), each with an m-point Gauss-Legendre rule.
+/// The panels keep the rule accurate for functions which oscillate or fall off over a length of about panel_width.
+void RadialBasis::GaussLegendre(double rmax, double panel_width, int m, vector<double>& R, vector<double>& W)
+{
+  int npanels = max(1, int(ceil(rmax/panel_width)));
+  double h = rmax/npanels;
+  R.resize(npanels*m);
+  W.resize(npanels*m);
+  gsl_integration_glfixed_table* table = gsl_integration_glfixed_table_alloc(m);
+  for (int p=0; p<npanels; ++p)
+  {
+    for (int i=0; i<m; ++i) gsl_integration_glfixed_point(p*h, (p+1)*h, i, &R[p*m+i], &W[p*m+i], table);
+  }
+  gsl_integration_glfixed_table_free(table);
+}
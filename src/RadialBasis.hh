@@ -0,0 +1,46 @@
+#ifndef RadialBasis_h
+#define RadialBasis_h 1
+
+#include "ModelSpace.hh"
+#include <armadillo>
+#include <vector>
+#include <array>
+#include <string>
+
+using namespace std;
+
+/// Radial wave functions of a single-particle basis, tabulated once on a set of points \f$ r_k \f$.
+///
+/// The functions are stored as a dense matrix with one row per (n,l) and one column per point,
+/// so that radial integrals, overlaps and densities become dot products or matrix products
+/// instead of a call to gsl_sf_laguerre_n, gsl_sf_fact and pow for every point of every integral.
+/// The generalized Laguerre polynomials come from their three-term recurrence, which gives all the
+/// degrees up to n for all the points in one sweep. The normalizations are done once per (n,l).
+///
+/// The basis is one of
+///  - "harmonic" : oscillator functions as in imsrg_util::HO_Radial_psi, and scale is the oscillator length b.
+///  - "hydrogen" : hydrogen functions as in imsrg_util::Rnl, with n the principal quantum number, and scale is Z.
+///  - "sturmian" : Coulomb-Sturmian functions \f$ \propto x^l e^{-x/2} L_n^{2l+2}(x) \f$ with \f$ x=2br \f$, and scale is b.
+///
+/// To do integrals, the points should be a quadrature grid (see GaussLegendre()), with weights w.
+class RadialBasis
+{
+ public:
+  arma::vec r;   ///< Points
+  arma::vec w;   ///< Quadrature weights for \f$ \int dr \f$, if the points are a grid
+  arma::mat psi; ///< psi(i,k) is the i-th radial function at r_k
+
+  RadialBasis(string basis, double scale, const vector<array<int,2>>& nl_list, const vector<double>& R, const vector<double>& W={});
+  RadialBasis(string basis, double scale, ModelSpace& modelspace, const vector<double>& R, const vector<double>& W={});
+
+  arma::rowvec Density(const arma::mat& D) const;
+  arma::mat Overlap(const RadialBasis& other) const;
+
+  static arma::mat Laguerre(int nmax, double alpha, const arma::rowvec& x);
+  static void GaussLegendre(double rmax, double panel_width, int m, vector<double>& R, vector<double>& W);
+
+ private:
+  void Tabulate(string basis, double scale, const vector<array<int,2>>& nl_list);
+};
+
+#endif
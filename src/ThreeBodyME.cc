@@ -364,14 +364,14 @@ void ThreeBodyME::Deallocate()
 
 
 
-void ThreeBodyME::WriteBinary(ofstream& f)
+void ThreeBodyME::WriteBinary(ostream& f)
 {
   f.write((char*)&E3max,sizeof(E3max));
   f.write((char*)&total_dimension,sizeof(total_dimension));
   f.write((char*)&MatEl[0],total_dimension);
 }
 
-void ThreeBodyME::ReadBinary(ifstream& f)
+void ThreeBodyME::ReadBinary(istream& f)
 {
   f.read((char*)&E3max,sizeof(E3max));
   f.read((char*)&total_dimension,sizeof(total_dimension));
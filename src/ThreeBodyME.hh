@@ -52,8 +52,8 @@ class ThreeBodyME
   size_t size(){return total_dimension * sizeof(ThreeBME_type);};
 
 
-  void WriteBinary(ofstream&);
-  void ReadBinary(ifstream&);
+  void WriteBinary(ostream&);
+  void ReadBinary(istream&);
 
 };
 
@@ -1,10 +1,16 @@
 
 #include "TwoBodyME.hh"
 #include "AngMom.hh"
+#include <stdexcept>
 #ifndef SQRT2
   #define SQRT2 1.4142135623730950488
 #endif
 
+// Written (negated) at the start of WriteBinary(), where older versions wrote nChannels.
+// Bump it whenever the order of the matrix elements in MatElStorage changes.
+// Version 2: the kets of each channel are ordered hh, ph, pp (see TwoBodyChannel::Initialize).
+#define TWOBODY_BINARY_VERSION 2
+
 // destructor defined for debugging purposes
 TwoBodyME::~TwoBodyME()
 {}
@@ -32,18 +38,58 @@ TwoBodyME::TwoBodyME(ModelSpace* ms, int rJ, int rT, int p)
   Allocate();
 }
 
+// The matrices in MatEl point into MatElStorage, so they can't just be
+// copied member-wise. Copy the buffer and point the views at our own copy.
+TwoBodyME::TwoBodyME(const TwoBodyME& rhs)
+: modelspace(rhs.modelspace), MatEl(), MatElStorage(rhs.MatElStorage), MatElIndex(rhs.MatElIndex),
+  nChannels(rhs.nChannels), hermitian(rhs.hermitian), antihermitian(rhs.antihermitian),
+  rank_J(rhs.rank_J), rank_T(rhs.rank_T), parity(rhs.parity), packed(rhs.packed)
+{
+  if (not packed) SetUpMatElViews();
+}
+
+// If the blocks are laid out the same way (which is nearly always the case
+// for operators in the same flow) this is a single copy of the buffer.
+TwoBodyME& TwoBodyME::operator=(const TwoBodyME& rhs)
+{
+  if (this == &rhs) return *this;
+  if ( SameLayout(rhs) )
+  {
+    copy( rhs.MatElStorage.begin(), rhs.MatElStorage.end(), MatElStorage.begin() );
+    hermitian = rhs.hermitian;
+    antihermitian = rhs.antihermitian;
+    return *this;
+  }
+  TwoBodyME tmp(rhs);
+  *this = move(tmp);
+  return *this;
+}
+
 
  TwoBodyME& TwoBodyME::operator*=(const double rhs)
  {
-   for ( auto& itmat : MatEl )
-   {
-      itmat.second *= rhs;
-   }
+   for ( auto& x : MatElStorage ) x *= rhs;
    return *this;
  }
 
  TwoBodyME& TwoBodyME::operator+=(const TwoBodyME& rhs)
  {
+   if ( SameLayout(rhs) )
+   {
+     double* x = MatElStorage.data();
+     const double* y = rhs.MatElStorage.data();
+     size_t n = MatElStorage.size();
+     for (size_t i=0; i<n; ++i) x[i] += y[i];
+     return *this;
+   }
+   // The block-by-block version needs the full matrices on both sides
+   if (packed) Unpack();
+   if (rhs.packed)
+   {
+     TwoBodyME unpacked(rhs);
+     unpacked.Unpack();
+     return *this += unpacked;
+   }
    for ( auto& itmat : MatEl )
    {
       int ch_bra = itmat.first[0];
@@ -55,6 +101,22 @@ TwoBodyME::TwoBodyME(ModelSpace* ms, int rJ, int rT, int p)
 
  TwoBodyME& TwoBodyME::operator-=(const TwoBodyME& rhs)
  {
+   if ( SameLayout(rhs) )
+   {
+     double* x = MatElStorage.data();
+     const double* y = rhs.MatElStorage.data();
+     size_t n = MatElStorage.size();
+     for (size_t i=0; i<n; ++i) x[i] -= y[i];
+     return *this;
+   }
+   // The block-by-block version needs the full matrices on both sides
+   if (packed) Unpack();
+   if (rhs.packed)
+   {
+     TwoBodyME unpacked(rhs);
+     unpacked.Unpack();
+     return *this -= unpacked;
+   }
    for ( auto& itmat : rhs.MatEl )
    {
       int ch_bra = itmat.first[0];
@@ -65,11 +127,22 @@ TwoBodyME::TwoBodyME(ModelSpace* ms, int rJ, int rT, int p)
  }
 
 
+/// Two operators have the same layout if they store the same list of
+/// channel blocks, in which case the storage buffers line up element by element.
+bool TwoBodyME::SameLayout(const TwoBodyME& rhs) const
+{
+  return ( modelspace == rhs.modelspace and nChannels == rhs.nChannels
+           and rank_J == rhs.rank_J and rank_T == rhs.rank_T and parity == rhs.parity and packed == rhs.packed
+           and MatEl.size() == rhs.MatEl.size() and MatElStorage.size() == rhs.MatElStorage.size() );
+}
+
 
 void TwoBodyME::Allocate()
 {
   //cout << "Allocating TwoBody." << endl;
-  MatEl.clear();
+  MatElIndex.assign(nChannels*nChannels, -1);
+  size_t nblocks = 0;
+  size_t nelem = 0;
   for (int ch_bra=0; ch_bra<nChannels;++ch_bra)
   {
      TwoBodyChannel& tbc_bra = modelspace->GetTwoBodyChannel(ch_bra);
@@ -80,9 +153,89 @@ void TwoBodyME::Allocate()
         if ( (tbc_bra.J+tbc_ket.J)<rank_J ) continue;
         if ( abs(tbc_bra.Tz-tbc_ket.Tz)>rank_T ) continue;
         if ( (tbc_bra.parity + tbc_ket.parity + parity)%2>0 ) continue;
-        MatEl[{ch_bra,ch_ket}] =  arma::mat(tbc_bra.GetNumberKets(), tbc_ket.GetNumberKets(), arma::fill::zeros);
+        MatElIndex[ch_bra*nChannels+ch_ket] = nblocks++;
+        nelem += tbc_bra.GetNumberKets() * tbc_ket.GetNumberKets();
      }
   }
+  MatElStorage.assign(nelem, 0.0);
+  SetUpMatElViews();
+}
+
+/// Rebuild the matrices in MatEl as fixed-size views into MatElStorage.
+/// The blocks listed in MatElIndex are packed one after the other, ordered by {ch_bra,ch_ket}.
+void TwoBodyME::SetUpMatElViews()
+{
+  MatEl.clear();
+  MatEl.reserve( count_if(MatElIndex.begin(), MatElIndex.end(), [](int i){return i>=0;}) );
+  size_t offset = 0;
+  for (int ch_bra=0; ch_bra<nChannels;++ch_bra)
+  {
+     int nbras = modelspace->GetTwoBodyChannel(ch_bra).GetNumberKets();
+     for (int ch_ket=ch_bra; ch_ket<nChannels;++ch_ket)
+     {
+        if ( MatElIndex[ch_bra*nChannels+ch_ket] < 0 ) continue;
+        int nkets = modelspace->GetTwoBodyChannel(ch_ket).GetNumberKets();
+        MatEl.emplace_back( array<int,2>{ch_bra,ch_ket}, arma::mat( MatElStorage.data()+offset, nbras, nkets, false, true) );
+        offset += nbras*nkets;
+     }
+  }
+}
+
+/// Keep only the upper triangle (including the diagonal) of each block, packed column by column,
+/// and release the rest of MatElStorage. The lower triangle of a hermitian or anti-hermitian
+/// scalar operator is redundant, so this halves the memory of an \f$ \Omega \f$ which is only
+/// kept for later transformations (see IMSRGSolver::SetPackOmegas()).
+/// This is a storage format only: none of the commutators work on packed blocks, and an
+/// operator has to be unpacked (or copied and unpacked) before it is used in one.
+/// While packed, the matrices in MatEl are not available, and the only
+/// things which may be done are copying, scaling, adding or subtracting another TwoBodyME (which unpacks
+/// this one unless both are packed), taking the Norm(),
+/// writing with WriteBinary(), and Unpack(). Tensor and non-hermitian operators are left as they are.
+void TwoBodyME::Pack()
+{
+  if (packed or not (hermitian or antihermitian) or rank_J>0 or rank_T>0 or parity>0) return;
+  // The packed position is never ahead of the full one, so this can be done in place.
+  double* x = MatElStorage.data();
+  size_t offset_full = 0;
+  size_t offset_packed = 0;
+  for (auto& itmat : MatEl)
+  {
+    size_t n = itmat.second.n_rows;
+    for (size_t j=0; j<n; ++j)
+    {
+      for (size_t i=0; i<=j; ++i)  x[offset_packed++] = x[offset_full + i + j*n];
+    }
+    offset_full += n*n;
+  }
+  MatEl.clear();
+  MatElStorage.resize(offset_packed);
+  MatElStorage.shrink_to_fit();
+  packed = true;
+}
+
+/// Restore the full blocks from the upper triangles stored by Pack().
+void TwoBodyME::Unpack()
+{
+  if (not packed) return;
+  vector<double> triangles;
+  swap(triangles, MatElStorage);
+  packed = false;
+  Allocate();
+  double flip = hermitian ? 1 : -1;
+  size_t offset = 0;
+  for (auto& itmat : MatEl)
+  {
+    arma::mat& matrix = itmat.second;
+    for (size_t j=0; j<matrix.n_cols; ++j)
+    {
+      for (size_t i=0; i<j; ++i)
+      {
+        matrix(i,j) = triangles[offset++];
+        matrix(j,i) = flip * matrix(i,j);
+      }
+      matrix(j,j) = triangles[offset++];
+    }
+  }
 }
 
 void TwoBodyME::SetHermitian()
@@ -250,26 +403,12 @@ void TwoBodyME::AddToTBME(int j_bra, int p_bra, int t_bra, int j_ket, int p_ket,
    int ch_ket = modelspace->GetTwoBodyChannelIndex(j_ket,p_ket,t_ket);
    AddToTBME(ch_bra,ch_ket,bra,ket,tbme);
 }
+/// The selection rules are in the template version in TwoBodyME.hh
 double TwoBodyME::GetTBME_J(int j_bra, int j_ket, int a, int b, int c, int d) const
 {
-   Orbit& oa = modelspace->GetOrbit(a);
-   Orbit& ob = modelspace->GetOrbit(b);
-   Orbit& oc = modelspace->GetOrbit(c);
-   Orbit& od = modelspace->GetOrbit(d);
-   int parity_bra = (oa.l+ob.l)%2;
-   int parity_ket = (oc.l+od.l)%2;
-   int Tz_bra = (oa.tz2+ob.tz2)/2;
-   int Tz_ket = (oc.tz2+od.tz2)/2;
-   if ( (parity+parity_bra+parity_ket)%2 > 0) return 0;
-   if ( abs(Tz_bra-Tz_ket)>rank_T) return 0;
-   if ( abs(j_bra-j_ket) > rank_J) return 0;
-   if ( j_bra + j_ket < rank_J) return 0;
-   int ch_bra = modelspace->GetTwoBodyChannelIndex(j_bra,parity_bra,Tz_bra);
-   int ch_ket = modelspace->GetTwoBodyChannelIndex(j_ket,parity_ket,Tz_ket);
-   return GetTBME(ch_bra,ch_ket,a,b,c,d);
-//   if (ch_bra <= ch_ket)
-//    return GetTBME(ch_bra,ch_ket,a,b,c,d);
-//   return modelspace->phase(j_bra - j_ket) * GetTBME(ch_ket,ch_bra,c,d,a,b);
+   if (rank_J==0 and rank_T==0 and parity==0)
+     return GetTBME_J<true>(j_bra,j_ket,a,b,c,d);
+   return GetTBME_J<false>(j_bra,j_ket,a,b,c,d);
 }
 void TwoBodyME::SetTBME_J(int j_bra, int j_ket, int a, int b, int c, int d, double tbme)
 {
@@ -556,7 +695,7 @@ void TwoBodyME::AddToTBME_RelCM(int n_bra, int lam_bra, int N_bra, int LAM_bra,
   TwoBodyChannel& tbc_bra = modelspace->GetTwoBodyChannel( ch_bra );
   TwoBodyChannel& tbc_ket = modelspace->GetTwoBodyChannel( ch_ket );
 
-  if ( MatEl.find({ min(ch_bra,ch_ket),max(ch_bra,ch_ket)}) == MatEl.end() )
+  if ( not HasMatrix( min(ch_bra,ch_ket),max(ch_bra,ch_ket)) )
   {
 //    cout << "AAAHHH!!!! There appears to be a mismatch in the rank of the operator read in by AddToTBME_RelCM !!" << endl;
  //   cout << "Couldn't find " << ch_bra << " " << ch_ket << endl;
@@ -590,7 +729,7 @@ void TwoBodyME::AddToTBME_RelCM(int n_bra, int lam_bra, int N_bra, int LAM_bra,
     {
       index_t iket = tbc_ket.GetLocalIndex(labket.first);
       cout << "ibra = " << ibra << " (from " << labbra.first << ")  iket = " << iket << " (from " << labket.first << ") " << ch_bra << "," << ch_ket << endl;
-      cout << " matrix size = " << MatEl.at({min(ch_bra,ch_ket),max(ch_bra,ch_ket)}).size() << endl;
+      cout << " matrix size = " << GetMatrix(min(ch_bra,ch_ket),max(ch_bra,ch_ket)).size() << endl;
       if ( (N_bra==N_ket) and (LAM_bra==LAM_ket) )
       {
         AddToTBME(ch_bra, ch_ket, ibra, iket, labket.second*labbra.second*Vrel);
@@ -666,31 +805,69 @@ vector<pair<int,double>> TwoBodyME::GetLabFrameKets(int n, int lam, int N, int L
 
 void TwoBodyME::Erase()
 {
-  for ( auto& itmat : MatEl )
-  {
-     arma::mat& matrix = itmat.second;
-     matrix.zeros();
-  }
+  fill( MatElStorage.begin(), MatElStorage.end(), 0.0 );
 }
 
 
 double TwoBodyME::Norm() const
 {
    double nrm = 0;
+   // A packed block only holds its upper triangle, column by column, and
+   // each off-diagonal element stands for itself and its (anti-)transpose.
+   if (packed)
+   {
+     const double* x = MatElStorage.data();
+     for (int ch=0; ch<nChannels; ++ch)
+     {
+        if ( MatElIndex[ch*nChannels+ch] < 0 ) continue;
+        size_t n = modelspace->GetTwoBodyChannel(ch).GetNumberKets();
+        for (size_t j=0; j<n; ++j)
+        {
+          for (size_t i=0; i<j; ++i, ++x)  nrm += 2 * (*x) * (*x);
+          nrm += (*x) * (*x);
+          ++x;
+        }
+     }
+     return sqrt(nrm);
+   }
+   for ( auto& x : MatElStorage ) nrm += x*x;
+   // If bra and ket are different channels, we only store
+   // one ordering. For the norm, we then need a factor of 2.
    for ( auto& itmat : MatEl )
    {
+      if (itmat.first[0] == itmat.first[1]) continue;
       const arma::mat& matrix = itmat.second;
-      double n2 = arma::norm(matrix,"fro");
-      nrm += n2*n2;
-      // If bra and ket are different channels, we only store
-      // one ordering. For the norm, we then need a factor of 2.
-      if (itmat.first[0] != itmat.first[1])
-         nrm += n2*n2;
+      nrm += arma::accu(matrix % matrix);
    }
    return sqrt(nrm);
 }
 
 
+/// Frobenius norms of the sub-blocks of the diagonal block {ch,ch}, with the kets
+/// grouped into hh, ph and pp. Element (g1,g2) is the norm of \f$ \langle g_1 | X | g_2 \rangle\f$,
+/// where g=0,1,2 means hh,ph,pp. Used for screening products in the commutators.
+arma::mat TwoBodyME::GetSubBlockNorms(int ch) const
+{
+   TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
+   const arma::mat& matrix = GetMatrix(ch,ch);
+   arma::uvec groups[3] = { tbc.GetKetIndex_hh(), tbc.GetKetIndex_ph(), tbc.GetKetIndex_pp() };
+   arma::mat norms(3,3,arma::fill::zeros);
+   for (int g1=0;g1<3;++g1)
+   {
+     if (groups[g1].n_elem==0) continue;
+     for (int g2=0;g2<3;++g2)
+     {
+       if (groups[g2].n_elem==0) continue;
+       if ( TwoBodyChannel::IsContiguous(groups[g1]) and TwoBodyChannel::IsContiguous(groups[g2]) )
+         norms(g1,g2) = arma::norm( matrix( arma::span(groups[g1](0),groups[g1](groups[g1].n_elem-1)), arma::span(groups[g2](0),groups[g2](groups[g2].n_elem-1)) ), "fro");
+       else
+         norms(g1,g2) = arma::norm( matrix.submat(groups[g1],groups[g2]), "fro");
+     }
+   }
+   return norms;
+}
+
+
 void TwoBodyME::Symmetrize()
 {
   if (rank_J>0 or rank_T>0 or parity>0) return;
@@ -716,12 +893,7 @@ void TwoBodyME::AntiSymmetrize()
 
 void TwoBodyME::Scale(double x)
 {
-   for ( auto& itmat : MatEl )
-   {
-      arma::mat& matrix = itmat.second;
-      matrix *= x;
-   }
-
+   *this *= x;
 }
 
 void TwoBodyME::Eye()
@@ -747,39 +919,53 @@ int TwoBodyME::Dimension()
 
 int TwoBodyME::size()
 {
-  int size=0;
-  for ( auto& itmat : MatEl )
-     size += itmat.second.size();
-  return size*sizeof(double);
+  return MatElStorage.size()*sizeof(double);
 }
 
 
 
-void TwoBodyME::WriteBinary( ofstream& of )
+void TwoBodyME::WriteBinary( ostream& of )
 {
+  if (packed)
+  {
+    TwoBodyME unpacked(*this);
+    unpacked.Unpack();
+    unpacked.WriteBinary(of);
+    return;
+  }
+  int version_tag = -TWOBODY_BINARY_VERSION;
+  of.write((char*)&version_tag,sizeof(version_tag));
   of.write((char*)&nChannels,sizeof(nChannels));
   of.write((char*)&hermitian,sizeof(hermitian));
   of.write((char*)&antihermitian,sizeof(antihermitian));
   of.write((char*)&rank_J,sizeof(rank_J));
   of.write((char*)&rank_T,sizeof(rank_T));
   of.write((char*)&parity,sizeof(parity));
-  for ( auto& itmat : MatEl )
-    of.write((char*)itmat.second.memptr(),itmat.second.size()*sizeof(double));
+  of.write((char*)MatElStorage.data(),MatElStorage.size()*sizeof(double));
 
 }
 
 
-void TwoBodyME::ReadBinary( ifstream& of )
+/// Throws if the data was written by a version with a different layout of the matrix elements.
+void TwoBodyME::ReadBinary( istream& of )
 {
+  int version_tag = 0;
+  of.read((char*)&version_tag,sizeof(version_tag));
+  if ( not of.good() or version_tag != -TWOBODY_BINARY_VERSION )
+  {
+    cout << "Error: TwoBodyME binary data has version tag " << version_tag << ", expected " << -TWOBODY_BINARY_VERSION
+         << ". It was written with a different ket ordering and can't be used." << endl;
+    throw runtime_error("TwoBodyME::ReadBinary: incompatible binary format");
+  }
   of.read((char*)&nChannels,sizeof(nChannels));
   of.read((char*)&hermitian,sizeof(hermitian));
   of.read((char*)&antihermitian,sizeof(antihermitian));
   of.read((char*)&rank_J,sizeof(rank_J));
   of.read((char*)&rank_T,sizeof(rank_T));
   of.read((char*)&parity,sizeof(parity));
+  packed = false;
   Allocate();
-  for ( auto& itmat : MatEl )
-    of.read((char*)itmat.second.memptr(),itmat.second.size()*sizeof(double));
+  of.read((char*)MatElStorage.data(),MatElStorage.size()*sizeof(double));
 
 }
 
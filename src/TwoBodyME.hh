@@ -7,12 +7,15 @@
 #include "ModelSpace.hh"
 class TwoBodyME_ph;
 
-/// The two-body piece of the operator, stored in a vector of maps of of armadillo matrices.
-/// The index of the vector indicates the J-coupled two-body channel of the ket state, while the
-/// map key is the two-body channel of the bra state. This is done to allow for tensor operators
-/// which connect different two-body channels without having to store all possible combinations.
-/// In the case of a scalar operator, there is only one map key for the bra state, corresponding
-/// to that of the ket state.
+/// The two-body piece of the operator, stored as a list of armadillo matrices, one for each
+/// pair of J-coupled two-body channels {ch_bra,ch_ket} with ch_bra <= ch_ket connected by the operator.
+/// This is done to allow for tensor operators which connect different two-body channels
+/// without having to store all possible combinations. In the case of a scalar operator,
+/// there is only one block per channel, with ch_bra = ch_ket.
+/// All of the blocks live in a single contiguous buffer, MatElStorage, and the matrices in
+/// MatEl are armadillo views into that buffer, so copying an operator is a single copy of the buffer
+/// and element-wise operations (scaling, adding, norms) are single loops over it.
+/// MatElIndex maps ch_bra*nChannels+ch_ket to the position of that block in MatEl (or -1).
 /// The normalized J-coupled TBME's are stored in the matrices. However, when the TBME's are
 /// accessed by GetTBME(), they are returned as
 /// \f$ \tilde{\Gamma}_{ijkl} \equiv \sqrt{(1+\delta_{ij})(1+\delta_{kl})} \Gamma_{ijkl} \f$
@@ -32,19 +35,27 @@ class TwoBodyME
 {
  public:
   ModelSpace*  modelspace;
-  map<array<int,2>,arma::mat> MatEl;
+  vector<pair<array<int,2>,arma::mat>> MatEl; ///< Views into MatElStorage, ordered by {ch_bra,ch_ket}
+  vector<double> MatElStorage; ///< Contiguous storage for all the channel blocks
+  vector<int> MatElIndex; ///< Position in MatEl of block {ch_bra,ch_ket}, or -1 if it isn't allocated
   int nChannels;
   bool hermitian;
   bool antihermitian;
   int rank_J;
   int rank_T;
   int parity;
+  bool packed = false; ///< If true, MatElStorage only holds the upper triangle of each block. See Pack().
 
   ~TwoBodyME();
   TwoBodyME();
   TwoBodyME(ModelSpace*);
   TwoBodyME(TwoBodyME_ph&); // Transform a ph operator to pp.
   TwoBodyME(ModelSpace* ms, int rankJ, int rankT, int parity);
+  TwoBodyME(const TwoBodyME&);
+  TwoBodyME(TwoBodyME&&) = default;
+
+  TwoBodyME& operator=(const TwoBodyME&);
+  TwoBodyME& operator=(TwoBodyME&&) = default;
 
   TwoBodyME& operator*=(const double);
   TwoBodyME& operator+=(const TwoBodyME&);
@@ -52,17 +63,29 @@ class TwoBodyME
 
 //  void Copy(const TwoBodyME&);
   void Allocate();
+  void SetUpMatElViews(); ///< Point the matrices in MatEl at MatElStorage
+  bool SameLayout(const TwoBodyME&) const; ///< True if both operators store the same blocks
   bool IsHermitian(){return hermitian;};
   bool IsAntiHermitian(){return antihermitian;};
   bool IsNonHermitian(){return not (hermitian or antihermitian);};
   void SetHermitian();
   void SetAntiHermitian();
   void SetNonHermitian();
-
-  arma::mat& GetMatrix(int chbra, int chket){return MatEl.at({chbra,chket});};
+  void Pack(); ///< Compress to the upper triangles, for storage only
+  void Unpack(); ///< Undo Pack()
+  bool IsPacked() const {return packed;};
+
+  /// Position of block {chbra,chket} in MatEl, or MatEl.size() if it isn't allocated, so that MatEl.at() complains.
+  size_t BlockIndex(int chbra, int chket) const
+  {
+    if (chbra<0 or chket<0 or chbra>=nChannels or chket>=nChannels or MatElIndex[chbra*nChannels+chket]<0) return MatEl.size();
+    return MatElIndex[chbra*nChannels+chket];
+  };
+  bool HasMatrix(int chbra, int chket) const {return BlockIndex(chbra,chket) < MatEl.size();};
+  arma::mat& GetMatrix(int chbra, int chket){return MatEl.at(BlockIndex(chbra,chket)).second;};
   arma::mat& GetMatrix(int ch){return GetMatrix(ch,ch);};
   arma::mat& GetMatrix(array<int,2> a){return GetMatrix(a[0],a[1]);};
-  const arma::mat& GetMatrix(int chbra, int chket)const {return  MatEl.at({chbra,chket});};
+  const arma::mat& GetMatrix(int chbra, int chket)const {return  MatEl.at(BlockIndex(chbra,chket)).second;};
   const arma::mat& GetMatrix(int ch)const {return  GetMatrix(ch,ch);};
 
  //TwoBody setter/getters
@@ -86,6 +109,7 @@ class TwoBodyME
   void   SetTBME_J(int j_bra, int j_ket, int a, int b, int c, int d, double tbme);
   void   AddToTBME_J(int j_bra, int j_ket, int a, int b, int c, int d, double tbme);
   double GetTBME_J_norm(int j_bra, int j_ket, int a, int b, int c, int d) const;
+  template <bool Scalar> double GetTBME_J(int j_bra, int j_ket, int a, int b, int c, int d) const;
 
   // Scalar setters/getters for backwards compatibility
   double GetTBME(int ch, int a, int b, int c, int d) const;
@@ -127,20 +151,53 @@ class TwoBodyME
   void Erase();
   void Scale(double);
   double Norm() const;
+  arma::mat GetSubBlockNorms(int ch) const; ///< Norms of the hh,ph,pp sub-blocks of channel ch
   void Symmetrize();
   void AntiSymmetrize();
   void Eye();
-  void PrintMatrix(int chbra,int chket) const { MatEl.at({chbra,chket}).print();};
+  void PrintMatrix(int chbra,int chket) const { GetMatrix(chbra,chket).print();};
   int Dimension();
   int size();
 
-  void WriteBinary(ofstream&);
-  void ReadBinary(ifstream&);
-
+  void WriteBinary(ostream&);
+  void ReadBinary(istream&);
 
 };
 
 
+/// GetTBME_J() with the selection rules fixed at compile time, for use in the inner loops
+/// of the commutators and Pandya transformations. The non-template version dispatches to this.
+/// With Scalar=true the operator must be a scalar (rank_J = rank_T = parity = 0), so the bra and ket
+/// must have the same quantum numbers and there is only one channel to look up.
+/// With Scalar=false, the rank_J, rank_T and parity of the operator are checked as usual.
+template <bool Scalar>
+inline double TwoBodyME::GetTBME_J(int j_bra, int j_ket, int a, int b, int c, int d) const
+{
+   Orbit& oa = modelspace->GetOrbit(a);
+   Orbit& ob = modelspace->GetOrbit(b);
+   Orbit& oc = modelspace->GetOrbit(c);
+   Orbit& od = modelspace->GetOrbit(d);
+   int parity_bra = (oa.l+ob.l)%2;
+   int parity_ket = (oc.l+od.l)%2;
+   int Tz_bra = (oa.tz2+ob.tz2)/2;
+   int Tz_ket = (oc.tz2+od.tz2)/2;
+   if (Scalar)
+   {
+     if ( j_bra!=j_ket or parity_bra!=parity_ket or Tz_bra!=Tz_ket ) return 0;
+   }
+   else
+   {
+     if ( (parity+parity_bra+parity_ket)%2 > 0) return 0;
+     if ( abs(Tz_bra-Tz_ket)>rank_T) return 0;
+     if ( abs(j_bra-j_ket) > rank_J) return 0;
+     if ( j_bra + j_ket < rank_J) return 0;
+   }
+   int ch_bra = modelspace->GetTwoBodyChannelIndex(j_bra,parity_bra,Tz_bra);
+   int ch_ket = Scalar ? ch_bra : modelspace->GetTwoBodyChannelIndex(j_ket,parity_ket,Tz_ket);
+   return GetTBME(ch_bra,ch_ket,a,b,c,d);
+}
+
+
 
 
 #endif
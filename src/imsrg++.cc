@@ -37,7 +37,12 @@ int main(int argc, char** argv)
   string denominator_delta_orbit = parameters.s("denominator_delta_orbit");
   string LECs = parameters.s("LECs");
   string scratch = parameters.s("scratch");
+  string symbol_cache = parameters.s("symbol_cache");
+  string checkpoint = parameters.s("checkpoint");
+  string resume = parameters.s("resume");
+  string pack_omegas = parameters.s("pack_omegas");
   string use_brueckner_bch = parameters.s("use_brueckner_bch");
+  string use_pandya_plans = parameters.s("use_pandya_plans");
   string valence_file_format = parameters.s("valence_file_format");
   string occ_file = parameters.s("occ_file");
 
@@ -46,6 +51,8 @@ int main(int argc, char** argv)
   int lmax3 = parameters.i("lmax3");
   int targetMass = parameters.i("A");
   int nsteps = parameters.i("nsteps");
+  int checkpoint_interval = parameters.i("checkpoint_interval");
+  int hf_diis_history = parameters.i("hf_diis_history");
   int file2e1max = parameters.i("file2e1max");
   int file2e2max = parameters.i("file2e2max");
   int file2lmax = parameters.i("file2lmax");
@@ -56,6 +63,9 @@ int main(int argc, char** argv)
   double hw = parameters.d("hw");
   double smax = parameters.d("smax");
   double ode_tolerance = parameters.d("ode_tolerance");
+  double commutator_screening_threshold = parameters.d("commutator_screening_threshold");
+  double pandya_plans_max_memory = parameters.d("pandya_plans_max_memory");
+  double sixj_table_max_memory = parameters.d("sixj_table_max_memory");
   double dsmax = parameters.d("dsmax");
   double ds_0 = parameters.d("ds_0");
   double domega = parameters.d("domega");
@@ -95,6 +105,9 @@ int main(int argc, char** argv)
   ReadWrite rw;
   rw.SetLECs_preset(LECs);
   rw.SetScratchDir(scratch);
+  if (symbol_cache != "none")
+    ModelSpace::LoadSymbolCache(symbol_cache);
+  ModelSpace::SetSixJTableMaxMemory(sixj_table_max_memory);
   ModelSpace modelspace = reference=="default" ? ModelSpace(eMax,valence_space) : ModelSpace(eMax,reference,valence_space);
   if (occ_file != "none" and occ_file != "" )
   {
@@ -122,6 +135,9 @@ int main(int argc, char** argv)
     Hbare.SetUseBruecknerBCH(true);
     cout << "Using Brueckner flavor of BCH" << endl;
   }
+  Hbare.Set_Commutator_Screening_Threshold(commutator_screening_threshold);
+  Hbare.SetUsePandyaPlans(use_pandya_plans == "true");
+  ModelSpace::SetPandyaPlansMaxMemory(pandya_plans_max_memory);
 
   cout << "Reading interactions..." << endl;
 
@@ -155,6 +171,7 @@ int main(int argc, char** argv)
   }
 
   HartreeFock hf(Hbare);
+  hf.SetDIISHistory(hf_diis_history);
   hf.Solve();
   cout << "EHF = " << hf.EHF << endl;
   
@@ -224,6 +241,7 @@ int main(int argc, char** argv)
   
   if ( method == "HF" or method == "MP3")
   {
+    ModelSpace::WriteSymbolCache();
     Hbare.PrintTimes();
     return 0;
   }
@@ -247,12 +265,31 @@ int main(int argc, char** argv)
   imsrgsolver.SetdOmega(domega);
   imsrgsolver.SetOmegaNormMax(omega_norm_max);
   imsrgsolver.SetODETolerance(ode_tolerance);
+  imsrgsolver.SetPackOmegas(pack_omegas == "true");
   if (denominator_delta_orbit != "none")
     imsrgsolver.SetDenominatorDeltaOrbit(denominator_delta_orbit);
 
-  if (nsteps > 1) // two-step decoupling, do core first
+  // If we're resuming, the checkpoint restores the generator, so we figure out which stage
+  // of the decoupling it was written in and skip the SetGenerator call for that stage.
+  bool resumed = false;
+  bool resume_valence = false;
+  if (checkpoint != "none")
   {
-    imsrgsolver.SetGenerator(core_generator);
+    imsrgsolver.SetCheckpointFile(checkpoint);
+    imsrgsolver.SetCheckpointInterval(checkpoint_interval);
+    if (resume == "true")
+      resumed = imsrgsolver.ReadCheckpoint(checkpoint);
+    if (resumed)
+    {
+      string gen = imsrgsolver.GetGenerator().GetType();
+      resume_valence = nsteps<=1 or (gen==valence_generator and (gen!=core_generator or imsrgsolver.GetS()>=smax));
+    }
+  }
+
+  if (nsteps > 1 and not resume_valence) // two-step decoupling, do core first
+  {
+    if (not resumed)
+      imsrgsolver.SetGenerator(core_generator);
     if (core_generator.find("imaginary")!=string::npos)
     {
      if (ds_0>1e-2)
@@ -264,10 +301,11 @@ int main(int argc, char** argv)
      }
     }
     imsrgsolver.Solve();
-    if (method == "magnus") smax *= 2;
   }
+  if (nsteps > 1 and method == "magnus") smax *= 2;
 
-  imsrgsolver.SetGenerator(valence_generator);
+  if (not resume_valence)
+    imsrgsolver.SetGenerator(valence_generator);
   if (valence_generator.find("imaginary")!=string::npos)
   {
    if (ds_0>1e-2)
@@ -286,11 +324,10 @@ int main(int argc, char** argv)
   if (method == "magnus")
   {
     if (ops.size()>0) cout << "transforming operators" << endl;
+    imsrgsolver.TransformMany(ops);
     for (size_t i=0;i<ops.size();++i)
     {
-      cout << opnames[i] << " " << flush;
-      ops[i] = imsrgsolver.Transform(ops[i]);
-      cout << " (" << ops[i].ZeroBody << " ) " << endl; 
+      cout << opnames[i] << " (" << ops[i].ZeroBody << " ) " << endl; 
     }
     cout << endl;
     // increase smax in case we need to do additional steps
@@ -334,22 +371,27 @@ int main(int argc, char** argv)
     cout << "Doing NO wrt A=" << ms2.GetAref() << " Z=" << ms2.GetZref() << "  norbits = " << ms2.GetNumberOrbits() << endl;
     Hbare = Hbare.DoNormalOrdering();
 
+    imsrgsolver.SetCheckpointFile(""); // the checkpoint only covers the main decoupling
     imsrgsolver.SetHin(Hbare);
     imsrgsolver.SetEtaCriterion(1e-4);
     imsrgsolver.Solve();
     // Change operators to the new basis, then apply the rest of the transformation
     cout << "Final transformation on the operators..." << endl;
+    vector<double> ZeroBody_before, ZeroBody_undo, ZeroBody_mid;
     for (auto& op : ops)
     {
-      double ZeroBody_before = op.ZeroBody;
+      ZeroBody_before.push_back(op.ZeroBody);
       op = op.UndoNormalOrdering();
-      double ZeroBody_undo = op.ZeroBody;
+      ZeroBody_undo.push_back(op.ZeroBody);
       op.SetModelSpace(ms2);
       op = op.DoNormalOrdering();
-      double ZeroBody_mid = op.ZeroBody;
-      // transform using the remaining omegas
-      op = imsrgsolver.Transform_Partial(op,nOmega);
-      cout << ZeroBody_before << "   =>   " << ZeroBody_undo << "   =>   " << ZeroBody_mid<< "   =>   " << op.ZeroBody << endl;
+      ZeroBody_mid.push_back(op.ZeroBody);
+    }
+    // transform using the remaining omegas
+    imsrgsolver.TransformMany_Partial(ops,nOmega);
+    for (size_t i=0;i<ops.size();++i)
+    {
+      cout << ZeroBody_before[i] << "   =>   " << ZeroBody_undo[i] << "   =>   " << ZeroBody_mid[i] << "   =>   " << ops[i].ZeroBody << endl;
     }
   }
 
@@ -406,6 +448,7 @@ int main(int argc, char** argv)
   }
 
 
+  ModelSpace::WriteSymbolCache();
   Hbare.PrintTimes();
  
   return 0;
@@ -1,11 +1,14 @@
 #include "imsrg_util.hh"
 #include "AngMom.hh"
+#include "RadialBasis.hh"
 #include <boost/multiprecision/cpp_bin_float.hpp>
 #include <boost/math/special_functions/gamma.hpp>
 #include <boost/multiprecision/float128.hpp>
 #include <boost/implicit_cast.hpp>
 #include <gsl/gsl_integration.h>
 #include <list>
+#include <set>
+#include <unordered_set>
 #include <cmath>
 #include <algorithm>
 #include <stdlib.h>
@@ -217,18 +220,11 @@ double HO_Radial_psi(int n, int l, double hw, double r)
 
  vector<double> GetDensity( vector<double>& occupation, vector<double>& R, vector<int>& orbits, ModelSpace& modelspace )
  {
-     int nr_steps = R.size();
-     double hw = modelspace.GetHbarOmega();
-     vector<double> dens(nr_steps,0);
-     for (int& i : orbits)
-     {
-       Orbit & oi = modelspace.GetOrbit(i);
-       for (int ir=0;ir<nr_steps;++ir)
-       {
-          dens[ir] += HO_density(oi.n,oi.l,hw,R[ir]) * occupation[i];
-       }
-     }
-     return dens;
+     double b = sqrt( (HBARC*HBARC) / (modelspace.GetHbarOmega() * M_NUCLEON) );
+     RadialBasis basis("harmonic", b, modelspace, R);
+     arma::mat D(modelspace.GetNumberOrbits(), modelspace.GetNumberOrbits(), arma::fill::zeros);
+     for (int& i : orbits) D(i,i) += occupation[i];
+     return arma::conv_to<vector<double>>::from( basis.Density(D) );
  }
 
  Operator Single_Ref_1B_Density_Matrix(ModelSpace& modelspace)
@@ -246,7 +242,8 @@ double HO_Radial_psi(int n, int l, double hw, double r)
  double Get_Charge_Density( Operator& DM, double r)
  {
    ModelSpace* modelspace = DM.GetModelSpace();
-   double hw = modelspace->GetHbarOmega();
+   double b = sqrt( (HBARC*HBARC) / (modelspace->GetHbarOmega() * M_NUCLEON) );
+   RadialBasis basis("harmonic", b, *modelspace, {r});
    double rho=0;
    for (index_t i : modelspace->proton_orbits )
    {
@@ -254,8 +251,7 @@ double HO_Radial_psi(int n, int l, double hw, double r)
       for ( index_t j : DM.OneBodyChannels[{oi.l,oi.j2,oi.tz2}] )
       {
         if (abs(DM.OneBody(i,j))<1e-7) continue;
-        Orbit& oj = modelspace->GetOrbit(j);
-        rho += DM.OneBody(i,j) * HO_Radial_psi(oi.n, oi.l, hw, r) * HO_Radial_psi(oj.n, oj.l, hw, r);
+        rho += DM.OneBody(i,j) * basis.psi(i,0) * basis.psi(j,0);
       }
    }
    return rho;
@@ -326,14 +322,15 @@ double getRadialIntegral(int n1, int l1, int n2, int l2, ModelSpace& modelspace)
     // Should be good for lmax < 10; could use some ordering to reduce the number of possiblities further
     double rad;
     auto it = modelspace.radList.find(ind);
-    if ( it != modelspace.radList.end() )  return modelspace.radList[ind];
+    if ( it != modelspace.radList.end() )  return it->second;
     cout << "Didn't find " << ind << " in rad list, making a new one" << endl;
-    //#pragma omp critical
-    //{
+    // The list is shared, so it is only added to outside of parallel regions
 	rad = RadialIntegral(n1, l1, n2, l2, -1, modelspace);
-	cout << "Calculated, writing to radList." << endl;
-	modelspace.radList[ind] = rad;
-    //}
+	if (not omp_in_parallel())
+	{
+	  cout << "Calculated, writing to radList." << endl;
+	  modelspace.radList[ind] = rad;
+	}
     cout << "Radial integral made, returning." << endl;
     return rad;
 }
@@ -470,97 +467,275 @@ Operator CSOneBody(ModelSpace& modelspace)
 	return op;
 }
 
-struct cs_RabRcd_params { int na; int la;
-			  int nb; int lb;
-			  int nc; int lc;
-			  int nd; int ld; int lp; double b; };
-
-double cs_Rnl(double r, int n, int l, double b)
+/// Radial grid for the Slater integrals
+/// \f[
+/// R^k(ab;cd) = \int dr_1 dr_2\, \rho_{ac}(r_1) \frac{r_<^k}{r_>^{k+1}} \rho_{bd}(r_2) = \int dr\, \rho_{bd}(r) Y^k_{ac}(r),
+/// \qquad \rho_{ac}(r) = r^2 R_a(r) R_c(r),
+/// \f]
+/// where the potential function
+/// \f[
+/// Y^k_{ac}(r) = r^{-k-1} \int_0^r dr'\, r'^k \rho_{ac}(r') + r^k \int_r^\infty dr'\, r'^{-k-1} \rho_{ac}(r')
+/// \f]
+/// is smooth, unlike the 2-D integrand with its kink at \f$ r_1=r_2 \f$.
+/// The grid cuts [0,rmax] into panels of equal width, each with the nodes of an m-point Gauss-Legendre rule.
+/// The inner integrals up to each node are done by integrating the polynomial which interpolates the integrand
+/// on the nodes of its panel. So once \f$ Y^k_{ac} \f$ is known (at a cost proportional to the number of grid points),
+/// each \f$ R^k \f$ is a single sum over the grid. The accuracy is set by the panel width and m.
+class SlaterGrid
 {
-	double x = 2.*b*r;
-	double norm = sqrt( pow(2*b,3) *gsl_sf_fact(n)/gsl_sf_fact(n+2*l+2) );
-	return norm * pow(x, l) * exp(-x*0.5) * gsl_sf_laguerre_n(n, 2*l+2, x);
+ public:
+  SlaterGrid(double rmax, double panel_width, int m=16);
+  RadialBasis Tabulate(string basis, double scale, const vector<array<int,2>>& nl_list) const;
+  arma::vec Density(const arma::rowvec& Ra, const arma::rowvec& Rc) const;
+  arma::vec Potential(const arma::vec& rho, int k) const;
+  double Integrate(const arma::vec& rho, const arma::vec& Yk) const;
+  size_t size() const {return r.size();};
+
+ private:
+  int m;
+  int npanels;
+  vector<double> r; ///< Grid points, panel by panel
+  vector<double> w; ///< Quadrature weights
+  vector<double> S; ///< S[i*m+j] is the integral of the interpolating polynomial of node j, from the start of the panel to node i
+};
+
+/// The interpolating polynomial of node j is \f$ \sum_n \frac{2n+1}{2} w_j P_n(x_j) P_n(x) \f$,
+/// and \f$ \int_{-1}^x P_n = (P_{n+1}(x)-P_{n-1}(x))/(2n+1) \f$ for n>0.
+SlaterGrid::SlaterGrid(double rmax, double panel_width, int m)
+: m(m), S(m*m)
+{
+  RadialBasis::GaussLegendre(rmax, panel_width, m, r, w);
+  npanels = r.size()/m;
+  double h = rmax/npanels;
+  vector<double> x(m), wx(m); // the rule on [-1,1], from the first panel
+  for (int i=0; i<m; ++i)
+  {
+    x[i] = 2*r[i]/h - 1;
+    wx[i] = 2*w[i]/h;
+  }
+
+  vector<double> P((m+1)*m); // P[n*m+i] = P_n(x_i)
+  for (int i=0; i<m; ++i)
+  {
+    P[i] = 1;
+    P[m+i] = x[i];
+    for (int n=2; n<=m; ++n) P[n*m+i] = ( (2*n-1)*x[i]*P[(n-1)*m+i] - (n-1)*P[(n-2)*m+i] ) / n;
+  }
+  for (int i=0; i<m; ++i)
+  {
+    for (int j=0; j<m; ++j)
+    {
+      double s = 0.5*(x[i]+1);
+      for (int n=1; n<m; ++n) s += 0.5*P[n*m+j] * ( P[(n+1)*m+i] - P[(n-1)*m+i] );
+      S[i*m+j] = 0.5*h * wx[j] * s;
+    }
+  }
 }
 
-int cs_RabRcd(unsigned ndim, const double *x, void *fdata, unsigned fdim, double *fval)
+/// The radial functions of basis (see RadialBasis) on the grid, one row per (n,l)
+RadialBasis SlaterGrid::Tabulate(string basis, double scale, const vector<array<int,2>>& nl_list) const
 {
-    (void)(ndim); // Avoid unused parameter warnings;
-    (void)(fval);
-    struct cs_RabRcd_params * params = (struct cs_RabRcd_params*)fdata;
+  return RadialBasis(basis, scale, nl_list, r, w);
+}
 
-    int na = (params->na);
-    int nb = (params->nb);
-    int nc = (params->nc);
-    int nd = (params->nd);
+/// \f$ \rho_{ac}(r) = r^2 R_a(r) R_c(r) \f$ from the tabulated radial functions
+arma::vec SlaterGrid::Density(const arma::rowvec& Ra, const arma::rowvec& Rc) const
+{
+  arma::vec rho(r.size());
+  for (size_t i=0; i<r.size(); ++i) rho[i] = r[i]*r[i] * Ra[i] * Rc[i];
+  return rho;
+}
 
-    int la = (params->la);
-    int lb = (params->lb);
-    int lc = (params->lc);
-    int ld = (params->ld);
+/// \f$ Y^k(r) \f$ on the grid. The integral from 0 is accumulated going outward, and the integral to rmax going inward.
+arma::vec SlaterGrid::Potential(const arma::vec& rho, int k) const
+{
+  arma::vec Yk(r.size());
+  vector<double> f(m);
+  double below = 0;
+  for (int p=0; p<npanels; ++p)
+  {
+    int offset = p*m;
+    for (int j=0; j<m; ++j) f[j] = rho[offset+j] * pow(r[offset+j],k);
+    for (int i=0; i<m; ++i)
+    {
+      double partial = 0;
+      for (int j=0; j<m; ++j) partial += S[i*m+j] * f[j];
+      Yk[offset+i] = (below + partial) / pow(r[offset+i],k+1);
+    }
+    for (int j=0; j<m; ++j) below += w[offset+j] * f[j];
+  }
+  double above = 0;
+  for (int p=npanels-1; p>=0; --p)
+  {
+    int offset = p*m;
+    double panel = 0;
+    for (int j=0; j<m; ++j)
+    {
+      f[j] = rho[offset+j] / pow(r[offset+j],k+1);
+      panel += w[offset+j] * f[j];
+    }
+    for (int i=0; i<m; ++i)
+    {
+      double partial = 0;
+      for (int j=0; j<m; ++j) partial += S[i*m+j] * f[j];
+      Yk[offset+i] += (above + panel - partial) * pow(r[offset+i],k);
+    }
+    above += panel;
+  }
+  return Yk;
+}
 
-    int lp = (params->lp);
+/// \f$ \int dr\, \rho(r) Y^k(r) \f$
+double SlaterGrid::Integrate(const arma::vec& rho, const arma::vec& Yk) const
+{
+  double sum = 0;
+  for (size_t i=0; i<r.size(); ++i) sum += w[i] * rho[i] * Yk[i];
+  return sum;
+}
 
-    double b = (params->b);
 
-    double r1 = x[0]/(1-x[0]);
-    double r2 = x[1]/(1-x[1]);
+/// Table of the radial Slater integrals in the Coulomb-Sturmian or hydrogen basis (see RadialBasis)
+/// \f[
+/// R^L(ab;cd) = \int dr_1 dr_2\, r_1^2 r_2^2 R_a(r_1) R_b(r_2) \frac{r_<^L}{r_>^{L+1}} R_c(r_1) R_d(r_2)
+/// \f]
+/// These depend only on the n and l of the four orbits and on L, not on J or the j's, so each
+/// distinct one is integrated once up front on a SlaterGrid, and CoulombTwoBodyME() looks them up.
+/// The integral is unchanged by \f$ a\leftrightarrow c \f$, \f$ b\leftrightarrow d \f$ and \f$ (ac)\leftrightarrow(bd) \f$,
+/// so the key is put in a canonical order.
+class SlaterTable
+{
+ public:
+  SlaterTable(ModelSpace& modelspace, string basis, double scale);
+  double Get(Orbit& o1, Orbit& o2, Orbit& o3, Orbit& o4, int L) const;
+  size_t size() const {return table.size();};
+
+ private:
+  static array<int,5> Key(Orbit& o1, Orbit& o2, Orbit& o3, Orbit& o4, int L);
+  void AddKeys(Orbit& o1, Orbit& o2, Orbit& o3, Orbit& o4, set<array<int,5>>& keys);
+  map<array<int,5>,double> table;
+};
+
+/// Orbits are labeled by n*1000+l. o1 and o3 go with r1, o2 and o4 with r2.
+array<int,5> SlaterTable::Key(Orbit& o1, Orbit& o2, Orbit& o3, Orbit& o4, int L)
+{
+  int nl1 = o1.n*1000+o1.l;
+  int nl2 = o2.n*1000+o2.l;
+  int nl3 = o3.n*1000+o3.l;
+  int nl4 = o4.n*1000+o4.l;
+  array<int,2> r1 = {{ min(nl1,nl3), max(nl1,nl3) }};
+  array<int,2> r2 = {{ min(nl2,nl4), max(nl2,nl4) }};
+  if (r2 < r1) swap(r1,r2);
+  return {{ r1[0], r1[1], r2[0], r2[1], L }};
+}
 
-    double rmin = min(r1,r2);
-    double rmax = max(r1,r2);
+/// The multipoles L which CoulombTwoBodyME() needs for <12|V|34>
+void SlaterTable::AddKeys(Orbit& o1, Orbit& o2, Orbit& o3, Orbit& o4, set<array<int,5>>& keys)
+{
+  int Lmin = max( abs(o1.j2-o3.j2), abs(o2.j2-o4.j2) )/2;
+  int Lmax = min( o1.j2+o3.j2, o2.j2+o4.j2 )/2;
+  for (int L=Lmin; L<=Lmax; ++L)
+  {
+    if ( (o1.l+o3.l+L)%2 !=0 || (o2.l+o4.l+L)%2 != 0) continue;
+    keys.insert( Key(o1,o2,o3,o4,L) );
+  }
+}
 
-    double Ra = cs_Rnl(r1, na, la, b);
-    double Rb = cs_Rnl(r2, nb, lb, b);
-    double Rc = cs_Rnl(r1, nc, lc, b);
-    double Rd = cs_Rnl(r2, nd, ld, b);
+/// Collect the integrals needed for the direct and exchange terms of every two-body matrix element, and integrate them.
+SlaterTable::SlaterTable(ModelSpace& modelspace, string basis, double scale)
+{
+  set<array<int,5>> keys;
+  for (int ch : modelspace.SortedTwoBodyChannels)
+  {
+    TwoBodyChannel& tbc = modelspace.GetTwoBodyChannel(ch);
+    int nkets = tbc.GetNumberKets();
+    for (int iket=0; iket<nkets; ++iket)
+    {
+      Ket& ket = tbc.GetKet(iket);
+      for (int jbra=0; jbra<=iket; ++jbra)
+      {
+        Ket& bra = tbc.GetKet(jbra);
+        AddKeys( *bra.op, *bra.oq, *ket.op, *ket.oq, keys);
+        AddKeys( *bra.op, *bra.oq, *ket.oq, *ket.op, keys);
+      }
+    }
+  }
 
-    fval[0] = Ra*Rb*Rc*Rd * pow(rmin,lp) *1./ pow(rmax,lp+1) * 1./pow(1-x[0],2) * 1./pow(1-x[1],2) * r1*r1*r2*r2;
+  set<int> nl_set;
+  int nmax = 0;
+  int nlmax = 0;
+  for (auto& k : keys)
+  {
+    for (int i=0; i<4; ++i)
+    {
+      nl_set.insert(k[i]);
+      nmax = max(nmax, k[i]/1000);
+      nlmax = max(nlmax, k[i]/1000 + k[i]%1000);
+    }
+  }
+  // The Coulomb-Sturmian functions go like x^(n+l) exp(-x/2), with x=2br,
+  // and the hydrogen functions like r^(n-1) exp(-r/(n a)), with a=BOHR_RADIUS/Z
+  double rmax = (50+4*(nlmax+1))/(2*scale);
+  double width = 1/(2*scale);
+  if (basis == "hydrogen")
+  {
+    width = BOHR_RADIUS/scale;
+    rmax = nmax*(25+2*nmax)*width;
+  }
+  SlaterGrid grid( rmax, width );
+  vector<int> nl_codes(nl_set.begin(), nl_set.end());
+  vector<array<int,2>> nl_list;
+  map<int,int> row;
+  for (int nl : nl_codes)
+  {
+    row[nl] = nl_list.size();
+    nl_list.push_back( {{nl/1000, nl%1000}} );
+  }
+  RadialBasis radial = grid.Tabulate(basis, scale, nl_list);
+
+  // Y^L for each (a,c) pair on r1
+  map<array<int,3>,arma::vec> potentials;
+  for (auto& k : keys) potentials.emplace( array<int,3>{{k[0],k[1],k[4]}}, arma::vec() );
+  vector<map<array<int,3>,arma::vec>::iterator> potential_list;
+  for (auto it=potentials.begin(); it!=potentials.end(); ++it) potential_list.push_back(it);
+  #pragma omp parallel for schedule(dynamic,1)
+  for (size_t i=0; i<potential_list.size(); ++i)
+  {
+    const array<int,3>& k = potential_list[i]->first;
+    potential_list[i]->second = grid.Potential( grid.Density( radial.psi.row(row.at(k[0])), radial.psi.row(row.at(k[1])) ), k[2] );
+  }
 
-    return 0;
+  vector<array<int,5>> key_list(keys.begin(),keys.end());
+  vector<double> values(key_list.size());
+  #pragma omp parallel for schedule(dynamic,1)
+  for (size_t i=0; i<key_list.size(); ++i)
+  {
+    const array<int,5>& k = key_list[i];
+    values[i] = grid.Integrate( grid.Density( radial.psi.row(row.at(k[2])), radial.psi.row(row.at(k[3])) ), potentials.at({{k[0],k[1],k[4]}}) );
+  }
+  for (size_t i=0; i<key_list.size(); ++i) table[key_list[i]] = values[i];
 }
 
-double csTwoBodyME(Orbit& o1, Orbit& o2, Orbit& o3, Orbit& o4, int J, double b)
+double SlaterTable::Get(Orbit& o1, Orbit& o2, Orbit& o3, Orbit& o4, int L) const
 {
-        double xmin[2] = {0,0};
-        double xmax[2] = {1,1};
-        int max_iter = 1e4;
-        double max_err = 1e-4;
+  return table.at( Key(o1,o2,o3,o4,L) );
+}
 
+
+/// Angular recoupling of the radial Slater integrals, looked up in radial.
+double CoulombTwoBodyME(Orbit& o1, Orbit& o2, Orbit& o3, Orbit& o4, int J, const SlaterTable& radial)
+{
 	double me = 0.;
-        double me_err = 0.;
         int Lmin = max( abs(o1.j2-o3.j2), abs(o2.j2-o4.j2) )*0.5;
         int Lmax = min( o1.j2+o3.j2, o2.j2+o4.j2 )*0.5;
         for (int L = Lmin; L<= Lmax; L++)
         {
         	if ( (o1.l+o3.l+L)%2 !=0 || (o2.l+o4.l+L)%2 != 0) continue;
                 double temp = SixJ( o1.j2*0.5,o2.j2*0.5,J, o4.j2*0.5,o3.j2*0.5,L );
-                if (temp == 0)
-                {
-                	// cout << "SixJs Returned Zero! L=" << L << " J=" << J << endl;
-                        // cout << " <(" << o1.n << o1.l << o1.j2 << ")(" << o2.n << o2.l << o2.j2 << ")" << J << "|V|(" << o3.n << o3.l << o3.j2 << ")(" << o4.n << o4.l << o4.j2 << ")>" << endl;
-                        continue;
-                }
+                if (temp == 0) continue;
                 temp *= ThreeJ( o1.j2*0.5,L,o3.j2*0.5, -0.5,0,0.5) * ThreeJ( o2.j2*0.5,L,o4.j2*0.5, -0.5,0,0.5);
-                if (temp == 0)
-                {
-                	// cout << "ThreeJs returned zero!" << endl;
-                        continue;
-                }
-
-                struct cs_RabRcd_params int_params = { o1.n,o1.l, o2.n,o2.l, o3.n,o3.l, o4.n,o4.l, L, b};
-                double val;
-                double err;
-                hcubature(1, &cs_RabRcd, &int_params, 2, xmin, xmax, max_iter, 0, max_err, ERROR_INDIVIDUAL, &val, &err);
-		/*		
-		cout << "L=" << L << endl;
-		cout << "val=" << val << endl;
-		cout << "sixj=" << SixJ( o1.j2*0.5,o2.j2*0.5,J, o4.j2*0.5,o3.j2*0.5,L ) << endl;
-		cout << "3j ac=" << ThreeJ( o1.j2*0.5,L,o3.j2*0.5, -0.5,0,0.5) << endl;
-		cout << "3j bd=" << ThreeJ( o2.j2*0.5,L,o4.j2*0.5, -0.5,0,0.5) << endl;
-		*/
-		me += temp*val;
-		me_err += temp*err;
+                if (temp == 0) continue;
+		me += temp * radial.Get(o1,o2,o3,o4,L);
 	}
-	//cout << "me=" << me << " error=" << me_err << endl;
 	return me;
 }
 
@@ -578,8 +753,10 @@ Operator CSTwoBody(ModelSpace& modelspace)
 	double b = modelspace.GetHbarOmega();
 	double Ha = 1; // 27.21138602;
 	vector<me_params> params_vec;
+	SlaterTable radial(modelspace, "sturmian", b);
+	cout << "CSTwoBody: " << radial.size() << " radial integrals" << endl;
 	
-	for (int ch=0; ch<=nchan; ch++)
+	for (int ch=0; ch<nchan; ch++)
 	{
 		TwoBodyChannel& tbc = modelspace.GetTwoBodyChannel(ch);
                 int nkets = tbc.GetNumberKets();
@@ -623,11 +800,11 @@ Operator CSTwoBody(ModelSpace& modelspace)
 
                 // cout << "Indices:" << endl;
                 // cout << o1.index << o2.index << o3.index << o4.index << endl;
-                me = csTwoBodyME(o1, o2, o3, o4, tbc.J, b);
+                me = CoulombTwoBodyME(o1, o2, o3, o4, tbc.J, radial);
                 double me_norm = Ha * sqrt( (o1.j2+1.)*(o2.j2+1.)*(o3.j2+1.)*(o4.j2+1.) ) * pow(-1, (o1.j2+o3.j2)*0.5+tbc.J);
                 if ( o3.index != o4.index )
                 {
-                	asym_me = csTwoBodyME(o1, o2, o4, o3, tbc.J, b) * Ha * sqrt( (o1.j2+1.)*(o2.j2+1.)*(o3.j2+1.)*(o4.j2+1.) ) * pow(-1, (o1.j2+o4.j2)*0.5+tbc.J);
+                	asym_me = CoulombTwoBodyME(o1, o2, o4, o3, tbc.J, radial) * Ha * sqrt( (o1.j2+1.)*(o2.j2+1.)*(o3.j2+1.)*(o4.j2+1.) ) * pow(-1, (o1.j2+o4.j2)*0.5+tbc.J);
                 } else {
                 	asym_me = me * Ha * sqrt( (o1.j2+1.)*(o2.j2+1.)*(o3.j2+1.)*(o4.j2+1.) ) * pow(-1, (o1.j2+o4.j2)*0.5+tbc.J);
                 }
@@ -884,7 +1061,7 @@ Operator InverseR_Op(ModelSpace& modelspace)
 	Orbit& oj = modelspace.GetOrbit(j);
 	if ( oi.l != oj.l ) continue; // From spherical harmonics orthogonality; \delta_j1j2 ?
 	//double temp1 = getRadialIntegral(oi.n, oi.l, oj.n, oj.l, modelspace)*(-HBARC / (137.035999139) * modelspace.GetTargetZ()); //  -Z\hbarc\alpha
-	double temp1 = RadialIntegral(oi.n,oi.l, oj.n, oj.l, -1, modelspace)*(-HBARC / (137.035999139) * modelspace.GetTargetZ());
+	double temp1 = RadialIntegral(oi.n,oi.l, oj.n, oj.l, -1, modelspace)*(-HBARC * ALPHA_FS * modelspace.GetTargetZ());
 	if (temp1 == 0) cout << "Writing 0 at " << oi.n << oi.l << oj.n << oj.l << endl;
 	InvR.OneBody(i,j) = temp1;
 	InvR.OneBody(j,i) = temp1;
@@ -1427,40 +1604,50 @@ Operator ElectronTwoBody_original(ModelSpace& modelspace)
   return V12;
 }
 
+/// Electron-electron Coulomb interaction in the hydrogen basis.
+/// The radial integrals are done once, for the distinct (n,l) combinations, in a SlaterTable which is shared
+/// by the direct and exchange terms of all the matrix elements. Each matrix element which is unique under
+/// the symmetries (one channel, bra <= ket) is one item of a single parallel loop over all channels,
+/// and each item only writes its own element, so nothing needs a lock.
 Operator ElectronTwoBody(ModelSpace& modelspace)
 {
   double t_start = omp_get_wtime();
   cout << "Entering ElectronTwoBody." << endl;
-  int nchan = modelspace.GetNumberTwoBodyChannels();
   Operator V12(modelspace);
   V12.SetHermitian();
   V12.Erase();
-  //#pragma omp parallel for schedule(dynamic,1) // Throws an error on for ( int ch : .. .  claims it requires an = before :
+  SlaterTable radial(modelspace, "hydrogen", modelspace.GetTargetZ());
+  cout << "ElectronTwoBody: " << radial.size() << " radial integrals" << endl;
+
+  vector<me_params> params_vec;
   for ( int ch : modelspace.SortedTwoBodyChannels )
   {
     TwoBodyChannel& tbc = modelspace.GetTwoBodyChannel(ch);
     int nkets = tbc.GetNumberKets();
-    if (nkets == 0) continue; // SortedTwoBodies should only contain > 0 kets, so this should be redundant.
-    for (int ibra = 0; ibra < nkets; ++ibra)
+    for (int iket=0; iket<nkets; ++iket)
     {
-      Ket & bra = tbc.GetKet(ibra);
-      Orbit & o1 = modelspace.GetOrbit(bra.p);
-      Orbit & o2 = modelspace.GetOrbit(bra.q);
-      for (int jket = ibra; jket < nkets; jket++)
-      {
-        Ket & ket = tbc.GetKet(jket);
-        Orbit & o3 = modelspace.GetOrbit(ket.p);
-        Orbit & o4 = modelspace.GetOrbit(ket.q);
-        double me = HBARC*(1./137) / (sqrt( (1+ket.delta_pq())*(1+bra.delta_pq()) )) *
-          ( ElectronTwoBodyME_original(o1,o2,o3,o4,tbc.J,modelspace.GetTargetZ())
-            - pow(-1,(o1.j2+o2.j2)/2 - tbc.J) * ElectronTwoBodyME_original(o1,o2,o4,o3,tbc.J,modelspace.GetTargetZ()) );
-        V12.TwoBody.SetTBME(ch, jket, ibra, me);
-        V12.TwoBody.SetTBME(ch, ibra, jket, me);
-      } // jket
-    } // ibra
-    cout << "time for channel: " << ch << " is " <<
-      omp_get_wtime() - t_start  << " sec." << endl;
-  } // ch
+      for (int jbra=0; jbra<=iket; ++jbra) params_vec.push_back( {ch,iket,jbra,tbc.J} );
+    }
+  }
+
+  #pragma omp parallel for schedule(dynamic,64)
+  for (size_t i=0; i<params_vec.size(); ++i)
+  {
+    me_params& p = params_vec[i];
+    TwoBodyChannel& tbc = modelspace.GetTwoBodyChannel(p.ch);
+    Ket & ket = tbc.GetKet(p.iket);
+    Ket & bra = tbc.GetKet(p.jbra);
+    Orbit & o1 = *bra.op;
+    Orbit & o2 = *bra.oq;
+    Orbit & o3 = *ket.op;
+    Orbit & o4 = *ket.oq;
+    double direct = CoulombTwoBodyME(o1,o2,o3,o4,p.tbcJ,radial) * modelspace.phase((o1.j2+o3.j2)/2+p.tbcJ);
+    double exchange = CoulombTwoBodyME(o1,o2,o4,o3,p.tbcJ,radial) * modelspace.phase((o1.j2+o4.j2)/2+p.tbcJ);
+    double me = HBARC*ALPHA_FS * sqrt( (o1.j2+1)*(o2.j2+1)*(o3.j2+1)*(o4.j2+1) ) / sqrt( (1+ket.delta_pq())*(1+bra.delta_pq()) )
+              * ( direct - modelspace.phase((o3.j2+o4.j2)/2-p.tbcJ) * exchange );
+    V12.TwoBody.SetTBME(p.ch, p.iket, p.jbra, me);
+    V12.TwoBody.SetTBME(p.ch, p.jbra, p.iket, me);
+  }
   V12.profiler.timer["ElectronTwoBody"] += omp_get_wtime() - t_start;
   cout << "Leaving ElectronTwoBody." << endl;
   return V12;
@@ -1749,166 +1936,14 @@ Operator eeCoulomb_original(ModelSpace& modelspace)
     return V12;
 }
 
+/// Electron-electron Coulomb interaction in the hydrogen basis, built from the multipole expansion
+/// \f[ \langle ab;J | V | cd;J \rangle = (-1)^{j_b+j_c+J} \sum_k \left\{ \begin{array}{lll} j_a & j_b & J \\ j_d & j_c & k \end{array} \right\}
+///     \langle a \| C^k \| c \rangle \langle b \| C^k \| d \rangle R^k(ab;cd) \f]
+/// (minus the exchange term). This is the same interaction as ElectronTwoBody(), which builds it
+/// from a SlaterTable and CoulombTwoBodyME(), so both names give the same matrix elements.
 Operator eeCoulomb(ModelSpace& modelspace)
 {
-  double t_start = omp_get_wtime();
-  cout << "Entering eeCoulomb; precalculating." << endl;
-  //PrecalculationCoulomb(modelspace);
-  int nchan = modelspace.GetNumberTwoBodyChannels();
-  Operator V12(modelspace);
-  V12.SetHermitian();
-  V12.Erase();
-  double PI = 3.141592;
-  vector<unsigned long> cache_list;
-  vector<unsigned long> cache;
-  for ( int ch : modelspace.SortedTwoBodyChannels )
-  {
-    double t_start = omp_get_wtime();
-    TwoBodyChannel& tbc = modelspace.GetTwoBodyChannel(ch);
-    int nkets = tbc.GetNumberKets();
-    if (nkets == 0) continue;
-    #pragma omp parallel for
-    for (int ibra = 0; ibra < nkets; ++ibra)
-    {
-      Ket & bra = tbc.GetKet(ibra);
-      Orbit & oa = modelspace.GetOrbit(bra.p);
-      Orbit & ob = modelspace.GetOrbit(bra.q);
-      double sqr_coeff_ab = sqrt( (2*oa.l+1) * (2*ob.l+1) );
-
-      for (int Lab=abs(oa.l-ob.l); Lab<=oa.l+ob.l; Lab++)
-      {
-        for (int Sab=0; Sab<=1; Sab++)
-        {
-          double ab_9j = sqrt( (oa.j2+1) * (ob.j2+1) * (2*Lab+1) * (2*Sab+1) ) * modelspace.GetNineJ(oa.l,0.5,oa.j2*1./2, ob.l,0.5,ob.j2*1./2, Lab,Sab,tbc.J);
-          if (ab_9j == 0)
-          {
-            continue;
-          }
-
-          for (int jket = ibra; jket < nkets; jket++)
-          {
-            Ket & ket = tbc.GetKet(jket);
-            Orbit & oc = modelspace.GetOrbit(ket.p);
-            Orbit & od = modelspace.GetOrbit(ket.q);
-            if ( (oa.l + ob.l + oc.l + od.l)%2 != 0 ) continue;
-            double sqr_coeff_cd = sqrt( (2*oc.l+1) * (2*od.l+1) );
-            double me = 0;
-
-            for (int Lcd=abs(oc.l-od.l); Lcd<=oc.l+od.l; Lcd++)
-            {
-              for (int Scd=0; Scd<=1; Scd++)
-              {
-                if(Sab != Scd) continue;
-                double cd_9j = sqrt( (oc.j2+1) * (od.j2+1) * (2*Lcd+1) * (2*Scd+1) ) * modelspace.GetNineJ(oc.l,0.5,oc.j2*1./2, od.l,0.5,od.j2*1./2, Lcd,Scd,tbc.J);
-                if (cd_9j == 0)
-                {
-                  continue;
-                }
-
-                for (int mLab=-Lab; mLab<=Lab; mLab++)
-                {
-                  for (int mSab=-Sab; mSab<=Sab; mSab++)
-                  {
-                    int mJab = mLab + mSab;
-                    double LSab_clebsh = pow(-1,Lab-Sab+mJab) * sqrt(2*tbc.J+1) * ThreeJ(Lab,Sab,tbc.J, mLab,mSab,-mJab);
-                    if (LSab_clebsh == 0)
-                    {
-                      continue;
-                    }
-
-                    for (int mLcd=-Lcd; mLcd<=Lcd; mLcd++)
-                    {
-                      for (int mScd=-Scd; mScd<=Scd; mScd++)
-                      {
-                        int mJcd = mLcd + mScd;
-                        double LScd_clebsh = pow(-1,Lcd-Scd+mJcd) * sqrt(2*tbc.J+1) * ThreeJ(Lcd,Scd,tbc.J, mLcd,mScd,-mJcd);
-                        if (LScd_clebsh == 0) continue;
-
-                        for (int mla=-oa.l; mla<=oa.l; mla++)
-                        {
-                          for (int mlb=-ob.l; mlb<=ob.l; mlb++)
-                          {
-                            int Mlab = mla+mlb;
-                            double mlab_clebsh = pow(-1,oa.l-ob.l+Mlab) * sqrt(2*Lab+1) * ThreeJ(oa.l,ob.l,Lab, mla,mlb,-Mlab);
-                            if (mlab_clebsh == 0) continue;
-
-                            for (int mlc=-oc.l; mlc<=oc.l; mlc++)
-                            {
-                              for (int mld=-od.l; mld<=od.l; mld++)
-                              {
-                                int Mlcd = mlc+mld;
-                                double mlcd_clebsh = pow(-1,oc.l-od.l+Mlcd) * sqrt(2*Lcd+1) * ThreeJ(oc.l,od.l,Lcd, mlc,mld,-Mlcd);
-                                if (mlcd_clebsh == 0) continue;
-				#pragma omp critical
-                                for (int lp=max(abs(oa.l-ob.l), abs(oc.l-od.l)); lp <= min(oa.l+ob.l, od.l+od.l); lp++)
-                                {
-                                  double lp_3j = 0; //ThreeJ(oa.l,lp,oc.l, 0,0,0) * ThreeJ(ob.l,lp,od.l, 0,0,0);
-                                  double lp_3j_inv = 0; //ThreeJ(oa.l,lp,od.l, 0,0,0) * ThreeJ(ob.l,lp,oc.l, 0,0,0);
-                                  int d_ab = 0;
-                                  int d_cd = 0;
-                                  double sym_term = 1;
-                                  if (oa.n == ob.n && oa.l == ob.l && oa.j2 == ob.j2)
-                                  {
-                                    d_ab = 1;
-                                  }
-                                  if (oc.n == od.n && oc.l == od.l && oc.j2 == od.j2)
-                                  {
-                                    d_cd = 1;
-                                  }
-                                  sym_term *= sqrt(1+d_ab); //sqrt(1+ pow(-1,tbc.J)*d_ab) / (1+d_ab);
-                                  sym_term *= sqrt(1+d_cd); //sqrt(1+ pow(-1,tbc.J)*d_cd) / (1+d_cd);
-
-
-                                  for (int mlp = -lp; mlp <= lp; mlp++)
-                                  {
-
-                                    double lp_ac = pow(-1,mla+mlb+mlp) * ThreeJ(oa.l,oc.l,lp, mla,-mlc,-mlp);
-                                    double lp_bd = ThreeJ(ob.l,od.l,lp, mlb,-mld,mlp);
-                                    double lp_ad = pow(-1,mla+mlb+mlp) * ThreeJ(oa.l,od.l,lp, mla,-mld,-mlp);
-                                    double lp_bc = ThreeJ(ob.l,oc.l,lp, mlb,-mlc,mlp);
-
-                                    lp_3j += pow(-1,mlc+mld) * lp_ac*lp_bd;
-                                    lp_3j_inv += pow(-1,mlc+mld) * lp_ad*lp_bc;
-
-                                  } // mlp
-
-                                  if (lp_3j == 0 && lp_3j_inv == 0) continue;
-
-                                  lp_3j *= ThreeJ(oa.l,lp,oc.l, 0,0,0) * ThreeJ(ob.l,lp,od.l, 0,0,0);
-                                  lp_3j_inv *= ThreeJ(oa.l,lp,od.l, 0,0,0) * ThreeJ(ob.l,lp,oc.l, 0,0,0);
-                                  double val_sym = 0; //Integral[{oa.n, oa.l, ob.n, ob.l, oc.n, oc.l, od.n, od.l, lp}];
-                                  double val_asym = 0; //Integral[{oa.n, oa.l, ob.n, ob.l, od.n, od.l, oc.n, oc.l, lp}];
-                                  double val = val_sym*lp_3j - pow(-1, oc.j2*1./2+od.j2*1./2-tbc.J)*val_asym*lp_3j_inv;
-
-                                  val *= mlab_clebsh*mlcd_clebsh;
-                                  val *= LSab_clebsh*LScd_clebsh;
-                                  val *= ab_9j*cd_9j/sym_term; // factor of 2 in sym_term?
-                                  me += val;
-                                } // lp
-                              } // mld
-                            } // mlc
-                          } // mlb
-                        } // mla
-                      } // mScd
-                    } // mLcd
-                  } // mSab
-                } // mLab
-              } // Scd
-            } // Lcd
-            me *= sqr_coeff_ab * sqr_coeff_cd * HBARC/137.035999139;
-            V12.TwoBody.SetTBME(ch, jket, ibra, me);
-            V12.TwoBody.SetTBME(ch, ibra, jket, me);
-          } // jket
-        } // Sab
-      } // Lab
-    } // ibra
-    cout << "time for channel: " << ch << " is " <<
-      omp_get_wtime() - t_start  << " sec." << endl;
-    cout << V12.TwoBody.GetMatrix(ch) << endl;
-  } // channels
-  V12.profiler.timer["ElectronTwoBody"] += omp_get_wtime() - t_start;
-  cout << "Leaving ElectronTwoBody." << endl;
-  return V12;
+  return ElectronTwoBody(modelspace);
 }
 /*
 void PrecalculationCoulomb(ModelSpace& modelspace)
@@ -3425,7 +3460,14 @@ Operator NumericalE2b(ModelSpace& modelspace)
     return E;
 }
 
- /* Copied from other operator */
+ /// Two-body Coulomb term in the hydrogen basis, from the expansion of each hydrogen orbit in oscillator orbits,
+ /// \f[ \langle ab|V|cd\rangle_J = \sum_{N_aN_bN_cN_d} D_{N_a a} D_{N_b b} D_{N_c c} D_{N_d d}\, \langle N_aN_b|V|N_cN_d\rangle_J \f]
+ /// where the oscillator matrix elements come from Corr_Invr_Hydrogen.
+ /// Everything shared is made before the parallel part: the overlaps \f$ D_{Na} \f$ go in a matrix with one column per orbit,
+ /// and the Moshinsky brackets, 9j symbols and radial integrals which Corr_Invr_Hydrogen will ask for are put in their lists,
+ /// so that the parallel part only reads them. The (bra,ket) pairs of all channels are then one parallel loop.
+ /// The same oscillator matrix element turns up for every hydrogen n with the same l and j, so each thread
+ /// keeps its own memo of them.
  Operator CorrE2b_Hydrogen(ModelSpace& modelspace)
  {
    cout << "Entering Hydrogen two body." << endl;
@@ -3442,665 +3484,220 @@ Operator NumericalE2b(ModelSpace& modelspace)
    int n2max = 0;
    int l2max = 0;
    double tol = 1e-9;
-   double suma = 0;
-   double sumb = 0;
-   double sumc = 0;
-   double sumd = 0;
-   bool trunca = false;
-   bool truncb = false;
-   bool truncc = false;
-   bool truncd = false;
-   int nchan = modelspace.GetNumberTwoBodyChannels();
-   //modelspace.PreCalculateMoshinsky();
-   static map<unsigned long int,double> Mat_El_List;
-   //vector<unsigned long long int> local_mosh_list;
-   vector<int> local_D_list; // Int should be long enough
-   //vector<unsigned long long int> local_nineJ_list;
-   //vector<unsigned int> local_rad_list;
-   vector<unsigned long long int> local_mat_list;
-
-
-   cout << "About to estimate which constants are needed." << endl;
+   double Z = modelspace.GetTargetZ();
+   int norbits = modelspace.GetNumberOrbits();
 
-   // First loop; determines which constants to calculate
-   for (int ch=0; ch<nchan; ++ch)
+   // Oscillator matrix elements are labeled by the oscillator n's, and the l and j2 of the four orbits, and J.
+   // These are packed in bit fields: 7 bits for J and for each n, and for each orbit 5 bits for l
+   // and 1 bit for whether j2=2l+1.
+   auto mat_el_key = [](int Na, int Nb, int Nc, int Nd, Orbit& oa, Orbit& ob, Orbit& oc, Orbit& od, int J)
+   {
+     unsigned long long int key = J;
+     for (Orbit* o : {&od, &oc, &ob, &oa}) key = (key<<6) + (o->l<<1) + (o->j2>2*o->l ? 1 : 0);
+     for (int N : {Nd, Nc, Nb, Na}) key = (key<<7) + N;
+     return key;
+   };
+
+   vector<me_params> params_vec;
+   for (int ch : modelspace.SortedTwoBodyChannels)
    {
-      //cout << "In channel " << ch << endl;
       TwoBodyChannel& tbc = modelspace.GetTwoBodyChannel(ch);
       int nkets = tbc.GetNumberKets();
-      for (int ibra=0;ibra<nkets;++ibra)
+      for (int iket=0; iket<nkets; ++iket)
       {
-	 //cout << "In bra " << ibra << endl;
-         Ket & bra = tbc.GetKet(ibra);
-	 //if ( bra.op->n == bra.oq->n and bra.op->l == bra.oq->l and bra.op->j2 == bra.oq->j2 ) continue; // Pauli!
-         for (int iket=ibra;iket<nkets;++iket)
-         {
-	    //cout << "In ket " << iket << endl;
-            Ket & ket = tbc.GetKet(iket);
-	    //if ( ket.op->n == ket.oq->n and ket.op->l == ket.oq->l and ket.op->j2 == ket.oq->j2 ) continue; // Pauli!
-	    if (E.TwoBody.GetTBME(ch,ch,bra,ket) != 0 or E.TwoBody.GetTBME(ch,ch,ket,bra) != 0) continue;
-
-	    //cout << "About to start big loop." << endl;
-
-	    //#pragma omp parallel for // should check out generateMoshinsky to see how it is done.
-	    for (int Na = 0; Na <= nmax; Na++) // 46 because integral returns NaN for n > 46
-	    {
-		int ia = 1000*Na + 10*bra.op->n + bra.op->l;
-		#pragma omp critical
-		if ( std::find(local_D_list.begin(), local_D_list.end(), ia) == local_D_list.end() ) {
-		    //cout << "Setting Dna at " << ia << " total elements=" << local_D_list.size() << endl;
-
-		    local_D_list.emplace_back (ia);
-		}
-
-		//cout << "Getting Dna at " << ia << "=" << Dna << endl;
-		Orbit oa = Orbit(Na, bra.op->l, bra.op->j2, bra.op->tz2, bra.op->occ, bra.op->cvq, bra.op->index);
-		//if ( 2*Na + bra.op->l + 3./2 >= modelspace.GetTargetZ() * modelspace.GetTargetZ() * modelspace.GetHbarOmega()/(min(bra.oq->n,bra.op->n)^2)/2 ) continue; // Crazy energy. / from 2*(2N + l+...)=27.211 eV Z^2
-
-		for (int Nb = 0; Nb <= nmax; Nb++) // 46 because integral returns NaN for n > 46
-		{
-		    int ib = 1000*Nb + 10*bra.oq->n + bra.oq->l;
-		    #pragma omp critical
-		    if ( std::find(local_D_list.begin(), local_D_list.end(), ib) == local_D_list.end() ) {
-			//cout << "Setting Dnb at " << ib << " total elements=" << local_D_list.size() << endl;
-			local_D_list.emplace_back (ib);
-		    }
-
-		    Orbit ob = Orbit(Nb, bra.oq->l, bra.oq->j2, bra.oq->tz2, bra.oq->occ, bra.oq->cvq, bra.oq->index);
-		    //if ( 2*Na + bra.op->l + 3./2 + 2*Nb + bra.oq->l + 3./2 >= modelspace.GetTargetZ() * modelspace.GetTargetZ() * modelspace.GetHbarOmega()/(min(bra.oq->n,bra.op->n)^2)/2 ) continue; // Crazy energy.
-		    Ket brap = Ket(oa, ob);
-
-
-		    for (int Nc = 0; Nc <= nmax; Nc++) // 46 because integral returns NaN for n > 46
-		    {
-			int ic = 1000*Nc + 10*ket.op->n + ket.op->l;
-			#pragma omp critical
-			if ( std::find(local_D_list.begin(), local_D_list.end(), ic) == local_D_list.end() ) {
-			    //cout << "Setting Dnc at " << ic << " total elements=" << local_D_list.size() << endl;
-			    local_D_list.emplace_back (ic);
-			}
-
-			Orbit oc = Orbit(Nc, ket.op->l, ket.op->j2, ket.op->tz2, ket.op->occ, ket.op->cvq, ket.op->index);
-
-			//if ( 2*Nc + ket.op->l + 3./2 >= modelspace.GetTargetZ() * modelspace.GetTargetZ() * modelspace.GetHbarOmega()/(min(ket.oq->n,ket.op->n)^2)/2 ) continue; // Crazy energy.
-
-			for (int Nd = 0; Nd <= nmax; Nd++) // 46 because integral returns NaN for n > 46
-			{
-			    Orbit od = Orbit(Nd, ket.oq->l, ket.oq->j2, ket.oq->tz2, ket.oq->occ, ket.oq->cvq, ket.oq->index);
-			    int id = 1000*Nd + 10*ket.oq->n + ket.oq->l;
-			    //#pragma omp critical
-			    if ( std::find(local_D_list.begin(), local_D_list.end(), id) == local_D_list.end() ) {
-				//cout << "Setting Dnd at " << id << " total elements=" << local_D_list.size() << endl;
-				local_D_list.emplace_back (id);
-			    }
-
-			    //if ( od.j2 + oc.j2 != oa.j2 + ob.j2 ) continue; // cons of angular momentum.
-			    int n1, n2, n3, n4, l1, l2, l3, l4, j1, j2, j3, j4;
-			    int p = 1;
-
-			    if ( Na <= Nb ) {
-				n1 = Na;
-				n2 = Nb;
-				l1 = bra.op->l;
-				l2 = bra.oq->l;
-				j1 = bra.op->j2;
-				j2 = bra.oq->j2;
-			    } else {
-				n2 = Na;
-				n1 = Nb;
-				l2 = bra.op->l;
-				l1 = bra.oq->l;
-				j2 = bra.op->j2;
-				j1 = bra.oq->j2;
-			    }
-			    if ( Nc <= Nd ) {
-				n3 = Nc;
-				n4 = Nd;
-				l3 = ket.op->l;
-				l4 = ket.oq->l;
-				j3 = ket.op->j2;
-				j4 = ket.oq->j2;
-			    } else {
-				n4 = Nc;
-				n3 = Nd;
-				l4 = ket.op->l;
-				l3 = ket.oq->l;
-				j4 = ket.op->j2;
-				j3 = ket.oq->j2;
-			    }
-
-			    long long unsigned int index = n1*1 +
-							   n2*100 +
-							   n3*10000 +
-							   n4*1000000 +
-							   l1*100000000 +
-							   l2*1000000000 +
-							   l3*10000000000 +
-							   l4*100000000000 +
-							   j1*1000000000000 +
-							   j2*10000000000000 +
-							   j3*100000000000000 +
-							   j4*1000000000000000 + // Could probably figure out a better indexing function.
-							tbc.J*10000000000000000;
-
-			  /*  long long unsigned int index = Na*1 +
-							   Nb*100 +
-							   Nc*10000 +
-							   Nd*1000000 +
-						    bra.op->l*100000000 +
-						   bra.op->j2*1000000000 +
-						    bra.oq->l*10000000000 +
-						   bra.oq->j2*100000000000 +
-						    ket.op->l*1000000000000 +
-						   ket.op->j2*10000000000000 +
-						    ket.oq->l*100000000000000 +
-						   ket.oq->j2*1000000000000000 +// Could probably figure out a better indexing function.
-							tbc.J*10000000000000000; */
-
-			    //if ( index > local_mat_list.size() ) local_mat_list.resize(index);
-			    //if ( local_mat_list[index] != 0 ) continue;
-			    //if ( local_mat_list.find(index) == local_mat_list.end() ) continue;
-			    //#pragma omp critical
-			    if ( std::find(local_mat_list.begin(), local_mat_list.end(), index) == local_mat_list.end() ) {
-				//cout << "Lacking mat_el at " << index << " total elements=" << local_mat_list.size() << endl;
-				local_mat_list.emplace_back (index);
-			    } else {
-				continue;
-			    }
-
-			    //cout << "New Element, simulating Corr_Invr_Hydrogen." << endl;
-
-			    // About to start the effective Corr_Invr_Hydrogen function
-			    int la = bra.op->l;
-			    int lb = bra.oq->l;
-			    int lc = ket.op->l;
-			    int ld = ket.oq->l;
+         for (int jbra=0; jbra<=iket; ++jbra) params_vec.push_back( {ch,iket,jbra,tbc.J} );
+      }
+   }
 
-			    double ja = bra.op->j2/2.0;
-			    double jb = bra.oq->j2/2.0;
-			    double jc = ket.op->j2/2.0;
-			    double jd = ket.oq->j2/2.0;
+   cout << "About to estimate which constants are needed." << endl;
 
-			    int fab = 2*Na + 2*Nb + la + lb;
-			    int fcd = 2*Nc + 2*Nd + lc + ld;
+   vector<int> local_D_list; // Int should be long enough
+   for (int i=0; i<norbits; ++i)
+   {
+      Orbit& oi = modelspace.GetOrbit(i);
+      for (int N=0; N<=nmax; ++N)
+      {
+         int key = 1000*N + 10*oi.n + oi.l;
+         if ( std::find(local_D_list.begin(), local_D_list.end(), key) == local_D_list.end() ) local_D_list.push_back(key);
+      }
+   }
 
-			    double sa,sb,sc,sd;
-			    sa=sb=sc=sd=0.5;
-			    int J = tbc.J;
-			    // First, transform to LS coupling using 9j coefficients
-			    for (int Lab=abs(la-lb); Lab<= la+lb; ++Lab)
-			    {
-				for (int Sab=0; Sab<=1; ++Sab)
-				{
-				    if ( abs(Lab-Sab)>J or Lab+Sab<J) continue;
-				    /* unsigned long long int ninejkeyab = pow(100,8)*J
-								      + pow(100,7)*Sab
-								      + pow(100,6)*Lab
-								      + pow(100,5)*jb
-								      + pow(100,4)*sb
-								      + pow(100,3)*lb
-								      + pow(100,2)*ja
-								      + pow(100,1)*sa
-								      + pow(100,0)*la; */
-				    /* unsigned long long int ninejkeyab = getNineJkey( la,sa,ja, lb,sb,jb, Lab,Sab,J );
-				    if ( std::find(local_nineJ_list.begin(), local_nineJ_list.end(), ninejkeyab) == local_nineJ_list.end() ) {
-					//cout << "Setting 9-J with key=" << ninejkeyab << " total elements=" << local_nineJ_list.size() << endl;
-					#pragma omp critical
-					local_nineJ_list.emplace_back( ninejkeyab );
-				    } */
-				    //#pragma omp critical
-				    double nin1 = modelspace.GetNineJ(la, sa, ja, lb, sb, jb, Lab, Sab, J);
-				    if ( nin1 == 0 ) continue;
-       				    int Scd = Sab;
-				    int Lcd = Lab;
-				    /* unsigned long long int ninejkeycd = pow(100,8)*J
-								      + pow(100,7)*Scd
-								      + pow(100,6)*Lcd
-								      + pow(100,5)*jd
-								      + pow(100,4)*sd
-								      + pow(100,3)*ld
-								      + pow(100,2)*jc
-								      + pow(100,1)*sc
-								      + pow(100,0)*lc; */
-				    /* unsigned long long int ninejkeycd = getNineJkey( lc,sc,jc, ld,sd,jd, Lcd,Scd,J );
-				    if ( std::find(local_nineJ_list.begin(), local_nineJ_list.end(), ninejkeycd) == local_nineJ_list.end() ) {
-					//cout << "Setting 9-J with key=" << ninejkeycd << " total elements=" << local_nineJ_list.size() << endl;
-					#pragma omp critical
-					local_nineJ_list.emplace_back( ninejkeycd );
-				    } */
-				    //#pragma omp critical
-				    double nin2 = modelspace.GetNineJ(lc, sc, jc, ld, sd, jd, Lcd, Scd, J);
-				    if ( nin2 == 0 ) continue;
-				    for (int N_ab=1; N_ab<=fab/2; ++N_ab)  // N_ab = CoM n for a,b
-				    {
-					for (int Lam_ab=0; Lam_ab<= fab-2*N_ab; ++Lam_ab) // Lam_ab = CoM l for a,b
-					{
-					    int Lam_cd = Lam_ab; // tcm and trel conserve lam and Lam, ie relative and com orbital angular momentum
-					    for (int lam_ab=(fab-2*N_ab-Lam_ab)%2; lam_ab<= (fab-2*N_ab-Lam_ab); lam_ab+=2) // lam_ab = relative l for a,b
-					    {
-						if (Lab<abs(Lam_ab-lam_ab) or Lab>(Lam_ab+lam_ab) ) continue;
-						int lam_cd = lam_ab; // tcm and trel conserve lam and Lam
-						int n_ab = (fab - 2*N_ab-Lam_ab-lam_ab)/2; // n_ab is determined by energy conservation
-						if (n_ab < 0 or N_ab < 0) continue; // or lam_ab >= n_ab
-						/* unsigned long long int moshkey1 = pow(100,8)*N_ab
-										+ pow(100,7)*Lam_ab
-										+ pow(100,6)*n_ab
-										+ pow(100,5)*lam_ab
-										+ pow(100,4)*Na
-										+ pow(100,3)*la
-										+ pow(100,2)*Nb
-										+ pow(100,1)*lb
-										+ pow(100,0)*Lab; */
-						//cout << "N=" << N_ab << " Lam=" << Lam_ab << " n=" << n_ab << " lam=" << lam_ab << " n1=" << Na << " l1=" << la << " n2=" << Nb << " l2=" << lb << " L=" << Lab << endl;
-						//unsigned long long int moshkey1 = getMoshkey( N_ab,Lam_ab, n_ab,lam_ab, Na,la, Nb,lb, Lab );
-						//#pragma omp critical
-						double mosh_ab = modelspace.GetMoshinsky( N_ab,Lam_ab, n_ab,lam_ab, Na,la, Nb,lb, Lab );
-				                if ( abs(mosh_ab) < tol ) {
-						     //cout << "Mosh_ab too small, mosh_ab=" << mosh_ab << endl;
-						     continue;
-					        }
-						/* if ( std::find(local_mosh_list.begin(), local_mosh_list.end(), moshkey1 ) == local_mosh_list.end() ) {
-						    //cout << "Setting mosh with key=" << moshkey1 << " total elements=" << local_mosh_list.size() << endl;
-						    #pragma omp critical
-						    local_mosh_list.emplace_back( moshkey1 );
-						} */
-						//double mosh1 = modelspace.GetMoshinsky( N_ab, Lam_ab, n_ab, lam_ab, Na, la, Nb, lb, Lab );
-						for (int N_cd=max(0,N_ab-1); N_cd<=N_ab+1; ++N_cd) // N_cd = CoM n for c,d
-						{
-						    int n_cd = (fcd - 2*N_cd-Lam_cd-lam_cd)/2; // n_cd is determined by energy conservation
-						    //if ( n_ab == 14 and lam_ab == 3 ) cout << "n_ab=" << n_ab << endl;
-						    //if ( n_cd == 14 and lam_cd == 3 ) cout << "n_cd=" << n_cd << endl;
-						    if (n_cd < 0 or N_cd < 0) continue; // or lam_cd >= n_cd or
-						    /* unsigned long long int moshkey2 = pow(100,8)*N_cd
-										    + pow(100,7)*Lam_cd
-										    + pow(100,6)*n_cd
-										    + pow(100,5)*lam_cd
-										    + pow(100,4)*Nc
-										    + pow(100,3)*lc
-										    + pow(100,2)*Nd
-										    + pow(100,1)*ld
-										    + pow(100,0)*Lcd; */
-						    //cout << "N=" << N_cd << " Lam=" << Lam_cd << " n=" << n_cd << " lam=" << lam_cd << " n1=" << Nc << " l1=" << lc << " n2=" << Nd << " l2=" << ld << " L=" << Lcd << endl;
-						    //unsigned long long int moshkey2 = getMoshkey( N_cd,Lam_cd, n_cd,lam_cd, Nc,lc, Nd,ld, Lcd );
-						    //#pragma omp critical
-						    double mosh_cd = modelspace.GetMoshinsky( N_cd,Lam_cd, n_cd,lam_cd, Nc,lc, Nd,ld, Lcd);
-					            if ( abs(mosh_ab) < tol ) {
-							 //cout << "Mosh_ab too small, mosh_ab=" << mosh_ab << endl;
-							 continue;
-						    }
-						    /* if ( std::find(local_mosh_list.begin(), local_mosh_list.end(), moshkey2 ) == local_mosh_list.end() ) {
-							//cout << "Setting mosh with key=" << moshkey2 << " total elements=" << local_mosh_list.size() << endl;
-							#pragma omp critical
-							local_mosh_list.emplace_back( moshkey2 );
-						    } */
-						    //double mosh2 = modelspace.GetMoshinsky( N_cd, Lam_cd, n_cd, lam_cd, Nc, lc, Nd, ld, Lcd );
-						    //if ( 2*n_ab + lam_ab + 3./2 >= modelspace.GetTargetZ() * modelspace.GetTargetZ() * modelspace.GetHbarOmega()/2 ) continue; // Crazy energy.
-						    //if ( 2*n_cd + lam_cd + 3./2 >= modelspace.GetTargetZ() * modelspace.GetTargetZ() * modelspace.GetHbarOmega()/2 ) continue; // Crazy energy.
-						    //#pragma omp critical
-						    {
-						    unsigned long long int radkey = 0;
-							/* radkey = 1e6*n_ab
-								+ 1e2*lam_ab
-								+ 1e4*n_cd
-								+ lam_cd; */
-						    if ( n_ab < n_cd) {
-							radkey = 1e6*n_ab
-								+ 1e2*lam_ab
-								+ 1e4*n_cd
-								+ lam_cd;
-							n1max = max( n1max, n_ab );
-							l1max = max( l1max, lam_ab );
-							n2max = max( n2max, n_cd );
-							l2max = max( l2max, lam_cd );
-						    } else {
-							radkey = 1e6*n_cd
-								+ 1e2*lam_cd
-								+ 1e4*n_ab
-								+ lam_ab;
-							n2max = max( n2max, n_ab );
-							l2max = max( l2max, lam_ab );
-							n1max = max( n1max, n_cd );
-							l1max = max( l1max, lam_cd );
-						    }
-
-							int pmax = (lam_ab + lam_cd)/2 + n_ab + n_cd;
-							int q = (lam_ab + lam_cd)/2;
-							int kmax = min(max(n_ab,n_cd),pmax-q);
-							maxFact = max( maxFact, max( 2*pmax+1, max( n_ab, max( n_cd, max( n_cd, max( 2*n_ab + 2*lam_ab + 1, max( n_ab + lam_ab, n_cd + lam_cd ) ) ) ) ) ) );
-							maxFact = max( maxFact, max( kmax, max( 2*lam_ab+2*kmax+1, max( n_ab-kmax, max( n_cd, max( 2*pmax - lam_ab + lam_cd - 2*kmax + 1, pmax-q-kmax ) ) ) ) ) );
-						    }
-						    //long double rad = RadialIntegral(n_ab, lam_ab, n_cd, lam_cd, -1, modelspace);
-						    //modelspace.radList[ radkey ] = rad;
-						    /* if ( std::find(local_rad_list.begin(), local_rad_list.end(), radkey) == local_rad_list.end() ) {
-							//cout << "About to place radkey=" << radkey << " total elements=" << local_rad_list.size() << endl;
-							#pragma omp critical
-							local_rad_list.emplace_back( radkey );
-						    } // find rad */
-						} // N_cd
-					    } // lam_ab
-					} // Lam_ab
-				    } // N_ab
-				} // Sab
-			    } // Lab
-            		} // Nd
-		    } // Nc
-		} // Nb
-	    } // Na
-         } // iket
-      } // ibra
-   } // ch
+   // First pass; goes through the same Moshinsky and 9j loops as Corr_Invr_Hydrogen, once for each distinct
+   // oscillator matrix element, to fill their lists and find the largest factorial and radial integral needed.
+   unordered_set<unsigned long long int> local_mat_list;
+   for (auto& p : params_vec)
+   {
+      TwoBodyChannel& tbc = modelspace.GetTwoBodyChannel(p.ch);
+      Ket & bra = tbc.GetKet(p.jbra);
+      Ket & ket = tbc.GetKet(p.iket);
+      int la = bra.op->l;
+      int lb = bra.oq->l;
+      int lc = ket.op->l;
+      int ld = ket.oq->l;
+      double ja = bra.op->j2/2.0;
+      double jb = bra.oq->j2/2.0;
+      double jc = ket.op->j2/2.0;
+      double jd = ket.oq->j2/2.0;
+      double sa,sb,sc,sd;
+      sa=sb=sc=sd=0.5;
+      int J = p.tbcJ;
+      for (int Na=0; Na<=nmax; ++Na)
+      {
+       for (int Nb=0; Nb<=nmax; ++Nb)
+       {
+        for (int Nc=0; Nc<=nmax; ++Nc)
+        {
+         for (int Nd=0; Nd<=nmax; ++Nd)
+         {
+          if ( not local_mat_list.insert( mat_el_key(Na,Nb,Nc,Nd,*bra.op,*bra.oq,*ket.op,*ket.oq,J) ).second ) continue;
+          int fab = 2*Na + 2*Nb + la + lb;
+          int fcd = 2*Nc + 2*Nd + lc + ld;
+          for (int Lab=abs(la-lb); Lab<= la+lb; ++Lab)
+          {
+           for (int Sab=0; Sab<=1; ++Sab)
+           {
+            if ( abs(Lab-Sab)>J or Lab+Sab<J) continue;
+            if ( modelspace.GetNineJ(la, sa, ja, lb, sb, jb, Lab, Sab, J) == 0 ) continue;
+            int Scd = Sab;
+            int Lcd = Lab;
+            if ( modelspace.GetNineJ(lc, sc, jc, ld, sd, jd, Lcd, Scd, J) == 0 ) continue;
+            for (int N_ab=0; N_ab<=fab/2; ++N_ab)  // N_ab = CoM n for a,b
+            {
+             for (int Lam_ab=0; Lam_ab<= fab-2*N_ab; ++Lam_ab) // Lam_ab = CoM l for a,b
+             {
+              int Lam_cd = Lam_ab; // tcm and trel conserve lam and Lam, ie relative and com orbital angular momentum
+              for (int lam_ab=(fab-2*N_ab-Lam_ab)%2; lam_ab<= (fab-2*N_ab-Lam_ab); lam_ab+=2) // lam_ab = relative l for a,b
+              {
+               if (Lab<abs(Lam_ab-lam_ab) or Lab>(Lam_ab+lam_ab) ) continue;
+               int lam_cd = lam_ab; // tcm and trel conserve lam and Lam
+               int n_ab = (fab - 2*N_ab-Lam_ab-lam_ab)/2; // n_ab is determined by energy conservation
+               if (n_ab < 0) continue;
+               double mosh_ab = modelspace.GetMoshinsky( N_ab,Lam_ab, n_ab,lam_ab, Na,la, Nb,lb, Lab );
+               if ( abs(mosh_ab) < tol ) continue;
+               for (int N_cd=max(0,N_ab-1); N_cd<=N_ab+1; ++N_cd) // N_cd = CoM n for c,d
+               {
+                int n_cd = (fcd - 2*N_cd-Lam_cd-lam_cd)/2; // n_cd is determined by energy conservation
+                if (n_cd < 0) continue;
+                double mosh_cd = modelspace.GetMoshinsky( N_cd,Lam_cd, n_cd,lam_cd, Nc,lc, Nd,ld, Lcd);
+                if ( abs(mosh_cd) < tol ) continue;
+                n1max = max( n1max, min(n_ab,n_cd) );
+                n2max = max( n2max, max(n_ab,n_cd) );
+                l1max = max( l1max, n_ab < n_cd ? lam_ab : lam_cd );
+                l2max = max( l2max, n_ab < n_cd ? lam_cd : lam_ab );
+
+                int pmax = (lam_ab + lam_cd)/2 + n_ab + n_cd;
+                int q = (lam_ab + lam_cd)/2;
+                int kmax = min(max(n_ab,n_cd),pmax-q);
+                maxFact = max( maxFact, max( 2*pmax+1, max( n_ab, max( n_cd, max( 2*n_ab + 2*lam_ab + 1, max( n_ab + lam_ab, n_cd + lam_cd ) ) ) ) ) );
+                maxFact = max( maxFact, max( kmax, max( 2*lam_ab+2*kmax+1, max( n_ab-kmax, max( 2*pmax - lam_ab + lam_cd - 2*kmax + 1, pmax-q-kmax ) ) ) ) );
+               } // N_cd
+              } // lam_ab
+             } // Lam_ab
+            } // N_ab
+           } // Sab
+          } // Lab
+         } // Nd
+        } // Nc
+       } // Nb
+      } // Na
+   } // params_vec
 
    cout << "Constants estimated, calculating needed factorials." << endl;
 
    modelspace.GenerateFactorialList( maxFact );
 
-   cout << "Factorials calculated about to calculate mosh, D_coeff, 9-J, and Radial integrals." << endl;
-   //cout << "Number of Moshinsky = " << local_mosh_list.size() << endl;
+   cout << "Factorials calculated about to calculate D_coeff and Radial integrals." << endl;
    cout << "Number of D_coeff = " << local_D_list.size() << endl;
-   //cout << "Number of 9-J = " << local_nineJ_list.size() << endl;
-   //cout << "Number of Radial Integrals = " << local_rad_list.size() << endl;
+   cout << "Number of oscillator matrix elements = " << local_mat_list.size() << endl;
    cout << "n1max=" << n1max << " n2max=" << n2max << " l1max=" << l1max << " l2max=" << l2max << endl;
-   // Could set factorial list to have 9 threads, and rest to have 1, to ensure thread safety.
-  // #pragma omp parallel sections num_threads(4)
+   local_mat_list.clear();
+
+   modelspace.GenerateOsToHydroCoeff_fromlist( local_D_list );
+   // D(N,i) is the overlap of oscillator orbit N with hydrogen orbit i
+   arma::mat D(nmax+1, norbits);
+   for (int i=0; i<norbits; ++i)
    {
-	//#pragma omp section
-	//modelspace.PreCalculateMoshinsky_FromList( local_mosh_list );
-	// Should now destroy local_mosh_list to save memory
-
-	//#pragma omp section
-	modelspace.GenerateOsToHydroCoeff_fromlist( local_D_list );
-	local_D_list.resize(0);
-	// Should now destroy local_D_list to save memory
-
-	//#pragma omp section
-	//modelspace.PrecalculateNineJ( local_nineJ_list );
-	// Should now destroy local_ninej_list to save memory
-
-
-	cout << "About to Calculate Radial Intergrals." << endl;
-	//#pragma omp section
-	n1max = max(n1max, n2max)+1;
-	l1max = max(l1max, l2max)+2;
-	GenerateRadialIntegrals(modelspace,1e6*n1max+1e4*n1max+1e2*l1max+l1max);
-	//PrecalculateRad_fromList( local_rad_list, modelspace );
-	// Should now destroy local_rad_list to save memory
-	cout << "Radial integrals calculated, calculating matrix elements." << endl;
-
-	/* //#pragma omp section
-	for ( unsigned long long int i=0; i < local_mat_list.size(); i++ )
-	{
-	    unsigned long long int temp = local_mat_list[i];
-	    int na = temp%100;
-	    temp -= na;
-	    temp /= 100;
-	    int nb = temp%100;
-	    temp -= nb;
-	    temp /= 100;
-	    int nc = temp%100;
-	    temp -= nc;
-	    temp /= 100;
-	    int nd = temp%100;
-	    temp -= nd;
-	    temp /= 100;
-	    int la = temp%10;
-	    temp -= la;
-	    temp /= 10;
-	    int ja = temp%10;
-	    temp -= ja;
-	    temp /= 10;
-	    int lb = temp%10;
-	    temp -= lb;
-	    temp /= 10;
-	    int jb = temp%10;
-	    temp -= jb;
-	    temp /= 10;
-	    int lc = temp%10;
-	    temp -= lc;
-	    temp /= 10;
-	    int jc = temp%10;
-	    temp -= jc;
-	    temp /= 10;
-	    int ld = temp%10;
-	    temp -= ld;
-	    temp /= 10;
-	    int jd = temp%10;
-	    temp -= jd;
-	    temp /= 10;
-	    int J = temp%10;
-	   Orbit oa = Orbit( na, la, ja, -1, 0, 0, 0);
-	   Orbit ob = Orbit( nb, lb, jb, -1, 0, 0, 0);
-	   Orbit oc = Orbit( nc, lc, jc, -1, 0, 0, 0);
-	   Orbit od = Orbit( nd, ld, jd, -1, 0, 0, 0);
-	   Ket bra_ab = Ket( oa, ob );
-	   Ket ket_cd = Ket( oc, od );
-	   #pragma omp critical
-	   Mat_El_List[ local_mat_list[i] ] = Corr_Invr_Hydrogen(modelspace, bra_ab, ket_cd, J);
-	} */
+      Orbit& oi = modelspace.GetOrbit(i);
+      for (int N=0; N<=nmax; ++N) D(N,i) = modelspace.OsToHydroCoeffList.at( 1000*N + 10*oi.n + oi.l );
    }
 
-   cout << "Lists generated, moving to calculation." << endl;
+   cout << "About to Calculate Radial Intergrals." << endl;
+   n1max = max(n1max, n2max)+1;
+   l1max = max(l1max, l2max)+2;
+   GenerateRadialIntegrals(modelspace,1e6*n1max+1e4*n1max+1e2*l1max+l1max);
+   cout << "Radial integrals calculated, calculating matrix elements." << endl;
 
    // Actual Calculation.
-   //#pragma omp parallel for  //not thread safe if using Mat_El_List
-   for (int ch=0; ch<nchan; ++ch)
+   // The sums over each oscillator N are cut off once the energy in them, sum (2N+l+3/2) D^2, passes that of the hydrogen orbit.
+   vector<unordered_map<unsigned long long int,double>> memo( omp_get_max_threads() );
+   #pragma omp parallel for schedule(dynamic,1)
+   for (size_t i=0; i<params_vec.size(); ++i)
    {
-      //cout << "In channel " << ch << endl;
-      TwoBodyChannel& tbc = modelspace.GetTwoBodyChannel(ch);
-      int nkets = tbc.GetNumberKets();
-      for (int ibra=0;ibra<nkets;++ibra)
+      me_params& p = params_vec[i];
+      unordered_map<unsigned long long int,double>& local_List = memo[omp_get_thread_num()];
+      TwoBodyChannel& tbc = modelspace.GetTwoBodyChannel(p.ch);
+      Ket & bra = tbc.GetKet(p.jbra);
+      Ket & ket = tbc.GetKet(p.iket);
+      Orbit & o1 = *bra.op;
+      Orbit & o2 = *bra.oq;
+      Orbit & o3 = *ket.op;
+      Orbit & o4 = *ket.oq;
+      double mat_el = 0;
+      double suma = 0;
+      for (int Na = 0; Na <= nmax; Na++)
       {
-	 //cout << "In bra " << ibra << endl;
-         Ket & bra = tbc.GetKet(ibra);
-	 //if ( bra.op->n == bra.oq->n and bra.op->l == bra.oq->l and bra.op->j2 == bra.oq->j2 ) continue; // Pauli!
-         for (int iket=ibra;iket<nkets;++iket)
+         double Dna = D(Na,o1.index);
+         if ( abs(Dna) < tol ) continue;
+         suma += (2*Na + o1.l + 3/2)*pow(Dna,2);
+         if ( suma > Z/pow(o1.n,2) *0.5 ) break;
+         Orbit oa = Orbit(Na, o1.l, o1.j2, o1.tz2, o1.occ, o1.cvq, o1.index);
+         double sumb = 0;
+         for (int Nb = 0; Nb <= nmax; Nb++)
          {
-	    //cout << "In ket " << iket << endl;
-            Ket & ket = tbc.GetKet(iket);
-	    //if ( ket.op->n == ket.oq->n and ket.op->l == ket.oq->l and ket.op->j2 == ket.oq->j2 ) continue; // Pauli!
-	    if (E.TwoBody.GetTBME(ch,ch,bra,ket) != 0 or E.TwoBody.GetTBME(ch,ch,ket,bra) != 0) continue;
-	    double mat_el = 0;
-	    double result = 0;
-	    //cout << "About to start big loop." << endl;
-	    suma = 0;
-	    trunca = false;
-	    #pragma omp parallel for  // should check out generateMoshinsky to see how it is done.
-	    for (int Na = 0; Na <= nmax; Na++) // 46 because integral returns NaN for n > 46
-	    {
-		static unordered_map<unsigned long int,double> local_List;
-		int ia = 1000*Na + 10*bra.op->n + bra.op->l;
-		//cout << "Getting Dna@" << ia << endl;
-		double Dna = modelspace.OsToHydroCoeffList[ia];
-
-		Orbit oa = Orbit(Na, bra.op->l, bra.op->j2, bra.op->tz2, bra.op->occ, bra.op->cvq, bra.op->index);
-		//if ( 2*Na + bra.op->l + 3./2 >= modelspace.GetTargetZ() * modelspace.GetTargetZ() * modelspace.GetHbarOmega()/(min(bra.oq->n,bra.op->n)^2)/2 ) continue; // Crazy energy. /4 from 2*(2N + l+...)=27.211 eV Z^2/2
-		if ( abs(Dna) < tol ) {
-		    cout << "Dna too small; Dna=" << Dna << " at ia=" << ia << endl;
-		    continue;
-		}
-		suma += (2*Na + bra.op->l + 3/2)*pow(Dna,2);
-		if ( (suma > pow(modelspace.GetTargetZ(),1)/pow(bra.op->n,2) *0.5 ) ) {
-		    trunca = true;
-		    continue; // truncation boolean?
-		}
-		sumb = 0;
-		truncb = false;
-		for (int Nb = 0; Nb <= nmax and truncb == true ; Nb++) // 46 because integral returns NaN for n > 46
-		{
-		    int ib = 1000*Nb + 10*bra.oq->n + bra.oq->l;
-		    //cout << "Getting Dnb@" << ib << endl;
-		    double Dnb = modelspace.OsToHydroCoeffList[ib];
-
-		    Orbit ob = Orbit(Nb, bra.oq->l, bra.oq->j2, bra.oq->tz2, bra.oq->occ, bra.oq->cvq, bra.oq->index);
-		    //if ( 2*Na + bra.op->l + 3./2 + 2*Nb + bra.oq->l + 3./2 >= modelspace.GetTargetZ() * modelspace.GetTargetZ() * modelspace.GetHbarOmega()/(min(bra.oq->n,bra.op->n)^2)/2 ) continue; // Crazy energy.
-		    Ket brap = Ket(oa, ob);
-		    if ( abs(Dnb) < tol ) {
-			cout << "Dnb too small; Dnb=" << Dnb << " at ib=" << ib << endl;
-			continue;
-		    }
-		    sumb += (2*Nb + bra.oq->l + 3/2)*pow(Dnb,2);
-		    if ( (sumb > pow(modelspace.GetTargetZ(),1)/pow(bra.oq->n,2) *0.5 ) ) {
-			truncb = true;
-			continue; // truncation boolean?
-		    }
-		    sumc = 0;
-		    truncc = false;
-		    for (int Nc = 0; Nc <= nmax and truncc == true; Nc++) // 46 because integral returns NaN for n > 46
-		    {
-			int ic = 1000*Nc + 10*ket.op->n + ket.op->l;
-			//cout << "Getting Dnc@" << ic << endl;
-			double Dnc = modelspace.OsToHydroCoeffList[ic];
-
-			Orbit oc = Orbit(Nc, ket.op->l, ket.op->j2, ket.op->tz2, ket.op->occ, ket.op->cvq, ket.op->index);
-
-			//if ( 2*Nc + ket.op->l + 3./2 >= modelspace.GetTargetZ() * modelspace.GetTargetZ() * modelspace.GetHbarOmega()/(min(ket.oq->n,ket.op->n)^2)/2 ) continue; // Crazy energy.
-			if ( abs(Dnc) < tol ) {
-			    cout << "Dnc too small; Dnc=" << Dnc << " at ic=" << ic << endl;
-			    continue;
-			}
-			sumc += (2*Nc + ket.op->l + 3/2)*pow(Dnc,2);
-			if ( (sumc > pow(modelspace.GetTargetZ(),1)/pow(ket.op->n,2) *0.5 ) ) {
-			    truncc = true;
-			    continue; // truncation boolean?
-			}
-			sumd = 0;
-			truncd = false;
-			for (int Nd = 0; Nd <= nmax; Nd++) // 46 because integral returns NaN for n > 46
-			{
-			    int id = 1000*Nd + 10*ket.oq->n + ket.oq->l;
-			    //cout << "Getting Dnd@" << id << endl;
-			    double Dnd = modelspace.OsToHydroCoeffList[id];
-			    //cout << "Getting Dnd at " << id << "=" << Dnd << " Dnc@" << ic << "=" << Dnc << " Dnb@" << ib << "=" << Dnb << " Dna@" << ia << "=" << Dna << endl;
-			    if ( abs(Dnd) < tol ) {
-				cout << "Dnd too small; Dnd=" << Dnd << " at id=" << id << endl;
-				continue;
-			    }
-			    sumd += (2*Nd + ket.oq->l + 3/2)*pow(Dnd,2);
-			    if ( (sumd > pow(modelspace.GetTargetZ(),2)/pow(ket.oq->n,2) *0.5 ) ) {
-				truncd = true;
-				continue; // truncation boolean?
-			    }
-
-			    int n1, n2, n3, n4, l1, l2, l3, l4, j1, j2, j3, j4;
-			    if ( Na <= Nb ) {
-				n1 = Na;
-				n2 = Nb;
-				l1 = bra.op->l;
-				l2 = bra.oq->l;
-				j1 = bra.op->j2;
-				j2 = bra.oq->j2;
-			    } else {
-				n2 = Na;
-				n1 = Nb;
-				l2 = bra.op->l;
-				l1 = bra.oq->l;
-				j2 = bra.op->j2;
-				j1 = bra.oq->j2;
-			    }
-			    if ( Nc <= Nd ) {
-				n3 = Nc;
-				n4 = Nd;
-				l3 = ket.op->l;
-				l4 = ket.oq->l;
-				j3 = ket.op->j2;
-				j4 = ket.oq->j2;
-			    } else {
-				n4 = Nc;
-				n3 = Nd;
-				l4 = ket.op->l;
-				l3 = ket.oq->l;
-				j4 = ket.op->j2;
-				j3 = ket.oq->j2;
-			    }
-			   /* if ( n1 > n3 ) {
-				swap( n1, n3 );
-				swap( n2, n4 );
-				swap( l1, l3 );
-				swap( l2, l4 );
-				swap( j1, j3 );
-				swap( j2, j4 );
-			    } */
-			    long long unsigned int index = n1*1 +
-							   n2*100 +
-							   n3*10000 +
-							   n4*1000000 +
-							   l1*100000000 +
-							   l2*1000000000 +
-							   l3*10000000000 +
-							   l4*100000000000 +
-							   j1*1000000000000 +
-							   j2*10000000000000 +
-							   j3*100000000000000 +
-							   j4*1000000000000000 + // Could probably figure out a better indexing function.
-							tbc.J*10000000000000000;
-
-			  /*  long long unsigned int index = Na*1 +
-							   Nb*100 +
-							   Nc*10000 +
-							   Nd*1000000 +
-						    bra.op->l*100000000 +
-						   bra.op->j2*1000000000 +
-						    bra.oq->l*10000000000 +
-						   bra.oq->j2*100000000000 +
-						    ket.op->l*1000000000000 +
-						   ket.op->j2*10000000000000 +
-						    ket.oq->l*100000000000000 +
-						   ket.oq->j2*1000000000000000 +// Could probably figure out a better indexing function.
-							tbc.J*10000000000000000; */
-
-			    if ( Mat_El_List.find(index) != Mat_El_List.end() ) {
-				//cout << "Already found element, getting from list" << endl;
-				result = Mat_El_List[index];
-			    } else {
-				//cout << "Not in list, calculating." << endl;
-				Orbit od = Orbit(Nd, ket.oq->l, ket.oq->j2, ket.oq->tz2, ket.oq->occ, ket.oq->cvq, ket.oq->index);
-				//if ( od.j2 + oc.j2 != oa.j2 + ob.j2 ) continue; // cons of angular momentum.
-				//int osLmax = oc.l + od.l;
-				//int osLmin = abs(oc.l-od.l);
-				//if ( oa.l + ob.l > osLmax or abs(oa.l - ob.l) < osLmin ) continue; // Cons of Ang Mom. Should be taken care of in Kets, I think
-				//if ( 2*Nc + ket.op->l + 3./2 + 2*Nd + ket.oq->l + 3./2 >= modelspace.GetTargetZ() * modelspace.GetTargetZ() * modelspace.GetHbarOmega()/(min(ket.oq->n,ket.op->n)^2) )continue; // Crazy energy.
-			        Ket ketp = Ket(oc, od);
-				result = Corr_Invr_Hydrogen(modelspace, brap, ketp, tbc.J);
-				if ( std::isnan( result ) ) continue; // Should find a better way of dealing/avoiding with NaN results.
-				if ( abs(result) < tol ) {
-				    //cout << "Result too small, result = " << result << endl;
-				    continue;
-				}
-				#pragma omp critical
-				local_List[index] = result;
-			    }
-
-			    //result = Corr_Invr_Hydrogen(modelspace, brap, ketp, tbc.J);//Need to cache these.
-			    //cout << "Result=" << result << endl;
-			    /* if ( Dna*Dnb*Dnc*Dnd*result < 0 ) {
-				cout << "Negative result=" << result << endl;
-				cout << "Na=" << Na << " bra.op->n=" << bra.op->n << " bra.op->l=" << bra.op->l << " bra.op->j2=" << bra.op->j2 << endl;
-				cout << "Nb=" << Nb << " bra.oq->n=" << bra.oq->n << " bra.oq->l=" << bra.oq->l << " bra.oq->j2=" << bra.oq->j2 << endl;
-				cout << "Nc=" << Nc << " ket.op->n=" << ket.op->n << " ket.op->l=" << ket.op->l << " ket.op->j2=" << ket.op->j2 << endl;
-				cout << "Nd=" << Nd << " ket.oq->n=" << ket.oq->n << " ket.oq->l=" << ket.oq->l << " ket.oq->j2=" << ket.oq->j2 << endl;
-				cout << "Dna=" << Dna << " Dnb=" << Dnb << " Dnc=" << Dnc << " Dnd=" << Dnd << endl;
-			    } */
-			    mat_el += Dna*Dnb*Dnc*Dnd*result;
-			    //cout << "Mat_el=" << mat_el << endl;
-            		} // Nd
-		    } // Nc
-		} // Nb
-		#pragma omp critical
-		Mat_El_List.insert( local_List.begin(), local_List.end() );
-	    } // Na
-	    //if (abs(mat_el) >= 10) cout << "abs(mat_el) = " << mat_el << " at ibra=" << ibra << " iket=" << iket << " in ch=" << ch << endl;
-	    /* #pragma omp critical
-	    if ( mat_el < 0 ) {
-		cout << "Negative Mat_el for ibra=" << ibra << " iket=" << iket << " tbc.J=" << tbc.J << endl;
-		cout << "bra.op->n=" << bra.op->n << " bra.op->l=" << bra.op->l << " bra.op->j2=" << bra.op->j2 << endl;
-		cout << "bra.oq->n=" << bra.oq->n << " bra.oq->l=" << bra.oq->l << " bra.oq->j2=" << bra.oq->j2 << endl;
-		cout << "ket.op->n=" << ket.op->n << " ket.op->l=" << ket.op->l << " ket.op->j2=" << ket.op->j2 << endl;
-		cout << "ket.oq->n=" << ket.oq->n << " ket.oq->l=" << ket.oq->l << " ket.oq->j2=" << ket.oq->j2 << endl;
-	    } */
-	    //cout << "Mat_el=" << mat_el << endl;
-            E.TwoBody.SetTBME(ch,ch,ibra,iket,mat_el);
-            E.TwoBody.SetTBME(ch,ch,iket,ibra,mat_el);
-         }
-      }
+            double Dnb = D(Nb,o2.index);
+            if ( abs(Dnb) < tol ) continue;
+            sumb += (2*Nb + o2.l + 3/2)*pow(Dnb,2);
+            if ( sumb > Z/pow(o2.n,2) *0.5 ) break;
+            Orbit ob = Orbit(Nb, o2.l, o2.j2, o2.tz2, o2.occ, o2.cvq, o2.index);
+            Ket brap = Ket(oa, ob);
+            double sumc = 0;
+            for (int Nc = 0; Nc <= nmax; Nc++)
+            {
+               double Dnc = D(Nc,o3.index);
+               if ( abs(Dnc) < tol ) continue;
+               sumc += (2*Nc + o3.l + 3/2)*pow(Dnc,2);
+               if ( sumc > Z/pow(o3.n,2) *0.5 ) break;
+               Orbit oc = Orbit(Nc, o3.l, o3.j2, o3.tz2, o3.occ, o3.cvq, o3.index);
+               double sumd = 0;
+               for (int Nd = 0; Nd <= nmax; Nd++)
+               {
+                  double Dnd = D(Nd,o4.index);
+                  if ( abs(Dnd) < tol ) continue;
+                  sumd += (2*Nd + o4.l + 3/2)*pow(Dnd,2);
+                  if ( sumd > Z*Z/pow(o4.n,2) *0.5 ) break;
+
+                  unsigned long long int index = mat_el_key(Na,Nb,Nc,Nd,o1,o2,o3,o4,p.tbcJ);
+                  double result;
+                  auto it = local_List.find(index);
+                  if ( it != local_List.end() )
+                  {
+                     result = it->second;
+                  }
+                  else
+                  {
+                     Orbit od = Orbit(Nd, o4.l, o4.j2, o4.tz2, o4.occ, o4.cvq, o4.index);
+                     Ket ketp = Ket(oc, od);
+                     result = Corr_Invr_Hydrogen(modelspace, brap, ketp, p.tbcJ);
+                     if ( std::isnan( result ) or abs(result) < tol ) result = 0; // Should find a better way of dealing/avoiding with NaN results.
+                     local_List[index] = result;
+                  }
+                  mat_el += Dna*Dnb*Dnc*Dnd*result;
+               } // Nd
+            } // Nc
+         } // Nb
+      } // Na
+      E.TwoBody.SetTBME(p.ch,p.iket,p.jbra,mat_el);
+      E.TwoBody.SetTBME(p.ch,p.jbra,p.iket,mat_el);
    }
    E.profiler.timer["CorrE2b_Hydrogen"] += omp_get_wtime() - t_start;
    cout << "Exiting Hydrogen two body." << endl;
@@ -5214,6 +4811,100 @@ Operator FourierBesselCoeff(ModelSpace& modelspace, int nu, double R, vector<ind
 
 
 
+  // Fill op with matrix elements which only depend on the ModelSpace orbit and ket indices,
+  // so that they're the same whatever the order of the kets within the channels.
+  static void FillKetOrderingTestOperator(Operator& op, double seed)
+  {
+    ModelSpace* ms = op.GetModelSpace();
+    double herm = op.IsHermitian() ? 1 : op.IsAntiHermitian() ? -1 : 0;
+    auto value = [&](int i, int j, int J)
+    {
+      if (herm==0) return sin(seed + 0.37*i + 0.11*j + 0.5*J);
+      if (i==j) return herm>0 ? sin(seed + 0.48*i + 0.5*J) : 0.;
+      double sign = (i<j or herm>0) ? 1 : -1;
+      return sign * sin(seed + 0.37*min(i,j) + 0.11*max(i,j) + 0.5*J);
+    };
+    op.OneBody.zeros();
+    int norbits = ms->GetNumberOrbits();
+    for (int i=0; i<norbits; ++i)
+    {
+      Orbit& oi = ms->GetOrbit(i);
+      for (int j=0; j<norbits; ++j)
+      {
+        Orbit& oj = ms->GetOrbit(j);
+        if (oi.l==oj.l and oi.j2==oj.j2 and oi.tz2==oj.tz2) op.OneBody(i,j) = value(i,j,0);
+      }
+    }
+    for (int ch=0; ch<ms->GetNumberTwoBodyChannels(); ++ch)
+    {
+      TwoBodyChannel& tbc = ms->GetTwoBodyChannel(ch);
+      arma::mat& matrix = op.TwoBody.GetMatrix(ch,ch);
+      for (int ibra=0; ibra<tbc.GetNumberKets(); ++ibra)
+      {
+        for (int iket=0; iket<tbc.GetNumberKets(); ++iket)
+          matrix(ibra,iket) = value(tbc.GetKetIndex(ibra), tbc.GetKetIndex(iket), tbc.J);
+      }
+    }
+  }
+
+  /// Regression check for the order of the kets within the two-body channels (see TwoBodyChannel::Initialize()).
+  /// \f$ [X,Y] \f$ is computed for a hermitian X and an anti-hermitian and a non-hermitian Y, once with the kets
+  /// ordered by occupation class and once in plain ModelSpace order, and the largest difference between the
+  /// matrix elements of the two results is printed. Anything above roundoff means the commutators depend on the order.
+  /// Returns the largest difference.
+  double KetOrderingTest(int emax, string reference, string valence)
+  {
+    ModelSpace ms_sorted(emax, reference, valence);
+    TwoBodyChannel::order_kets_by_class = false;
+    ModelSpace ms_plain(emax, reference, valence);
+    TwoBodyChannel::order_kets_by_class = true;
+    ModelSpace* ms[2] = {&ms_sorted, &ms_plain};
+    vector<Operator> Z(4);
+    for (int iorder=0; iorder<2; ++iorder)
+    {
+      Operator X(*ms[iorder]);
+      Operator Ya(*ms[iorder]);
+      Operator Yn(*ms[iorder]);
+      X.SetHermitian();
+      Ya.SetAntiHermitian();
+      Yn.SetNonHermitian();
+      FillKetOrderingTestOperator(X, 0.1);
+      FillKetOrderingTestOperator(Ya, 0.2);
+      FillKetOrderingTestOperator(Yn, 0.3);
+      Z[2*iorder] = Commutator(X,Ya);
+      Z[2*iorder+1] = Commutator(X,Yn);
+    }
+    double maxdiff = 0;
+    for (int iy=0; iy<2; ++iy)
+    {
+      Operator& Z0 = Z[iy];
+      Operator& Z1 = Z[2+iy];
+      double diff = max( abs(Z0.ZeroBody-Z1.ZeroBody), arma::abs(Z0.OneBody-Z1.OneBody).max() );
+      for (int ch=0; ch<ms_sorted.GetNumberTwoBodyChannels(); ++ch)
+      {
+        TwoBodyChannel& tbc0 = ms_sorted.GetTwoBodyChannel(ch);
+        TwoBodyChannel& tbc1 = ms_plain.GetTwoBodyChannel(ch);
+        arma::mat& M0 = Z0.TwoBody.GetMatrix(ch,ch);
+        arma::mat& M1 = Z1.TwoBody.GetMatrix(ch,ch);
+        for (int ibra=0; ibra<tbc0.GetNumberKets(); ++ibra)
+        {
+          int ibra1 = tbc1.GetLocalIndex(tbc0.GetKetIndex(ibra));
+          for (int iket=0; iket<tbc0.GetNumberKets(); ++iket)
+          {
+            int iket1 = tbc1.GetLocalIndex(tbc0.GetKetIndex(iket));
+            diff = max(diff, abs(M0(ibra,iket)-M1(ibra1,iket1)));
+          }
+        }
+      }
+      cout << "Ket ordering test, " << (iy==0 ? "anti-hermitian" : "non-hermitian") << " Y:  norm of [X,Y] = " << Z0.Norm()
+           << "  max difference = " << diff << endl;
+      maxdiff = max(maxdiff, diff);
+    }
+    return maxdiff;
+  }
+
+
+
 /*
   void CommutatorTest(Operator& X, Operator& Y)
   {
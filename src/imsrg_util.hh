@@ -14,6 +14,7 @@
 #define M_NUCLEON 938.9185 // average nucleon mass in MeV
 #define M_ELECTRON 0.510998910 // electron mass in MeV; scale to eV?
 #define BOHR_RADIUS 0.0529 // Bohr Radius in nm
+#define ALPHA_FS (1./137.035999139) // fine-structure constant
 
 namespace imsrg_util
 {
@@ -130,6 +131,7 @@ namespace imsrg_util
  double GetEmbeddedTBME(Operator& op1, index_t i, index_t j, index_t k, index_t l, int Jbra,int Jket, int Lambda);
 
  void CommutatorTest(Operator& X, Operator& Y);
+ double KetOrderingTest(int emax, string reference, string valence);
  void Reduce(Operator&);
  void UnReduce(Operator&);
  /*
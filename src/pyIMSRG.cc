@@ -24,6 +24,8 @@ using namespace boost::python;
   int TBCGetLocalIndex(TwoBodyChannel& self, int p, int q){ return self.GetLocalIndex( p, q);};
 
   void ArmaMatPrint( arma::mat& self){ self.print();};
+  Operator OpBCH_Transform( Operator& self, const Operator& Omega){ return self.BCH_Transform(Omega);};
+  void OpSetToCommutator( Operator& self, const Operator& X, const Operator& Y){ self.SetToCommutator(X,Y);};
 
 BOOST_PYTHON_MODULE(pyIMSRG)
 {
@@ -112,10 +114,10 @@ BOOST_PYTHON_MODULE(pyIMSRG)
       .def("GetE3max", &Operator::GetE3max)
       .def("SetE3max", &Operator::SetE3max)
       .def("PrintTimes", &Operator::PrintTimes)
-      .def("BCH_Transform", &Operator::BCH_Transform)
+      .def("BCH_Transform", &OpBCH_Transform)
 //      .def("EraseThreeBody", &Operator::EraseThreeBody)
       .def("Size", &Operator::Size)
-      .def("SetToCommutator", &Operator::SetToCommutator)
+      .def("SetToCommutator", &OpSetToCommutator)
       .def("comm110ss", &Operator::comm110ss)
       .def("comm220ss", &Operator::comm220ss)
       .def("comm111ss", &Operator::comm111ss)
@@ -225,6 +227,7 @@ BOOST_PYTHON_MODULE(pyIMSRG)
       .def("GetOmega",&IMSRGSolver::GetOmega)
       .def("GetH_s",&IMSRGSolver::GetH_s,return_value_policy<reference_existing_object>())
       .def("SetMagnusAdaptive",&IMSRGSolver::SetMagnusAdaptive)
+      .def("SetPackOmegas",&IMSRGSolver::SetPackOmegas)
       .def_readwrite("Eta", &IMSRGSolver::Eta)
    ;
 
@@ -261,6 +264,7 @@ BOOST_PYTHON_MODULE(pyIMSRG)
    def("GetOccupations",   imsrg_util::GetOccupations);
    def("GetDensity",       imsrg_util::GetDensity);
    def("CommutatorTest",   imsrg_util::CommutatorTest);
+   def("KetOrderingTest",  imsrg_util::KetOrderingTest);
    def("Calculate_p1p2_all",   imsrg_util::Calculate_p1p2_all);
    def("Single_Ref_1B_Density_Matrix", imsrg_util::Single_Ref_1B_Density_Matrix);
    def("Get_Charge_Density", imsrg_util::Get_Charge_Density);
@@ -29,6 +29,9 @@ int main(int argc, char** argv)
   string denominator_delta_orbit = PAR.s("denominator_delta_orbit");
   string LECs = PAR.s("LECs");
   string scratch = PAR.s("scratch");
+  string symbol_cache = PAR.s("symbol_cache");
+  string checkpoint = PAR.s("checkpoint");
+  string resume = PAR.s("resume");
   string use_brueckner_bch = PAR.s("use_brueckner_bch");
   string valence_file_format = PAR.s("valence_file_format");
   string systemtype = PAR.s("systemtype");
@@ -39,6 +42,8 @@ int main(int argc, char** argv)
   int lmax3 = PAR.i("lmax3");
   int targetMass = PAR.i("A");
   int nsteps = PAR.i("nsteps");
+  int checkpoint_interval = PAR.i("checkpoint_interval");
+  int hf_diis_history = PAR.i("hf_diis_history");
   int file2e1max = PAR.i("file2e1max");
   int file2e2max = PAR.i("file2e2max");
   int file2lmax = PAR.i("file2lmax");
@@ -49,6 +54,7 @@ int main(int argc, char** argv)
   double hw = PAR.d("hw");
   double smax = PAR.d("smax");
   double ode_tolerance = PAR.d("ode_tolerance");
+  double commutator_screening_threshold = PAR.d("commutator_screening_threshold");
   double ds_max = PAR.d("ds_max");
   double ds_0 = PAR.d("ds_0");
   double domega = PAR.d("domega");
@@ -90,6 +96,8 @@ int main(int argc, char** argv)
   ReadWrite rw;
   rw.SetLECs_preset(LECs);
   rw.SetScratchDir(scratch);
+  if (symbol_cache != "none")
+    ModelSpace::LoadSymbolCache(symbol_cache);
   //string SystemType = systemtype==string::empty "atomic" : systemtype;
 
   string SystemType = "atomic";
@@ -141,6 +149,7 @@ int main(int argc, char** argv)
     Hbare.SetUseBruecknerBCH(true);
     cout << "Using Brueckner flavor of BCH" << endl;
   }
+  Hbare.Set_Commutator_Screening_Threshold(commutator_screening_threshold);
 
   cout << "Reading interactions..." << endl;
 
@@ -279,6 +288,7 @@ int main(int argc, char** argv)
 
   cout << "About to create hf(Hbare)" << endl;
   HartreeFock hf(Hbare);
+  hf.SetDIISHistory(hf_diis_history);
   hf.freeze_occupations = true;
   hf.Solve();
   cout << "Done solving HF." << endl;
@@ -469,6 +479,7 @@ int main(int argc, char** argv)
   if ( method == "HF" or method == "MP3")
   {
     hf.PrintSPE();
+    ModelSpace::WriteSymbolCache();
     Hbare.PrintTimes();
     return 0;
   }
@@ -493,14 +504,33 @@ int main(int argc, char** argv)
   if (denominator_delta_orbit != "none")
     imsrgsolver.SetDenominatorDeltaOrbit(denominator_delta_orbit);
 
-  if (nsteps > 1) // two-step decoupling, do core first
+  // If we're resuming, the checkpoint restores the generator, so we figure out which stage
+  // of the decoupling it was written in and skip the SetGenerator call for that stage.
+  bool resumed = false;
+  bool resume_valence = false;
+  if (checkpoint != "none")
   {
-    imsrgsolver.SetGenerator(core_generator);
+    imsrgsolver.SetCheckpointFile(checkpoint);
+    imsrgsolver.SetCheckpointInterval(checkpoint_interval);
+    if (resume == "true")
+      resumed = imsrgsolver.ReadCheckpoint(checkpoint);
+    if (resumed)
+    {
+      string gen = imsrgsolver.GetGenerator().GetType();
+      resume_valence = nsteps<=1 or (gen==valence_generator and (gen!=core_generator or imsrgsolver.GetS()>=smax));
+    }
+  }
+
+  if (nsteps > 1 and not resume_valence) // two-step decoupling, do core first
+  {
+    if (not resumed)
+      imsrgsolver.SetGenerator(core_generator);
     imsrgsolver.Solve();
-    if (method == "magnus") smax *= 2;
   }
+  if (nsteps > 1 and method == "magnus") smax *= 2;
   cout << "About to Set valence_generator." << endl;
-  imsrgsolver.SetGenerator(valence_generator);
+  if (not resume_valence)
+    imsrgsolver.SetGenerator(valence_generator);
   cout << "About to set smax." << endl;
   imsrgsolver.SetSmax(smax);
   cout << "About to Solve imsrg." << endl;
@@ -517,11 +547,10 @@ int main(int argc, char** argv)
   if (method == "magnus")
   {
     if (ops.size()>0) cout << "transforming operators" << endl;
+    imsrgsolver.TransformMany(ops);
     for (size_t i=0;i<ops.size();++i)
     {
-      cout << opnames[i] << " " << flush;
-      ops[i] = imsrgsolver.Transform(ops[i]);
-      cout << " (" << ops[i].ZeroBody << " ) " << endl; 
+      cout << opnames[i] << " (" << ops[i].ZeroBody << " ) " << endl; 
     }
     cout << endl;
     // increase smax in case we need to do additional steps
@@ -567,22 +596,27 @@ int main(int argc, char** argv)
     cout << "Doing NO wrt A=" << ms2.GetAref() << " Z=" << ms2.GetZref() << "  norbits = " << ms2.GetNumberOrbits() << endl;
     Hbare = Hbare.DoNormalOrdering();
 
+    imsrgsolver.SetCheckpointFile(""); // the checkpoint only covers the main decoupling
     imsrgsolver.SetHin(Hbare);
     imsrgsolver.SetEtaCriterion(1e-4);
     imsrgsolver.Solve();
     // Change operators to the new basis, then apply the rest of the transformation
     cout << "Final transformation on the operators..." << endl;
+    vector<double> ZeroBody_before, ZeroBody_undo, ZeroBody_mid;
     for (auto& op : ops)
     {
-      double ZeroBody_before = op.ZeroBody;
+      ZeroBody_before.push_back(op.ZeroBody);
       op = op.UndoNormalOrdering();
-      double ZeroBody_undo = op.ZeroBody;
+      ZeroBody_undo.push_back(op.ZeroBody);
       op.SetModelSpace(ms2);
       op = op.DoNormalOrdering();
-      double ZeroBody_mid = op.ZeroBody;
-      // transform using the remaining omegas
-      op = imsrgsolver.Transform_Partial(op,nOmega);
-      cout << ZeroBody_before << "   =>   " << ZeroBody_undo << "   =>   " << ZeroBody_mid<< "   =>   " << op.ZeroBody << endl;
+      ZeroBody_mid.push_back(op.ZeroBody);
+    }
+    // transform using the remaining omegas
+    imsrgsolver.TransformMany_Partial(ops,nOmega);
+    for (size_t i=0;i<ops.size();++i)
+    {
+      cout << ZeroBody_before[i] << "   =>   " << ZeroBody_undo[i] << "   =>   " << ZeroBody_mid[i] << "   =>   " << ops[i].ZeroBody << endl;
     }
   }
 
@@ -641,6 +675,7 @@ int main(int argc, char** argv)
 
  
  
+  ModelSpace::WriteSymbolCache();
   Hbare.PrintTimes();
   cout << "That's all, folks!" << endl;
   return 0;